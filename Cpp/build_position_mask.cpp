@@ -0,0 +1,85 @@
+// Builds a position mask (position_mask.h) from site lists and BED files, for
+// xie_unphased_vcf_for_heterozygote_stat --exclude and filter_bam --mask
+#include <iostream>
+#include <string>
+#include <vector>
+#include "position_mask.h"
+
+using namespace std;
+
+// Chromosomes, intervals and masked bases of a mask
+void PrintMaskSummary(const PositionMask &mask)
+{
+    vector<pair<string,uint32_t> > names(mask.index.begin(), mask.index.end());
+    uint64_t bases;
+    uint32_t i;
+
+    sort(names.begin(), names.end());
+    cout << "Chr\tIntervals\tMaskedBases\n";
+    for(const auto &name : names)
+    {
+        const PositionMaskChrom &chrom = mask.chroms[name.second];
+        bases = 0;
+        for(i=0; i<chrom.nintervals; i++)
+            bases += chrom.ends[i]-chrom.starts[i];
+        cout << name.first << "\t" << chrom.nintervals << "\t" << bases << "\n";
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    PositionMaskBuilder builder;
+    PositionMask mask;
+    string output,error;
+    bool ok;
+    int i;
+
+    ok = true;
+    for(i=1; i<argc && ok; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--sites" && i+1<argc)
+            ok = LoadMaskSites(builder, argv[++i], error);
+        else if(opt=="--bed" && i+1<argc)
+            ok = LoadMaskBed(builder, argv[++i], error);
+        else if(opt=="--summary" && i+1<argc)
+        {
+            if(!OpenPositionMask(argv[++i], mask, error))
+                ok = false;
+            else
+            {
+                PrintMaskSummary(mask);
+                ClosePositionMask(mask);
+                return 0;
+            }
+        }
+        else if(output=="" && opt.compare(0, 2, "--")!=0)
+            output = opt;
+        else
+        {
+            output = "";
+            break;
+        }
+    }
+    if(!ok)
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    if(output=="" || builder.intervals.empty())
+    {
+        cout << "Usage: " << argv[0] << " output.mask [--sites excluded.snps.list ...] [--bed regions.bed ...]\n";
+        cout << "       " << argv[0] << " --summary output.mask\n";
+        cout << "  --sites F     'chromosome position' lines with 1-based positions (vcftools --exclude-positions)\n";
+        cout << "  --bed F       BED intervals (0-based start, exclusive end), e.g. paralog or low-complexity regions\n";
+        cout << "  Both options can be repeated; all sites and intervals are merged into one mask.\n";
+        cout << "  --summary F   print the chromosomes, intervals and masked bases of the mask F\n";
+        return 0;
+    }
+    if(!WritePositionMask(builder, output))
+    {
+        cerr << "Error: could not write " << output << endl;
+        return 1;
+    }
+    return 0;
+}
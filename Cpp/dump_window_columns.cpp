@@ -0,0 +1,128 @@
+// Prints a binary window table written by xie_unphased_vcf_for_heterozygote_stat --binary as the
+// TSV the tool writes without --binary, or its columns and metadata with --schema
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "window_columns.h"
+
+using namespace std;
+
+void SplitNames(const string &text, vector<string> &names)
+{
+    size_t pos = 0,end;
+    while(pos<text.size())
+    {
+        end = text.find(',', pos);
+        if(end==string::npos)
+            end = text.size();
+        names.push_back(text.substr(pos, end-pos));
+        pos = end+1;
+    }
+}
+
+string ColumnName(const WindowColumnDesc &col)
+{
+    return string(col.name, strnlen(col.name, sizeof(col.name)));
+}
+
+const char *ColumnTypeName(uint32_t type)
+{
+    switch(type)
+    {
+        case COLUMN_INT32: return "int32";
+        case COLUMN_INT64: return "int64";
+        case COLUMN_FLOAT32: return "float32";
+        case COLUMN_DICT: return "dict";
+    }
+    return "unknown";
+}
+
+void PrintSchema(const WindowColumnsReader &reader)
+{
+    uint32_t i;
+    cout << "rows\t" << reader.header->nrows << "\n";
+    for(i=0; i<reader.header->ncols; i++)
+        cout << "column\t" << ColumnName(reader.columns[i]) << "\t" << ColumnTypeName(reader.columns[i].type) << "\t" << reader.columns[i].offset << "\n";
+    cout << reader.meta;
+}
+
+// Returns false when a dictionary index is out of range
+bool PrintRows(const WindowColumnsReader &reader)
+{
+    vector<string> hidden;
+    vector<uint32_t> shown;
+    uint64_t row;
+    uint32_t i,value;
+
+    SplitNames(WindowColumnsMeta(reader, "tsv_hidden"), hidden);
+    for(i=0; i<reader.header->ncols; i++)
+        if(find(hidden.begin(), hidden.end(), ColumnName(reader.columns[i]))==hidden.end())
+            shown.push_back(i);
+
+    cout << WindowColumnsMeta(reader, "tsv_header") << "\n";
+    for(row=0; row<reader.header->nrows; row++)
+    {
+        for(i=0; i<shown.size(); i++)
+        {
+            const void *data = WindowColumnData(reader, shown[i]);
+            if(i>0)
+                cout << "\t";
+            switch(reader.columns[shown[i]].type)
+            {
+                case COLUMN_INT32: cout << static_cast<const int32_t*>(data)[row]; break;
+                case COLUMN_INT64: cout << static_cast<const int64_t*>(data)[row]; break;
+                case COLUMN_FLOAT32: cout << static_cast<const float*>(data)[row]; break;
+                case COLUMN_DICT:
+                    value = static_cast<const uint32_t*>(data)[row];
+                    if(value>=reader.dict.size())
+                        return false;
+                    cout << reader.dict[value];
+                    break;
+            }
+        }
+        cout << "\n";
+    }
+    return true;
+}
+
+int main(int argc,char *argv[])
+{
+    WindowColumnsReader reader;
+    string filename,error;
+    bool schema;
+    int i;
+
+    schema = false;
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--schema")
+            schema = true;
+        else
+            filename = opt;
+    }
+    if(filename=="")
+    {
+        cout << "Usage: " << argv[0] << " windows.bin [--schema]\n";
+        cout << "  Prints the window statistics as TSV, or with --schema the columns and metadata of the file.\n";
+        return 0;
+    }
+    ios::sync_with_stdio(false);
+    if(!OpenWindowColumns(filename, reader, error))
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    if(schema)
+        PrintSchema(reader);
+    else if(!PrintRows(reader))
+    {
+        cerr << "Error: " << filename << " has a chromosome outside its dictionary" << endl;
+        CloseWindowColumns(reader);
+        return 1;
+    }
+    CloseWindowColumns(reader);
+    return 0;
+}
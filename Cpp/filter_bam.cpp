@@ -1,17 +1,401 @@
 #include <iostream>
+#include <sstream>
+#include <fstream>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_map>
 #include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <zlib.h>
 #include <htslib/sam.h>
 #include <htslib/hts.h>
+#include <htslib/thread_pool.h>
+#include <htslib/bgzf.h>
+#include "position_mask.h"
+#include "run_metrics.h"
+
+// --progress/--metrics 统计的阶段: read 为 sam_read1/sam_itr_next (BGZF 解压和记录解析), group 为按 qname 归组,
+// score 为计算得分和选择配对, write 为 sam_write1 和分片 BAM 的拼接 (BGZF 压缩和写出)。
+// 嵌套的计时 (坐标排序的输入在分组时选择配对) 只计入内层阶段; 按名称分组的输入在读取时即成组，group 为 0
+enum MetricsStage { STAGE_READ, STAGE_GROUP, STAGE_SCORE, STAGE_WRITE };
+const std::vector<std::string> METRICS_STAGES = {"read", "group", "score", "write"};
+
+inline int read_record(samFile *in, bam_hdr_t *header, bam1_t *aln) {
+    StageTimer timer(STAGE_READ);
+    return sam_read1(in, header, aln);
+}
+
+inline int read_record(samFile *in, hts_itr_t *iter, bam1_t *aln) {
+    StageTimer timer(STAGE_READ);
+    return sam_itr_next(in, iter, aln);
+}
+
+inline int write_record(samFile *out, bam_hdr_t *header, bam1_t *aln) {
+    StageTimer timer(STAGE_WRITE);
+    return sam_write1(out, header, aln);
+}
+
+// 一组 reads 的筛选结果，按写出顺序保存
+struct GroupOutput {
+    std::vector<bam1_t*> pass;
+    std::vector<bam1_t*> fail;
+};
+
+// 可复用的 bam1_t 缓冲池，read 组处理完后缓冲放回池中供后续记录使用，避免每条 read 都分配和释放内存
+class BamPool {
+public:
+    BamPool() = default;
+    BamPool(const BamPool&) = delete;
+    BamPool& operator=(const BamPool&) = delete;
+
+    ~BamPool() {
+        for (bam1_t *aln : free_) {
+            bam_destroy1(aln);
+        }
+    }
+
+    // 优先复用空闲缓冲，池为空时才新分配
+    bam1_t *acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++acquired_;
+        if (free_.empty()) {
+            ++allocations_;
+            return bam_init1();
+        }
+        bam1_t *aln = free_.back();
+        free_.pop_back();
+        return aln;
+    }
+
+    void release(bam1_t *aln) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(aln);
+    }
+
+    void release(const std::vector<bam1_t*> &alns) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.insert(free_.end(), alns.begin(), alns.end());
+    }
+
+    size_t allocations() const { return allocations_; }
+    size_t acquired() const { return acquired_; }
+
+private:
+    std::vector<bam1_t*> free_;
+    size_t allocations_ = 0;
+    size_t acquired_ = 0;
+    std::mutex mutex_;
+};
+
+// 从 name-sorted BAM 中逐组读取 reads，记录直接读入缓冲池的 bam1_t，read 名称原地比较
+class GroupReader {
+public:
+    GroupReader(samFile *in, bam_hdr_t *header, BamPool &pool) : in_(in), header_(header), pool_(pool) {}
+
+    // 读取下一组 read 名称相同的记录，文件结束时返回 false
+    bool next(std::vector<bam1_t*> &group) {
+        group.clear();
+        if (pending_ == nullptr && !read_next(pending_)) {
+            return false;
+        }
+        group.push_back(pending_);
+        pending_ = nullptr;
+
+        size_t group_bytes = sizeof(bam1_t) + group[0]->m_data;
+        bam1_t *aln;
+        while (read_next(aln)) {
+            if (strcmp(bam_get_qname(aln), bam_get_qname(group[0])) != 0) {
+                pending_ = aln;  // 属于下一组
+                break;
+            }
+            group.push_back(aln);
+            group_bytes += sizeof(bam1_t) + aln->m_data;
+        }
+
+        if (group.size() > peak_group_size_) peak_group_size_ = group.size();
+        if (group_bytes > peak_group_bytes_) peak_group_bytes_ = group_bytes;
+        return true;
+    }
+
+    size_t records() const { return records_; }
+    size_t data_growths() const { return data_growths_; }
+    size_t peak_group_size() const { return peak_group_size_; }
+    size_t peak_group_bytes() const { return peak_group_bytes_; }
+
+private:
+    bool read_next(bam1_t *&aln) {
+        if (eof_) {
+            return false;
+        }
+        aln = pool_.acquire();
+        uint32_t m_data = aln->m_data;
+        if (read_record(in_, header_, aln) < 0) {
+            pool_.release(aln);
+            eof_ = true;
+            return false;
+        }
+        if (aln->m_data != m_data) {
+            ++data_growths_;  // 缓冲不够大，htslib 重新分配了数据区
+        }
+        ++records_;
+        CountItems(1);
+        return true;
+    }
+
+    samFile *in_;
+    bam_hdr_t *header_;
+    BamPool &pool_;
+    bam1_t *pending_ = nullptr;
+    bool eof_ = false;
+    size_t records_ = 0;
+    size_t data_growths_ = 0;
+    size_t peak_group_size_ = 0;
+    size_t peak_group_bytes_ = 0;
+};
+
+// 一条 read 参与配对和打分所需的信息，每组只从 bam1_t 中提取一次
+struct ReadScore {
+    int32_t tid;
+    int32_t pos;
+    int32_t isize;
+    uint8_t mapq;
+    bool reverse;
+    int nm;     // NM 标签，即 SNP 数量
+    int indel;  // CIGAR 中的插入和缺失数量
+};
+
+// 组内一对合适配对的下标，candidate 表示其 SNP 和 Indel 数量未超过阈值
+struct MatePair {
+    int32_t first;
+    int32_t second;
+    bool candidate;
+};
+
+// 组内配对引擎，缓冲区在组之间复用，每个线程使用各自的实例
+class GroupEngine {
+public:
+    void run(const std::vector<ReadScore> &scores, int max_insert_size, int max_snp, int max_indel);
+
+    std::vector<bam1_t*> &accepted() { return accepted_; }  // 通过过滤表达式的 reads，与 scores() 一一对应
+    std::vector<ReadScore> &scores() { return scores_; }
+    const std::vector<MatePair> &pairs() const { return pairs_; }
+    int best() const { return best_; }  // 最佳配对在 pairs() 中的下标，没有时为 -1
+    bool is_selected(size_t i) const { return (selected_[i >> 6] >> (i & 63)) & 1; }
+
+private:
+    void set_selected(size_t i) { selected_[i >> 6] |= uint64_t(1) << (i & 63); }
+
+    std::vector<bam1_t*> accepted_;
+    std::vector<ReadScore> scores_;
+    std::vector<int32_t> order_;
+    std::vector<MatePair> pairs_;
+    std::vector<MatePair> candidates_;
+    std::vector<size_t> candidate_pair_index_;
+    std::vector<uint64_t> selected_;  // 已写入 pass 文件的 reads 的位向量
+    int best_ = -1;
+};
+
+// 逐 read 日志的详细程度: off 不输出，summary 只在结束时输出汇总统计，sampled 另外按 read 名称抽样输出
+// 部分组的详细日志，full 输出所有组的详细日志
+enum class LogLevel { off, summary, sampled, full };
+
+// 分组之前按 core 字段快速剔除 reads 的过滤表达式，例如 mapq>=20 && !secondary && abs(isize)<=1000。
+// 表达式只编译一次，得到后缀形式的指令序列，每条 read 只需在一个定长栈上顺序执行
+class RecordFilter {
+public:
+    enum Field { mapq, flag, tid, pos, mtid, mpos, isize, flag_bit };
+    enum Op { push_const, push_field, op_not, op_neg, op_abs, op_band, op_add, op_sub,
+              op_lt, op_le, op_gt, op_ge, op_eq, op_ne, op_and, op_or };
+
+    // 编译表达式；语法错误时返回 false 并在 error 中给出原因。空表达式接受所有 reads
+    bool compile(const std::string &expr, std::string &error);
+
+    bool empty() const { return code_.empty(); }
+
+    bool accept(const bam1_core_t &core) const {
+        if (code_.empty()) {
+            return true;
+        }
+        int64_t stack[max_depth];
+        int top = -1;
+        for (const Instruction &ins : code_) {
+            switch (ins.op) {
+            case push_const: stack[++top] = ins.value; break;
+            case push_field: stack[++top] = field(core, ins.field, ins.value); break;
+            case op_not: stack[top] = !stack[top]; break;
+            case op_neg: stack[top] = -stack[top]; break;
+            case op_abs: stack[top] = stack[top] < 0 ? -stack[top] : stack[top]; break;
+            case op_band: --top; stack[top] &= stack[top + 1]; break;
+            case op_add: --top; stack[top] += stack[top + 1]; break;
+            case op_sub: --top; stack[top] -= stack[top + 1]; break;
+            case op_lt: --top; stack[top] = stack[top] < stack[top + 1]; break;
+            case op_le: --top; stack[top] = stack[top] <= stack[top + 1]; break;
+            case op_gt: --top; stack[top] = stack[top] > stack[top + 1]; break;
+            case op_ge: --top; stack[top] = stack[top] >= stack[top + 1]; break;
+            case op_eq: --top; stack[top] = stack[top] == stack[top + 1]; break;
+            case op_ne: --top; stack[top] = stack[top] != stack[top + 1]; break;
+            case op_and: --top; stack[top] = stack[top] && stack[top + 1]; break;
+            case op_or: --top; stack[top] = stack[top] || stack[top + 1]; break;
+            }
+        }
+        return stack[0] != 0;
+    }
+
+private:
+    static const int max_depth = 32;
+
+    struct Instruction {
+        Op op;
+        Field field;
+        int64_t value;
+    };
+
+    static int64_t field(const bam1_core_t &core, Field f, int64_t bit) {
+        switch (f) {
+        case mapq: return core.qual;
+        case flag: return core.flag;
+        case tid: return core.tid;
+        case pos: return core.pos;
+        case mtid: return core.mtid;
+        case mpos: return core.mpos;
+        case isize: return core.isize;
+        case flag_bit: return (core.flag & bit) != 0;
+        }
+        return 0;
+    }
+
+    class Parser;
+    std::vector<Instruction> code_;
+};
+
+// 命令行给定的筛选参数
+struct FilterOptions {
+    int mapQ_threshold = 0;
+    int max_insert_size = 0;
+    int max_snp = 0;
+    int max_indel = 0;
+    LogLevel log_level = LogLevel::summary;
+    size_t log_sample = 10000;  // sampled 时每 log_sample 组输出一组
+    RecordFilter filter;        // 不满足条件的 reads 不参与配对，直接输出到 fail 文件
+    const PositionMask *mask = nullptr;              // --mask: 与屏蔽区间重叠的 reads 同样直接输出到 fail 文件
+    std::vector<const PositionMaskChrom*> mask_tids; // 屏蔽区间按输入 header 的 tid 排列，由 bind_mask 填写
+};
+
+// 按 header 中的染色体名称查找各 tid 的屏蔽区间
+void bind_mask(FilterOptions &options, const bam_hdr_t *header) {
+    options.mask_tids.assign(header->n_targets, nullptr);
+    for (int32_t tid = 0; tid < header->n_targets; ++tid) {
+        options.mask_tids[tid] = FindMaskChrom(*options.mask, header->target_name[tid]);
+    }
+}
+
+// 读取输入文件的 header 并绑定屏蔽区间，没有 --mask 时直接返回
+bool bind_mask(FilterOptions &options, const char *input_bam) {
+    if (options.mask == nullptr) {
+        return true;
+    }
+    samFile *in = sam_open(input_bam, "rb");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : nullptr;
+    if (header == nullptr) {
+        std::cerr << "Error: could not read BAM header from " << input_bam << "\n";
+        if (in) sam_close(in);
+        return false;
+    }
+    bind_mask(options, header);
+    bam_hdr_destroy(header);
+    sam_close(in);
+    return true;
+}
+
+// 比对区间 [pos, endpos) 中有被屏蔽的位置
+inline bool is_masked(const FilterOptions &options, const bam1_t *aln) {
+    if (options.mask == nullptr || (aln->core.flag & BAM_FUNMAP) || aln->core.tid < 0 || (size_t)aln->core.tid >= options.mask_tids.size()) {
+        return false;
+    }
+    const PositionMaskChrom *chrom = options.mask_tids[aln->core.tid];
+    return chrom != nullptr && IsMaskedInterval(*chrom, aln->core.pos, bam_endpos(aln));
+}
+
+// 等宽分箱的直方图，超出范围的值计入最后一箱
+class Histogram {
+public:
+    Histogram(int bin_width, int bins) : bin_width_(bin_width), counts_(bins + 1, 0) {}
+
+    void add(int64_t value) {
+        size_t bin = value < 0 ? 0 : value / bin_width_;
+        ++counts_[std::min(bin, counts_.size() - 1)];
+    }
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+    }
+
+    // 每个非空的箱输出一行: 名称、箱的下界（最后一箱加 +）、计数
+    void write(std::ostream &out, const char *name) const {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            if (counts_[i] > 0) {
+                out << name << "\t" << i * bin_width_ << (i + 1 == counts_.size() ? "+" : "") << "\t" << counts_[i] << "\n";
+            }
+        }
+    }
+
+private:
+    int bin_width_;
+    std::vector<uint64_t> counts_;
+};
+
+// 按失败原因分类的计数，以及组大小、NM 和插入片段长度的分布，结束时输出为一张 TSV 表
+struct FilterStats {
+    uint64_t groups = 0;
+    uint64_t records = 0;
+    uint64_t rejected = 0;               // 被过滤表达式剔除的 reads，不计入 records
+    uint64_t masked = 0;                 // 与 --mask 区间重叠而剔除的 reads，不计入 records
+    uint64_t pass_pairs = 0;
+    uint64_t proper_pairs = 0;           // 找到的合适配对
+    uint64_t pairs_over_threshold = 0;   // SNP 或 Indel 数量超过阈值的合适配对
+    uint64_t fail_unpaired = 0;          // 组内只有一条 read
+    uint64_t fail_no_proper_pair = 0;    // 组内没有合适配对
+    uint64_t fail_over_threshold = 0;    // 组内所有合适配对都超过阈值
+    uint64_t fail_not_best_pair = 0;     // 组内有其他配对被选中
+    Histogram group_size{1, 64};
+    Histogram nm{1, 64};
+    Histogram insert_size{10, 200};
+
+    void add_group(const std::vector<ReadScore> &scores, const GroupEngine &engine);
+    void merge(const FilterStats &other);
+    void write(std::ostream &out) const;
+};
 
 // 函数声明
 int get_snp_count(bam1_t *aln);
 int get_indel_count(bam1_t *aln);
 bool is_proper_pair(bam1_t *aln1, bam1_t *aln2, int max_insert_size);
-std::pair<bam1_t*, bam1_t*> choose_best_pair(const std::vector<std::pair<bam1_t*, bam1_t*>>& candidate_pairs);
-void process_read_group(std::vector<bam1_t*>& current_group, int mapQ_threshold, int max_insert_size, int max_snp, int max_indel,
-                        samFile *out_pass, samFile *out_fail, bam_hdr_t *header, int &processed_pairs);
+ReadScore make_read_score(bam1_t *aln);
+int choose_best_pair(const std::vector<ReadScore>& scores, const std::vector<MatePair>& candidate_pairs);
+void log_group(std::ostream &log, const char *qname, const std::vector<ReadScore> &scores, const GroupEngine &engine);
+void report_group(const FilterOptions &options, FilterStats &stats, std::ostream &log, const char *qname,
+                  const std::vector<ReadScore> &scores, const GroupEngine &engine);
+void process_read_group(std::vector<bam1_t*>& current_group, const FilterOptions &options, GroupEngine &engine,
+                        GroupOutput &out, FilterStats &stats, std::ostream &log, int &processed_pairs);
+void write_group_output(GroupOutput &out, samFile *out_pass, samFile *out_fail, bam_hdr_t *header, BamPool &pool);
 void clean_up_resources(bam1_t *aln, samFile *in, samFile *out_pass, samFile *out_fail, bam_hdr_t *header);
 
 // 计算 SNP 数量
@@ -56,7 +440,6 @@ bool is_proper_pair(bam1_t *aln1, bam1_t *aln2, int max_insert_size) {
             bool strand1 = aln1->core.flag & BAM_FREVERSE;
             bool strand2 = aln2->core.flag & BAM_FREVERSE;
             if (strand1 != strand2) {
-                std::cout << "Proper pair detected: " << bam_get_qname(aln1) << " and " << bam_get_qname(aln2) << "\n";
                 return true;
             }
         }
@@ -65,257 +448,2098 @@ bool is_proper_pair(bam1_t *aln1, bam1_t *aln2, int max_insert_size) {
     return false;
 }
 
-// 选择得分最高的配对
-std::pair<bam1_t*, bam1_t*> choose_best_pair(const std::vector<std::pair<bam1_t*, bam1_t*>>& candidate_pairs) {
-    if (candidate_pairs.empty()) {
-        return {nullptr, nullptr};  // 没有候选配对
+// 过滤表达式的递归下降解析器，按优先级从低到高:
+//   ||  &&  比较运算 (< <= > >= == !=)  &  + -  一元运算 (! - abs())
+// 字段: mapq flag tid pos mtid mpos isize，以及标志位 paired proper unmapped munmap reverse mreverse
+// read1 read2 secondary qcfail duplicate supplementary (取值 0 或 1)
+class RecordFilter::Parser {
+public:
+    Parser(const std::string &expr, std::vector<Instruction> &code) : s_(expr), code_(code) {}
+
+    bool parse(std::string &error) {
+        skip_space();
+        if (!parse_or() || (skip_space(), p_ != s_.size())) {
+            if (error_.empty()) error_ = "unexpected '" + s_.substr(p_) + "'";
+            error = error_;
+            return false;
+        }
+        return true;
     }
 
-    std::pair<bam1_t*, bam1_t*> best_pair = candidate_pairs[0];
-    int best_score = -1;
+    int max_depth() const { return max_depth_; }
 
-    for (const auto& pair : candidate_pairs) {
-        bam1_t* aln1 = pair.first;
-        bam1_t* aln2 = pair.second;
+private:
+    void skip_space() {
+        while (p_ < s_.size() && isspace(static_cast<unsigned char>(s_[p_]))) ++p_;
+    }
 
-        // 计算配对的得分
-        int mapq1 = aln1->core.qual;
-        int mapq2 = aln2->core.qual;
-        int snp1 = get_snp_count(aln1);
-        int snp2 = get_snp_count(aln2);
-        int indel1 = get_indel_count(aln1);
-        int indel2 = get_indel_count(aln2);
+    // 匹配运算符 tok，不把 && 的前半部分当作 &，也不把 <= 当作 <
+    bool accept(const char *tok) {
+        skip_space();
+        size_t n = strlen(tok);
+        if (s_.compare(p_, n, tok) != 0) return false;
+        if (n == 1 && p_ + 1 < s_.size()) {
+            char next = s_[p_ + 1];
+            if ((tok[0] == '&' && next == '&') || (tok[0] == '|' && next == '|') ||
+                ((tok[0] == '<' || tok[0] == '>' || tok[0] == '!') && next == '=')) return false;
+        }
+        p_ += n;
+        return true;
+    }
 
-        // 打分规则: MAPQ 越高得分越高，SNP 和 Indel 越少得分越高
-        int score = mapq1 + mapq2 - (snp1 + snp2 + indel1 + indel2);
+    void emit(Op op, Field field = mapq, int64_t value = 0) {
+        code_.push_back({op, field, value});
+        if (op == push_const || op == push_field) {
+            if (++depth_ > max_depth_) max_depth_ = depth_;
+        } else if (op != op_not && op != op_neg && op != op_abs) {
+            --depth_;
+        }
+    }
 
-        // 找到得分最高的配对
-        if (score > best_score) {
-            best_score = score;
-            best_pair = pair;
+    bool parse_or() {
+        if (!parse_and()) return false;
+        while (accept("||")) {
+            if (!parse_and()) return false;
+            emit(op_or);
         }
+        return true;
     }
 
-    return best_pair;  // 返回得分最高的配对
-}
+    bool parse_and() {
+        if (!parse_compare()) return false;
+        while (accept("&&")) {
+            if (!parse_compare()) return false;
+            emit(op_and);
+        }
+        return true;
+    }
 
+    bool parse_compare() {
+        if (!parse_bit_and()) return false;
+        static const std::pair<const char*, Op> ops[] = {
+            {"<=", op_le}, {">=", op_ge}, {"==", op_eq}, {"!=", op_ne}, {"<", op_lt}, {">", op_gt}};
+        for (const auto &op : ops) {
+            if (accept(op.first)) {
+                if (!parse_bit_and()) return false;
+                emit(op.second);
+                break;
+            }
+        }
+        return true;
+    }
 
-// 处理一组 reads 并选择得分最高的位置
-void process_read_group(std::vector<bam1_t*>& current_group, int mapQ_threshold, int max_insert_size, int max_snp, int max_indel,
-                        samFile *out_pass, samFile *out_fail, bam_hdr_t *header, int &processed_pairs) {
-    std::unordered_set<int> processed_set;  // 使用索引存储已处理的 reads
-    std::vector<std::pair<bam1_t*, bam1_t*>> candidate_pairs;
+    bool parse_bit_and() {
+        if (!parse_sum()) return false;
+        while (accept("&")) {
+            if (!parse_sum()) return false;
+            emit(op_band);
+        }
+        return true;
+    }
 
-    if (current_group.size() < 2) {
-        std::cout << "----- Current group size < 2, no pairs to process.\n";
-        
-        // 对于 size < 2 的情况，直接输出到 fail 文件
-        for (bam1_t* aln : current_group) {
-            int snp = get_snp_count(aln);
-            int indel = get_indel_count(aln);
+    bool parse_sum() {
+        if (!parse_unary()) return false;
+        for (;;) {
+            Op op;
+            if (accept("+")) op = op_add;
+            else if (accept("-")) op = op_sub;
+            else return true;
+            if (!parse_unary()) return false;
+            emit(op);
+        }
+    }
 
-            // 记录日志
-            std::cout << "Fail: Unpaired read: " << bam_get_qname(aln) << "\n";
-            std::cout << "Chromosome position: " << aln->core.tid << ":" << aln->core.pos 
-                      << ", SNPs: " << snp << ", Indels: " << indel << "\n";
+    bool parse_unary() {
+        if (accept("!")) {
+            if (!parse_unary()) return false;
+            emit(op_not);
+            return true;
+        }
+        if (accept("-")) {
+            if (!parse_unary()) return false;
+            emit(op_neg);
+            return true;
+        }
+        return parse_primary();
+    }
 
-            // 输出到 fail 文件
-            if (sam_write1(out_fail, header, aln) < 0) {
-                std::cerr << "Error: could not write unpaired read to fail BAM\n";
-                exit(1);
+    bool parse_primary() {
+        skip_space();
+        if (accept("(")) {
+            if (!parse_or()) return false;
+            if (!accept(")")) {
+                error_ = "missing ')'";
+                return false;
             }
+            return true;
         }
-
-        // 清理当前组
-        for (auto aln_ptr : current_group) {
-            bam_destroy1(aln_ptr);
+        if (p_ < s_.size() && isdigit(static_cast<unsigned char>(s_[p_]))) {
+            size_t used = 0;
+            int64_t value = std::stoll(s_.substr(p_), &used, s_.compare(p_, 2, "0x") == 0 ? 16 : 10);
+            p_ += used;
+            emit(push_const, mapq, value);
+            return true;
         }
-        current_group.clear();
-        return;
+        size_t begin = p_;
+        while (p_ < s_.size() && (isalnum(static_cast<unsigned char>(s_[p_])) || s_[p_] == '_')) ++p_;
+        std::string name = s_.substr(begin, p_ - begin);
+        if (name.empty()) {
+            error_ = p_ < s_.size() ? "unexpected '" + s_.substr(p_) + "'" : "unexpected end of expression";
+            return false;
+        }
+        if (name == "abs") {
+            if (!accept("(") || !parse_or() || !accept(")")) {
+                if (error_.empty()) error_ = "abs() takes one argument in parentheses";
+                return false;
+            }
+            emit(op_abs);
+            return true;
+        }
+        static const std::pair<const char*, Field> fields[] = {
+            {"mapq", mapq}, {"flag", flag}, {"tid", tid}, {"pos", pos},
+            {"mtid", mtid}, {"mpos", mpos}, {"isize", isize}};
+        for (const auto &f : fields) {
+            if (name == f.first) {
+                emit(push_field, f.second);
+                return true;
+            }
+        }
+        static const std::pair<const char*, int> bits[] = {
+            {"paired", BAM_FPAIRED}, {"proper", BAM_FPROPER_PAIR}, {"unmapped", BAM_FUNMAP},
+            {"munmap", BAM_FMUNMAP}, {"reverse", BAM_FREVERSE}, {"mreverse", BAM_FMREVERSE},
+            {"read1", BAM_FREAD1}, {"read2", BAM_FREAD2}, {"secondary", BAM_FSECONDARY},
+            {"qcfail", BAM_FQCFAIL}, {"duplicate", BAM_FDUP}, {"supplementary", BAM_FSUPPLEMENTARY}};
+        for (const auto &b : bits) {
+            if (name == b.first) {
+                emit(push_field, flag_bit, b.second);
+                return true;
+            }
+        }
+        error_ = "unknown field '" + name + "'";
+        return false;
     }
 
-    std::cout << "----- Processing group of size: " << current_group.size() << "\n";
-
-    // 收集符合阈值要求的配对
-    for (size_t i = 0; i < current_group.size() - 1; ++i) {
-        if (processed_set.find(i) != processed_set.end()) {
-            continue;  // 如果该 read 已经被处理，则跳过
-        }
-        bam1_t *aln1 = current_group[i];
-        for (size_t j = i + 1; j < current_group.size(); ++j) {
-            if (processed_set.find(j) != processed_set.end()) {
-                continue;  // 如果该 read 已经被处理，则跳过
-            }
-            bam1_t *aln2 = current_group[j];
-            if (is_proper_pair(aln1, aln2, max_insert_size)) {
-                int snp1 = get_snp_count(aln1);
-                int snp2 = get_snp_count(aln2);
-                int indel1 = get_indel_count(aln1);
-                int indel2 = get_indel_count(aln2);
-
-                // 记录配对的详细信息
-                std::cout << "Checking pair: " << bam_get_qname(aln1) << " and " << bam_get_qname(aln2) << "\n";
-                std::cout << "Chromosome positions: " << aln1->core.tid << ":" << aln1->core.pos 
-                          << " and " << aln2->core.tid << ":" << aln2->core.pos << "\n";
-                std::cout << "SNPs: " << snp1 << " + " << snp2 << ", Indels: " << indel1 << " + " << indel2 << "\n";
-
-                // 过滤条件
-                if (snp1 + snp2 <= max_snp && indel1 + indel2 <= max_indel) {
-                    candidate_pairs.push_back({aln1, aln2});
-                } else {
-                    std::cout << "Fail: SNP or indel count exceeds threshold.\n";
-                }
-            }
+    const std::string &s_;
+    std::vector<Instruction> &code_;
+    size_t p_ = 0;
+    int depth_ = 0;
+    int max_depth_ = 0;
+    std::string error_;
+};
+
+bool RecordFilter::compile(const std::string &expr, std::string &error) {
+    code_.clear();
+    if (expr.find_first_not_of(" \t") == std::string::npos) {
+        return true;
+    }
+    Parser parser(expr, code_);
+    if (!parser.parse(error)) {
+        code_.clear();
+        return false;
+    }
+    if (parser.max_depth() > max_depth) {
+        error = "expression is nested too deeply";
+        code_.clear();
+        return false;
+    }
+    return true;
+}
+
+// 由缓存的打分信息构造一条 read 的记录
+ReadScore make_read_score(bam1_t *aln) {
+    ReadScore score;
+    score.tid = aln->core.tid;
+    score.pos = aln->core.pos;
+    score.isize = aln->core.isize;
+    score.mapq = aln->core.qual;
+    score.reverse = (aln->core.flag & BAM_FREVERSE) != 0;
+    score.nm = get_snp_count(aln);
+    score.indel = get_indel_count(aln);
+    return score;
+}
+
+// 选择得分最高的配对，返回其在 candidate_pairs 中的下标；得分相同时取靠前的配对
+int choose_best_pair(const std::vector<ReadScore>& scores, const std::vector<MatePair>& candidate_pairs) {
+    if (candidate_pairs.empty()) {
+        return -1;  // 没有候选配对
+    }
+
+    int best = 0;
+    int best_score = -1;
+
+    for (size_t i = 0; i < candidate_pairs.size(); ++i) {
+        const ReadScore &read1 = scores[candidate_pairs[i].first];
+        const ReadScore &read2 = scores[candidate_pairs[i].second];
+
+        // 打分规则: MAPQ 越高得分越高，SNP 和 Indel 越少得分越高
+        int score = read1.mapq + read2.mapq - (read1.nm + read2.nm + read1.indel + read2.indel);
+
+        // 找到得分最高的配对
+        if (score > best_score) {
+            best_score = score;
+            best = i;
         }
     }
 
-    // 选择得分最高的配对
-    if (!candidate_pairs.empty()) {
-        auto best_pair = choose_best_pair(candidate_pairs);
-        bam1_t *aln1 = best_pair.first;
-        bam1_t *aln2 = best_pair.second;
+    return best;  // 返回得分最高的配对
+}
 
-        // 输出到 pass 文件
-        if (sam_write1(out_pass, header, aln1) < 0 || sam_write1(out_pass, header, aln2) < 0) {
-            std::cerr << "Error: could not write alignment to pass BAM\n";
-            exit(1);
+// 在一组 reads 中查找所有合适配对（与 is_proper_pair 的判断一致）并选出最佳配对。
+// 配对的两条 read 必须在同一染色体、插入片段互为相反数且方向相反，因此按 (tid, isize, 方向, pos)
+// 排序后每条 read 只需二分查找对应的区间，不再两两比较。缓冲区在组之间复用。
+void GroupEngine::run(const std::vector<ReadScore> &scores, int max_insert_size, int max_snp, int max_indel) {
+    size_t n = scores.size();
+    pairs_.clear();
+    candidates_.clear();
+    candidate_pair_index_.clear();
+    best_ = -1;
+    selected_.assign((n + 63) / 64, 0);
+
+    order_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        order_[i] = i;
+    }
+    auto key_less = [](const ReadScore &x, const ReadScore &y) {
+        if (x.tid != y.tid) return x.tid < y.tid;
+        if (x.isize != y.isize) return x.isize < y.isize;
+        if (x.reverse != y.reverse) return x.reverse < y.reverse;
+        return x.pos < y.pos;
+    };
+    std::sort(order_.begin(), order_.end(), [&](int32_t a, int32_t b) { return key_less(scores[a], scores[b]); });
+
+    for (size_t i = 0; i < n; ++i) {
+        const ReadScore &read1 = scores[i];
+        if (abs(read1.isize) > max_insert_size) {
+            continue;
         }
+        // 与 read1 配对的 read 的排序键区间: (tid, -isize, 相反方向, pos ± max_insert_size)
+        ReadScore low = read1;
+        low.isize = -read1.isize;
+        low.reverse = !read1.reverse;
+        low.pos = read1.pos - max_insert_size;
+        ReadScore high = low;
+        high.pos = read1.pos + max_insert_size;
 
-        // 获取 aln1 和 aln2 在 current_group 中的下标并标记为已处理
-        for (size_t i = 0; i < current_group.size(); ++i) {
-            if (current_group[i] == aln1) {
-                processed_set.insert(i);
+        auto lo = std::partition_point(order_.begin(), order_.end(), [&](int32_t a) {
+            return key_less(scores[a], low);
+        });
+        for (auto it = lo; it != order_.end(); ++it) {
+            const ReadScore &x = scores[*it];
+            if (x.tid != high.tid || x.isize != high.isize || x.reverse != high.reverse || x.pos > high.pos) {
+                break;
             }
-            if (current_group[i] == aln2) {
-                processed_set.insert(i);
+            if (static_cast<size_t>(*it) > i) {
+                pairs_.push_back({static_cast<int32_t>(i), *it, false});
             }
         }
+    }
 
-        ++processed_pairs;
+    // 按组内下标排序，保证日志和候选配对的顺序与逐对比较时一致
+    std::sort(pairs_.begin(), pairs_.end(), [](const MatePair &a, const MatePair &b) {
+        return a.first != b.first ? a.first < b.first : a.second < b.second;
+    });
+
+    for (size_t k = 0; k < pairs_.size(); ++k) {
+        MatePair &pair = pairs_[k];
+        const ReadScore &read1 = scores[pair.first];
+        const ReadScore &read2 = scores[pair.second];
+        // 过滤条件
+        if (read1.nm + read2.nm <= max_snp && read1.indel + read2.indel <= max_indel) {
+            pair.candidate = true;
+            candidates_.push_back(pair);
+            candidate_pair_index_.push_back(k);
+        }
+    }
+
+    int best_candidate = choose_best_pair(scores, candidates_);
+    if (best_candidate >= 0) {
+        best_ = candidate_pair_index_[best_candidate];
+        set_selected(pairs_[best_].first);
+        set_selected(pairs_[best_].second);
+    }
+}
 
-        std::cout << "Pass: Pair written to pass BAM. Best scoring proper pair.\n";
+// 记录一组 reads 的配对和筛选过程，同一组 reads 的名称相同
+void log_group(std::ostream &log, const char *qname, const std::vector<ReadScore> &scores, const GroupEngine &engine) {
+    if (scores.size() < 2) {
+        log << "----- Current group size < 2, no pairs to process.\n";
+        for (const ReadScore &read : scores) {
+            log << "Fail: Unpaired read: " << qname << "\n";
+            log << "Chromosome position: " << read.tid << ":" << read.pos 
+                << ", SNPs: " << read.nm << ", Indels: " << read.indel << "\n";
+        }
+        return;
     }
 
-    // 未被选择的配对输出到 fail 文件，并详细记录 SNP、Indel 数量及染色体位置信息
-    for (size_t i = 0; i < current_group.size(); ++i) {
-        if (processed_set.find(i) == processed_set.end()) {
-            bam1_t *aln = current_group[i];
-            int snp = get_snp_count(aln);
-            int indel = get_indel_count(aln);
+    log << "----- Processing group of size: " << scores.size() << "\n";
 
-            // 输出 fail 信息到日志
-            std::cout << "Fail: Not paired with any read in the group: " << bam_get_qname(aln) << "\n";
-            std::cout << "Chromosome position: " << aln->core.tid << ":" << aln->core.pos 
-                      << ", SNPs: " << snp << ", Indels: " << indel << "\n";
+    for (const MatePair &pair : engine.pairs()) {
+        const ReadScore &read1 = scores[pair.first];
+        const ReadScore &read2 = scores[pair.second];
 
-            // 输出到 fail 文件
-            if (sam_write1(out_fail, header, aln) < 0) {
-                std::cerr << "Error: could not write alignment to fail BAM\n";
-                exit(1);
-            }
+        // 记录配对的详细信息
+        log << "Proper pair detected: " << qname << " and " << qname << "\n";
+        log << "Checking pair: " << qname << " and " << qname << "\n";
+        log << "Chromosome positions: " << read1.tid << ":" << read1.pos 
+            << " and " << read2.tid << ":" << read2.pos << "\n";
+        log << "SNPs: " << read1.nm << " + " << read2.nm << ", Indels: " << read1.indel << " + " << read2.indel << "\n";
+        if (!pair.candidate) {
+            log << "Fail: SNP or indel count exceeds threshold.\n";
         }
     }
 
-    // 清理已处理的 reads
-    for (auto aln_ptr : current_group) {
-        bam_destroy1(aln_ptr);
+    if (engine.best() >= 0) {
+        log << "Pass: Pair written to pass BAM. Best scoring proper pair.\n";
     }
-    current_group.clear();
-}
 
-// 资源清理
-void clean_up_resources(bam1_t *aln, samFile *in, samFile *out_pass, samFile *out_fail, bam_hdr_t *header) {
-    if (aln != nullptr) bam_destroy1(aln);
-    if (in != nullptr) sam_close(in);
-    if (out_pass != nullptr) sam_close(out_pass);
-    if (out_fail != nullptr) sam_close(out_fail);
-    if (header != nullptr) bam_hdr_destroy(header);
+    // 未被选择的 reads 记录 SNP、Indel 数量及染色体位置信息
+    for (size_t i = 0; i < scores.size(); ++i) {
+        if (!engine.is_selected(i)) {
+            log << "Fail: Not paired with any read in the group: " << qname << "\n";
+            log << "Chromosome position: " << scores[i].tid << ":" << scores[i].pos 
+                << ", SNPs: " << scores[i].nm << ", Indels: " << scores[i].indel << "\n";
+        }
+    }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 8) {
-        std::cerr << "Usage: " << argv[0] << " <input.bam> <output_pass.bam> <output_fail.bam> <mapQ_threshold> <max_insert_size> <max_snp> <max_indel>\n";
-        return 1;
+void FilterStats::add_group(const std::vector<ReadScore> &scores, const GroupEngine &engine) {
+    ++groups;
+    records += scores.size();
+    group_size.add(scores.size());
+    for (const ReadScore &read : scores) {
+        nm.add(read.nm);
+        insert_size.add(abs(read.isize));
+    }
+
+    if (scores.size() < 2) {
+        fail_unpaired += scores.size();
+        return;
+    }
+    proper_pairs += engine.pairs().size();
+    for (const MatePair &pair : engine.pairs()) {
+        if (!pair.candidate) {
+            ++pairs_over_threshold;
+        }
     }
+    if (engine.best() >= 0) {
+        ++pass_pairs;
+        fail_not_best_pair += scores.size() - 2;
+    } else if (engine.pairs().empty()) {
+        fail_no_proper_pair += scores.size();
+    } else {
+        fail_over_threshold += scores.size();
+    }
+}
 
-    const char *input_bam = argv[1];
-    const char *output_pass_bam = argv[2];
-    const char *output_fail_bam = argv[3];
-    int mapQ_threshold = std::stoi(argv[4]);
-    int max_insert_size = std::stoi(argv[5]);
-    int max_snp = std::stoi(argv[6]);
-    int max_indel = std::stoi(argv[7]);
+void FilterStats::merge(const FilterStats &other) {
+    groups += other.groups;
+    records += other.records;
+    rejected += other.rejected;
+    masked += other.masked;
+    pass_pairs += other.pass_pairs;
+    proper_pairs += other.proper_pairs;
+    pairs_over_threshold += other.pairs_over_threshold;
+    fail_unpaired += other.fail_unpaired;
+    fail_no_proper_pair += other.fail_no_proper_pair;
+    fail_over_threshold += other.fail_over_threshold;
+    fail_not_best_pair += other.fail_not_best_pair;
+    group_size.merge(other.group_size);
+    nm.merge(other.nm);
+    insert_size.merge(other.insert_size);
+}
 
-    samFile *in = sam_open(input_bam, "rb");
-    if (in == nullptr) {
-        std::cerr << "Error: could not open input BAM file " << input_bam << "\n";
-        return 1;
+void FilterStats::write(std::ostream &out) const {
+    out << "#section\tkey\tvalue\n";
+    out << "count\tgroups\t" << groups << "\n";
+    out << "count\trecords\t" << records << "\n";
+    out << "count\tpass_pairs\t" << pass_pairs << "\n";
+    out << "count\tpass_reads\t" << pass_pairs * 2 << "\n";
+    out << "count\tproper_pairs\t" << proper_pairs << "\n";
+    out << "count\tpairs_over_threshold\t" << pairs_over_threshold << "\n";
+    out << "fail\trejected_by_filter\t" << rejected << "\n";
+    out << "fail\tmasked\t" << masked << "\n";
+    out << "fail\tunpaired\t" << fail_unpaired << "\n";
+    out << "fail\tno_proper_pair\t" << fail_no_proper_pair << "\n";
+    out << "fail\tsnp_indel_over_threshold\t" << fail_over_threshold << "\n";
+    out << "fail\tnot_best_pair\t" << fail_not_best_pair << "\n";
+    group_size.write(out, "group_size");
+    nm.write(out, "nm");
+    insert_size.write(out, "insert_size");
+}
+
+// 累加汇总统计，并按 log level 输出该组的详细日志；sampled 按 read 名称的哈希值抽样，
+// 因此无论线程数和输入顺序如何，抽中的组都相同
+void report_group(const FilterOptions &options, FilterStats &stats, std::ostream &log, const char *qname,
+                  const std::vector<ReadScore> &scores, const GroupEngine &engine) {
+    if (options.log_level == LogLevel::off) {
+        return;
     }
+    stats.add_group(scores, engine);
+    if (options.log_level == LogLevel::full ||
+        (options.log_level == LogLevel::sampled && std::hash<std::string>()(qname) % options.log_sample == 0)) {
+        log_group(log, qname, scores, engine);
+    }
+}
 
-    samFile *out_pass = sam_open(output_pass_bam, "wb");
-    if (out_pass == nullptr) {
-        std::cerr << "Error: could not open output pass BAM file " << output_pass_bam << "\n";
-        sam_close(in);
-        return 1;
+// 处理一组 reads 并选择得分最高的位置，结果按写出顺序保存到 out 中
+void process_read_group(std::vector<bam1_t*>& current_group, const FilterOptions &options, GroupEngine &engine,
+                        GroupOutput &out, FilterStats &stats, std::ostream &log, int &processed_pairs) {
+    StageTimer timer(STAGE_SCORE);
+    // 先用过滤表达式剔除 reads，只对剩下的 reads 计算 NM、Indel 和 MAPQ（每条 read 只计算一次）
+    std::vector<bam1_t*> &accepted = engine.accepted();
+    std::vector<ReadScore> &scores = engine.scores();
+    accepted.clear();
+    scores.clear();
+    for (bam1_t *aln : current_group) {
+        if (!options.filter.accept(aln->core)) {
+            ++stats.rejected;
+        } else if (is_masked(options, aln)) {
+            ++stats.masked;
+        } else {
+            accepted.push_back(aln);
+            scores.push_back(make_read_score(aln));
+        }
     }
 
-    samFile *out_fail = sam_open(output_fail_bam, "wb");
-    if (out_fail == nullptr) {
-        std::cerr << "Error: could not open output fail BAM file " << output_fail_bam << "\n";
-        sam_close(in);
-        sam_close(out_pass);
-        return 1;
+    // 收集符合阈值要求的配对并选择得分最高的配对，size < 2 的组没有配对，全部输出到 fail 文件
+    engine.run(scores, options.max_insert_size, options.max_snp, options.max_indel);
+    if (!accepted.empty()) {
+        report_group(options, stats, log, bam_get_qname(current_group[0]), scores, engine);
     }
 
-    bam_hdr_t *header = sam_hdr_read(in);
-    if (header == nullptr) {
-        std::cerr << "Error: could not read BAM header from " << input_bam << "\n";
-        clean_up_resources(nullptr, in, out_pass, out_fail, nullptr);
-        return 1;
+    // 输出到 pass 文件
+    if (engine.best() >= 0) {
+        const MatePair &best_pair = engine.pairs()[engine.best()];
+        out.pass.push_back(accepted[best_pair.first]);
+        out.pass.push_back(accepted[best_pair.second]);
+        ++processed_pairs;
     }
 
-    if (sam_hdr_write(out_pass, header) < 0 || sam_hdr_write(out_fail, header) < 0) {
-        std::cerr << "Error: could not write BAM header to output files\n";
-        clean_up_resources(nullptr, in, out_pass, out_fail, header);
-        return 1;
+    // 被剔除和未被选择的 reads 按输入顺序输出到 fail 文件
+    size_t k = 0;
+    for (bam1_t *aln : current_group) {
+        bool selected = false;
+        if (k < accepted.size() && accepted[k] == aln) {
+            selected = engine.is_selected(k++);
+        }
+        if (!selected) {
+            out.fail.push_back(aln);
+        }
     }
 
-    bam1_t *aln = bam_init1();
-    if (aln == nullptr) {
-        std::cerr << "Error: could not initialize BAM structure\n";
-        clean_up_resources(nullptr, in, out_pass, out_fail, header);
-        return 1;
+    current_group.clear();
+}
+
+// 将处理结果写入 pass/fail 文件，并把 reads 的缓冲放回缓冲池
+void write_group_output(GroupOutput &out, samFile *out_pass, samFile *out_fail, bam_hdr_t *header, BamPool &pool) {
+    StageTimer timer(STAGE_WRITE);
+    for (bam1_t *aln : out.pass) {
+        if (sam_write1(out_pass, header, aln) < 0) {
+            std::cerr << "Error: could not write alignment to pass BAM\n";
+            exit(1);
+        }
+    }
+    for (bam1_t *aln : out.fail) {
+        if (sam_write1(out_fail, header, aln) < 0) {
+            std::cerr << "Error: could not write alignment to fail BAM\n";
+            exit(1);
+        }
     }
 
+    pool.release(out.pass);
+    pool.release(out.fail);
+    out.pass.clear();
+    out.fail.clear();
+}
+
+// 单线程处理: 读取、筛选和写出依次进行
+void run_serial(GroupReader &reader, samFile *out_pass, samFile *out_fail, bam_hdr_t *header, BamPool &pool,
+                const FilterOptions &options, FilterStats &stats, int &processed_pairs) {
     std::vector<bam1_t*> current_group;
+    GroupEngine engine;
+    GroupOutput out;
+
+    // 逐组读取 BAM 文件，处理后立即写出
+    while (reader.next(current_group)) {
+        process_read_group(current_group, options, engine, out, stats, std::cout, processed_pairs);
+        write_group_output(out, out_pass, out_fail, header, pool);
+    }
+}
+
+// 一批连续的 read 组，由工作线程处理后按 seq 顺序写出
+struct GroupBatch {
+    size_t seq = 0;
+    std::vector<std::vector<bam1_t*>> groups;
+    GroupOutput out;
+    std::string log;
     int processed_pairs = 0;
-    std::string last_qname;
+};
+
+// 有界的批次队列，读取线程与工作线程之间传递待处理批次
+class BatchQueue {
+public:
+    explicit BatchQueue(size_t capacity) : capacity_(capacity) {}
 
-    // 读取 BAM 文件中的每一行
-    while (sam_read1(in, header, aln) >= 0) {
-        std::string qname(bam_get_qname(aln));
-        if (last_qname.empty()) {
-            last_qname = qname;
+    void push(std::unique_ptr<GroupBatch> batch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(std::move(batch));
+        not_empty_.notify_one();
+    }
+
+    // 队列关闭且为空时返回 nullptr
+    std::unique_ptr<GroupBatch> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+        if (queue_.empty()) {
+            return nullptr;
         }
+        std::unique_ptr<GroupBatch> batch = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+        return batch;
+    }
 
-        // 如果当前 read 的名称与上一个相同，继续添加到当前组中
-        if (qname == last_qname) {
-            current_group.push_back(bam_dup1(aln));
-        } else {
-            // 否则，处理当前组并清空，开始新组
-            process_read_group(current_group, mapQ_threshold, max_insert_size, max_snp, max_indel, out_pass, out_fail, header, processed_pairs);
-            last_qname = qname;
-            current_group.push_back(bam_dup1(aln));
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_ = false;
+    std::deque<std::unique_ptr<GroupBatch>> queue_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// 按 seq 重新排序已完成的批次，保证输出与单线程运行逐字节一致。最多保留 capacity 个批次等待写出，
+// 超前太多的工作线程在 put 中等待，写出较慢时内存不会无限增长
+class OrderedBatches {
+public:
+    explicit OrderedBatches(size_t capacity) : capacity_(capacity) {}
+
+    void put(std::unique_ptr<GroupBatch> batch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t seq = batch->seq;
+        not_full_.wait(lock, [this, seq] { return seq < next_seq_ + capacity_; });
+        done_[seq] = std::move(batch);
+        ready_.notify_one();
+    }
+
+    // 所有批次写完后返回 nullptr
+    std::unique_ptr<GroupBatch> next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return done_.count(next_seq_) || (finished_ && next_seq_ == total_); });
+        auto it = done_.find(next_seq_);
+        if (it == done_.end()) {
+            return nullptr;
         }
+        std::unique_ptr<GroupBatch> batch = std::move(it->second);
+        done_.erase(it);
+        ++next_seq_;
+        not_full_.notify_all();
+        return batch;
     }
 
-    // 处理最后一个组
-    if (!current_group.empty()) {
-        process_read_group(current_group, mapQ_threshold, max_insert_size, max_snp, max_indel, out_pass, out_fail, header, processed_pairs);
+    void finish(size_t total) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+        total_ = total;
+        ready_.notify_all();
     }
 
-    clean_up_resources(aln, in, out_pass, out_fail, header);
-    std::cout << "Done! Processed " << processed_pairs << " read pairs.\n";
-    return 0;
-}
+private:
+    size_t capacity_;
+    std::map<size_t, std::unique_ptr<GroupBatch>> done_;
+    size_t next_seq_ = 0;
+    size_t total_ = 0;
+    bool finished_ = false;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable not_full_;
+};
+
+// 多线程处理: 主线程读取并切分批次，工作线程筛选，写出线程按顺序写出
+void run_parallel(GroupReader &reader, samFile *out_pass, samFile *out_fail, bam_hdr_t *header, BamPool &pool,
+                  const FilterOptions &options, FilterStats &stats, int &processed_pairs, int n_threads) {
+    const size_t batch_groups = 4096;  // 每批包含的 read 组数
+    BatchQueue todo(4 * n_threads);
+    OrderedBatches done(4 * n_threads);
 
+    std::vector<std::thread> workers;
+    std::vector<FilterStats> worker_stats(n_threads);
+    for (int t = 0; t < n_threads; ++t) {
+        workers.emplace_back([&, t] {
+            GroupEngine engine;
+            while (std::unique_ptr<GroupBatch> batch = todo.pop()) {
+                std::ostringstream log;
+                for (auto &group : batch->groups) {
+                    process_read_group(group, options, engine, batch->out, worker_stats[t], log, batch->processed_pairs);
+                }
+                batch->groups.clear();
+                batch->log = log.str();
+                done.put(std::move(batch));
+            }
+        });
+    }
+
+    std::thread writer([&] {
+        while (std::unique_ptr<GroupBatch> batch = done.next()) {
+            std::cout << batch->log;
+            write_group_output(batch->out, out_pass, out_fail, header, pool);
+            processed_pairs += batch->processed_pairs;
+        }
+    });
+
+    size_t seq = 0;
+    auto batch = std::make_unique<GroupBatch>();
+    std::vector<bam1_t*> current_group;
+
+    // 逐组读取 BAM 文件，满一批后交给工作线程
+    while (reader.next(current_group)) {
+        batch->groups.push_back(std::move(current_group));
+        current_group = std::vector<bam1_t*>();
+        if (batch->groups.size() >= batch_groups) {
+            batch->seq = seq++;
+            todo.push(std::move(batch));
+            batch = std::make_unique<GroupBatch>();
+        }
+    }
+
+    // 最后一批
+    if (!batch->groups.empty()) {
+        batch->seq = seq++;
+        todo.push(std::move(batch));
+    }
+    todo.close();
+    done.finish(seq);
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    writer.join();
+    for (const FilterStats &worker : worker_stats) {
+        stats.merge(worker);
+    }
+}
+
+// 资源清理
+void clean_up_resources(bam1_t *aln, samFile *in, samFile *out_pass, samFile *out_fail, bam_hdr_t *header) {
+    if (aln != nullptr) bam_destroy1(aln);
+    if (in != nullptr) sam_close(in);
+    if (out_pass != nullptr) sam_close(out_pass);
+    if (out_fail != nullptr) sam_close(out_fail);
+    if (header != nullptr) bam_hdr_destroy(header);
+}
+
+// 坐标排序模式下等待配对的 read，只保留打分所需的信息
+struct PendingRead {
+    uint64_t seq;   // 在输入文件中的序号
+    uint16_t flag;
+    ReadScore score;
+};
+
+// 染色体和位置打包成一个可比较的坐标，未比对的 reads (tid = -1) 排在最后
+inline uint64_t coord_key(int32_t tid, int64_t pos) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(tid)) << 32) | static_cast<uint32_t>(pos < 0 ? 0 : pos);
+}
+
+// 在坐标排序的文件中收集同名 reads。每组记录其余记录（mate 以及 SA 标签中的补充比对）可能出现的最远坐标，
+// 读取位置越过该坐标后这一组就完整了。这对 bwa mem 的默认输出是准确的；若输入含有不被 mate/SA 引用的
+// secondary 比对，需用 exact_groups 把所有组保留到输入读完。等待中的 reads 超过 max_pending 时，按 read 名称的
+// 哈希值溢出到临时文件，同名的后续 reads 也写入同一个文件，读完输入后再逐个文件分组。
+class CoordinateGrouper {
+public:
+    typedef std::function<void(const std::string &qname, std::vector<PendingRead> &reads)> GroupCallback;
+
+    CoordinateGrouper(bam_hdr_t *header, size_t max_pending, bool exact_groups, const std::string &spill_prefix, GroupCallback on_group)
+        : header_(header), max_pending_(max_pending), exact_groups_(exact_groups), spill_prefix_(spill_prefix), on_group_(on_group) {}
+
+    ~CoordinateGrouper() {
+        for (size_t i = 0; i < spill_files_.size(); ++i) {
+            if (spill_files_[i] != nullptr) {
+                fclose(spill_files_[i]);
+                remove(spill_name(i).c_str());
+            }
+        }
+    }
+
+    // 加入一条 read，返回 false 表示输入不是按坐标排序的
+    bool add(bam1_t *aln, uint64_t seq) {
+        uint64_t key = coord_key(aln->core.tid, aln->core.pos);
+        if (key < last_key_) {
+            return false;
+        }
+        last_key_ = key;
+        flush_before(key);
+
+        PendingRead read;
+        read.seq = seq;
+        read.flag = aln->core.flag;
+        read.score = make_read_score(aln);
+        uint64_t deadline = exact_groups_ ? UINT64_MAX - 1 : read_deadline(aln, key);
+
+        qname_.assign(bam_get_qname(aln));
+        auto it = groups_.find(qname_);
+        if (it != groups_.end()) {
+            it->second.reads.push_back(read);
+            if (deadline > it->second.deadline) {
+                it->second.deadline = deadline;
+                heap_.push({deadline, qname_});
+            }
+        } else if (!spilled_.empty() && spilled_.count(std::hash<std::string>()(qname_))) {
+            spill_read(qname_, read);
+            return true;
+        } else {
+            PendingGroup &group = groups_[qname_];
+            group.reads.push_back(read);
+            group.deadline = deadline;
+            heap_.push({deadline, qname_});
+        }
+
+        if (++pending_ > peak_pending_) peak_pending_ = pending_;
+        if (pending_ > max_pending_) {
+            spill_groups(key);
+        }
+        return true;
+    }
+
+    // 输入读完后处理剩余的组和溢出文件中的组；给定 on_remaining 时这些组交给它而不是 on_group
+    void finish(GroupCallback on_remaining = nullptr) {
+        if (on_remaining) {
+            on_group_ = on_remaining;
+        }
+        flush_before(UINT64_MAX);
+        for (size_t i = 0; i < spill_files_.size(); ++i) {
+            if (spill_files_[i] != nullptr) {
+                process_spill_file(i);
+            }
+        }
+    }
+
+    // 只处理坐标在 [begin, end) 内的 reads 时，mate 或补充比对在范围外的组留到 finish 时处理
+    void set_bounds(uint64_t begin, uint64_t end) {
+        bound_begin_ = begin;
+        bound_end_ = end;
+    }
+
+    size_t peak_pending() const { return peak_pending_; }
+    size_t spilled_reads() const { return spilled_reads_; }
+
+private:
+    struct PendingGroup {
+        std::vector<PendingRead> reads;
+        uint64_t deadline;
+    };
+
+    struct HeapEntry {
+        uint64_t deadline;
+        std::string qname;
+        bool operator<(const HeapEntry &other) const { return deadline > other.deadline; }
+    };
+
+    static const size_t spill_partitions = 64;
+
+    // 同名的其余记录最远可能出现的坐标: mate 的位置以及 SA 标签中的补充比对位置
+    uint64_t read_deadline(bam1_t *aln, uint64_t key) {
+        uint64_t deadline = key;
+        if ((aln->core.flag & BAM_FPAIRED) && aln->core.mtid >= 0) {
+            deadline = std::max(deadline, bounded(coord_key(aln->core.mtid, aln->core.mpos)));
+        }
+        uint8_t *sa = bam_aux_get(aln, "SA");
+        if (sa != nullptr && bam_aux2Z(sa) != nullptr) {
+            // SA:Z:rname,pos,strand,CIGAR,mapQ,NM;...
+            std::string entries = bam_aux2Z(sa);
+            size_t start = 0;
+            while (start < entries.size()) {
+                size_t end = entries.find(';', start);
+                if (end == std::string::npos) end = entries.size();
+                size_t comma1 = entries.find(',', start);
+                if (comma1 != std::string::npos && comma1 < end) {
+                    int32_t tid = sam_hdr_name2tid(header_, entries.substr(start, comma1 - start).c_str());
+                    int64_t pos = atol(entries.c_str() + comma1 + 1) - 1;
+                    if (tid >= 0) {
+                        deadline = std::max(deadline, bounded(coord_key(tid, pos)));
+                    }
+                }
+                start = end + 1;
+            }
+        }
+        return deadline;
+    }
+
+    uint64_t bounded(uint64_t key) const {
+        return key < bound_begin_ || key >= bound_end_ ? UINT64_MAX - 1 : key;
+    }
+
+    // 处理所有已经完整的组
+    void flush_before(uint64_t key) {
+        while (!heap_.empty() && heap_.top().deadline < key) {
+            HeapEntry entry = heap_.top();
+            heap_.pop();
+            auto it = groups_.find(entry.qname);
+            if (it == groups_.end() || it->second.deadline != entry.deadline) {
+                continue;  // 该组已处理、已溢出或截止坐标已更新
+            }
+            pending_ -= it->second.reads.size();
+            on_group_(entry.qname, it->second.reads);
+            groups_.erase(it);
+        }
+    }
+
+    // 优先溢出 mate 在其他染色体上的组，它们等待的时间最长
+    void spill_groups(uint64_t key) {
+        uint64_t current_tid = key >> 32;
+        for (int round = 0; round < 2 && pending_ > max_pending_ / 2; ++round) {
+            for (auto it = groups_.begin(); it != groups_.end();) {
+                if (round == 0 && (it->second.deadline >> 32) == current_tid) {
+                    ++it;
+                    continue;
+                }
+                spilled_.insert(std::hash<std::string>()(it->first));
+                for (const PendingRead &read : it->second.reads) {
+                    spill_read(it->first, read);
+                }
+                pending_ -= it->second.reads.size();
+                it = groups_.erase(it);
+            }
+        }
+
+        // 溢出组的堆条目要等读取位置越过其截止坐标才会弹出，按剩下的组重建堆，
+        // 使堆的大小与等待中的组数一致，而不是累积到 mate 所在的染色体
+        std::vector<HeapEntry> entries;
+        entries.reserve(groups_.size());
+        for (const auto &item : groups_) {
+            entries.push_back({item.second.deadline, item.first});
+        }
+        heap_ = std::priority_queue<HeapEntry>(std::less<HeapEntry>(), std::move(entries));
+    }
+
+    std::string spill_name(size_t partition) const {
+        return spill_prefix_ + "." + std::to_string(partition) + ".tmp";
+    }
+
+    void spill_read(const std::string &qname, const PendingRead &read) {
+        if (spill_files_.empty()) {
+            spill_files_.assign(spill_partitions, nullptr);
+        }
+        size_t partition = std::hash<std::string>()(qname) % spill_partitions;
+        FILE *&fp = spill_files_[partition];
+        if (fp == nullptr) {
+            fp = fopen(spill_name(partition).c_str(), "w+b");
+            if (fp == nullptr) {
+                std::cerr << "Error: could not create temporary file " << spill_name(partition) << "\n";
+                exit(1);
+            }
+        }
+        uint16_t length = qname.size();
+        if (fwrite(&length, sizeof(length), 1, fp) != 1 || fwrite(qname.data(), 1, length, fp) != length ||
+            fwrite(&read, sizeof(read), 1, fp) != 1) {
+            std::cerr << "Error: could not write temporary file " << spill_name(partition) << "\n";
+            exit(1);
+        }
+        ++spilled_reads_;
+    }
+
+    void process_spill_file(size_t partition) {
+        FILE *fp = spill_files_[partition];
+        rewind(fp);
+        std::unordered_map<std::string, std::vector<PendingRead>> groups;
+        std::vector<std::string> order;  // 按首次出现的顺序处理各组
+        uint16_t length;
+        char buffer[65536];
+        PendingRead read;
+        while (fread(&length, sizeof(length), 1, fp) == 1) {
+            if (fread(buffer, 1, length, fp) != length || fread(&read, sizeof(read), 1, fp) != 1) {
+                std::cerr << "Error: could not read temporary file " << spill_name(partition) << "\n";
+                exit(1);
+            }
+            std::string qname(buffer, length);
+            auto it = groups.find(qname);
+            if (it == groups.end()) {
+                it = groups.emplace(qname, std::vector<PendingRead>()).first;
+                order.push_back(qname);
+            }
+            it->second.push_back(read);
+        }
+        for (const std::string &qname : order) {
+            on_group_(qname, groups[qname]);
+        }
+        fclose(fp);
+        remove(spill_name(partition).c_str());
+        spill_files_[partition] = nullptr;
+    }
+
+    bam_hdr_t *header_;
+    size_t max_pending_;
+    bool exact_groups_;
+    std::string spill_prefix_;
+    GroupCallback on_group_;
+    std::unordered_map<std::string, PendingGroup> groups_;
+    std::priority_queue<HeapEntry> heap_;
+    std::unordered_set<size_t> spilled_;  // 已溢出的 read 名称的哈希值
+    std::vector<FILE*> spill_files_;
+    std::string qname_;
+    uint64_t last_key_ = 0;
+    uint64_t bound_begin_ = 0;
+    uint64_t bound_end_ = UINT64_MAX;
+    size_t pending_ = 0;
+    size_t peak_pending_ = 0;
+    size_t spilled_reads_ = 0;
+};
+
+// 按 name-sorted 文件中的顺序排列同名 reads（samtools sort -n: 先按 READ1/READ2 标志，再按输入顺序），
+// 保证得分相同时选出的配对与 name-sorted 输入一致
+void sort_pending_reads(std::vector<PendingRead> &reads) {
+    std::sort(reads.begin(), reads.end(), [](const PendingRead &a, const PendingRead &b) {
+        int flag_a = a.flag & (BAM_FREAD1 | BAM_FREAD2);
+        int flag_b = b.flag & (BAM_FREAD1 | BAM_FREAD2);
+        return flag_a != flag_b ? flag_a < flag_b : a.seq < b.seq;
+    });
+}
+
+// 对一组同名 reads 选择配对，返回 true 时 seq1/seq2 为被选中的两条 read 的序号
+bool choose_pending_pair(const std::string &qname, std::vector<PendingRead> &reads, const FilterOptions &options, GroupEngine &engine,
+                         FilterStats &stats, std::ostream &log, uint64_t &seq1, uint64_t &seq2) {
+    StageTimer timer(STAGE_SCORE);
+    sort_pending_reads(reads);
+    std::vector<ReadScore> &scores = engine.scores();
+    scores.clear();
+    for (const PendingRead &read : reads) {
+        scores.push_back(read.score);
+    }
+    engine.run(scores, options.max_insert_size, options.max_snp, options.max_indel);
+    report_group(options, stats, log, qname.c_str(), scores, engine);
+    if (engine.best() < 0) {
+        return false;
+    }
+    const MatePair &best_pair = engine.pairs()[engine.best()];
+    seq1 = reads[best_pair.first].seq;
+    seq2 = reads[best_pair.second].seq;
+    return true;
+}
+
+inline void set_pass_bit(std::vector<uint64_t> &pass_bits, uint64_t seq) {
+    pass_bits[seq >> 6] |= uint64_t(1) << (seq & 63);
+}
+
+inline bool get_pass_bit(const std::vector<uint64_t> &pass_bits, uint64_t seq) {
+    return (pass_bits[seq >> 6] >> (seq & 63)) & 1;
+}
+
+// 按 read 名称分组的输入（samtools sort -n 的输出）: 单线程或多线程逐组筛选
+int run_name_grouped(const char *input_bam, const char *output_pass_bam, const char *output_fail_bam, htsThreadPool *thread_pool,
+                     const FilterOptions &options, int n_threads, FilterStats &stats, int &processed_pairs, std::ostream &log) {
+    samFile *in = sam_open(input_bam, "rb");
+    if (in == nullptr) {
+        std::cerr << "Error: could not open input BAM file " << input_bam << "\n";
+        return 1;
+    }
+
+    samFile *out_pass = sam_open(output_pass_bam, "wb");
+    if (out_pass == nullptr) {
+        std::cerr << "Error: could not open output pass BAM file " << output_pass_bam << "\n";
+        sam_close(in);
+        return 1;
+    }
+
+    samFile *out_fail = sam_open(output_fail_bam, "wb");
+    if (out_fail == nullptr) {
+        std::cerr << "Error: could not open output fail BAM file " << output_fail_bam << "\n";
+        sam_close(in);
+        sam_close(out_pass);
+        return 1;
+    }
+
+    if (thread_pool->pool != nullptr) {
+        hts_set_opt(in, HTS_OPT_THREAD_POOL, thread_pool);
+        hts_set_opt(out_pass, HTS_OPT_THREAD_POOL, thread_pool);
+        hts_set_opt(out_fail, HTS_OPT_THREAD_POOL, thread_pool);
+    }
+
+    bam_hdr_t *header = sam_hdr_read(in);
+    if (header == nullptr) {
+        std::cerr << "Error: could not read BAM header from " << input_bam << "\n";
+        clean_up_resources(nullptr, in, out_pass, out_fail, nullptr);
+        return 1;
+    }
+
+    if (sam_hdr_write(out_pass, header) < 0 || sam_hdr_write(out_fail, header) < 0) {
+        std::cerr << "Error: could not write BAM header to output files\n";
+        clean_up_resources(nullptr, in, out_pass, out_fail, header);
+        return 1;
+    }
+
+    BamPool pool;
+    GroupReader reader(in, header, pool);
+    if (n_threads > 1) {
+        run_parallel(reader, out_pass, out_fail, header, pool, options, stats, processed_pairs, n_threads);
+    } else {
+        run_serial(reader, out_pass, out_fail, header, pool, options, stats, processed_pairs);
+    }
+
+    clean_up_resources(nullptr, in, out_pass, out_fail, header);
+    log << "BAM buffers: " << pool.allocations() << " allocations for " << reader.records() << " records ("
+        << reader.data_growths() << " data buffer growths), peak group " << reader.peak_group_size() << " records / "
+        << reader.peak_group_bytes() << " bytes\n";
+    return 0;
+}
+
+// 打开输出文件，写入头信息并在写出的同时建立 CSI 索引
+samFile *open_indexed_output(const char *filename, bam_hdr_t *header, htsThreadPool *thread_pool) {
+    samFile *out = sam_open(filename, "wb");
+    if (out == nullptr) {
+        std::cerr << "Error: could not open output BAM file " << filename << "\n";
+        return nullptr;
+    }
+    if (thread_pool->pool != nullptr) {
+        hts_set_opt(out, HTS_OPT_THREAD_POOL, thread_pool);
+    }
+    std::string index_name = std::string(filename) + ".csi";
+    if (sam_hdr_write(out, header) < 0 || sam_idx_init(out, header, 14, index_name.c_str()) < 0) {
+        std::cerr << "Error: could not initialise output BAM file " << filename << "\n";
+        sam_close(out);
+        return nullptr;
+    }
+    return out;
+}
+
+// 坐标排序输入: 第一遍按 read 名称分组并决定每条 read 的去向（每条 read 一个比特），
+// 第二遍按原顺序重新读取并写出，pass/fail 文件因此保持坐标排序，无需再排序
+int run_coordinate_sorted(const char *input_bam, const char *output_pass_bam, const char *output_fail_bam, htsThreadPool *thread_pool,
+                          const FilterOptions &options, size_t max_pending, bool exact_groups, FilterStats &stats, int &processed_pairs,
+                          std::ostream &log) {
+    samFile *in = sam_open(input_bam, "rb");
+    if (in == nullptr) {
+        std::cerr << "Error: could not open input BAM file " << input_bam << "\n";
+        return 1;
+    }
+    if (thread_pool->pool != nullptr) {
+        hts_set_opt(in, HTS_OPT_THREAD_POOL, thread_pool);
+    }
+    bam_hdr_t *header = sam_hdr_read(in);
+    if (header == nullptr) {
+        std::cerr << "Error: could not read BAM header from " << input_bam << "\n";
+        sam_close(in);
+        return 1;
+    }
+
+    std::vector<uint64_t> pass_bits;
+    GroupEngine engine;
+    CoordinateGrouper grouper(header, max_pending, exact_groups, std::string(output_pass_bam) + ".pending." + std::to_string(getpid()),
+        [&](const std::string &qname, std::vector<PendingRead> &reads) {
+            uint64_t seq1, seq2;
+            if (choose_pending_pair(qname, reads, options, engine, stats, log, seq1, seq2)) {
+                set_pass_bit(pass_bits, seq1);
+                set_pass_bit(pass_bits, seq2);
+                ++processed_pairs;
+            }
+        });
+
+    // 第一遍: 分组并选择配对
+    bam1_t *aln = bam_init1();
+    uint64_t records = 0;
+    while (read_record(in, header, aln) >= 0) {
+        if ((records >> 6) >= pass_bits.size()) {
+            pass_bits.resize(pass_bits.size() + 65536, 0);
+        }
+        if (!options.filter.accept(aln->core)) {
+            ++stats.rejected;  // 不进入分组，第二遍时因 pass 比特为 0 写入 fail 文件
+        } else if (is_masked(options, aln)) {
+            ++stats.masked;
+        } else {
+            StageTimer timer(STAGE_GROUP);
+            if (!grouper.add(aln, records)) {
+                std::cerr << "Error: " << input_bam << " is not sorted by coordinate\n";
+                clean_up_resources(aln, in, nullptr, nullptr, header);
+                return 1;
+            }
+        }
+        ++records;
+        CountItems(1);
+    }
+    {
+        StageTimer timer(STAGE_GROUP);
+        grouper.finish();
+    }
+    sam_close(in);
+
+    // 第二遍: 按输入顺序写出
+    in = sam_open(input_bam, "rb");
+    if (in == nullptr) {
+        std::cerr << "Error: could not reopen input BAM file " << input_bam << "\n";
+        clean_up_resources(aln, nullptr, nullptr, nullptr, header);
+        return 1;
+    }
+    if (thread_pool->pool != nullptr) {
+        hts_set_opt(in, HTS_OPT_THREAD_POOL, thread_pool);
+    }
+    bam_hdr_destroy(header);
+    header = sam_hdr_read(in);
+    samFile *out_pass = header ? open_indexed_output(output_pass_bam, header, thread_pool) : nullptr;
+    samFile *out_fail = out_pass ? open_indexed_output(output_fail_bam, header, thread_pool) : nullptr;
+    if (out_fail == nullptr) {
+        clean_up_resources(aln, in, out_pass, nullptr, header);
+        return 1;
+    }
+
+    uint64_t seq = 0;
+    while (seq < records && read_record(in, header, aln) >= 0) {
+        bool pass = get_pass_bit(pass_bits, seq);
+        if (write_record(pass ? out_pass : out_fail, header, aln) < 0) {
+            std::cerr << "Error: could not write alignment to " << (pass ? "pass" : "fail") << " BAM\n";
+            exit(1);
+        }
+        ++seq;
+    }
+    if (sam_idx_save(out_pass) < 0 || sam_idx_save(out_fail) < 0) {
+        std::cerr << "Error: could not save BAM index\n";
+        clean_up_resources(aln, in, out_pass, out_fail, header);
+        return 1;
+    }
+
+    clean_up_resources(aln, in, out_pass, out_fail, header);
+    log << "Pending reads: peak " << grouper.peak_pending() << ", spilled " << grouper.spilled_reads() << "\n";
+    return 0;
+}
+
+// 按索引切分的一个区域，各分片独立分组、选择配对和写出
+struct Shard {
+    std::string region;
+    int32_t tid = -1;
+    hts_pos_t beg = 0;    // 起点在 beg 之前的 reads 属于前一个分片
+    hts_pos_t end = UINT32_MAX;
+    std::vector<uint64_t> pass_bits;
+    uint64_t records = 0;
+    std::vector<std::pair<std::string, std::vector<PendingRead>>> remaining;  // mate 可能在其他分片中的组
+    std::ostringstream log;
+    FilterStats stats;
+    int processed_pairs = 0;
+    std::string pass_part;
+    std::string fail_part;
+};
+
+// PendingRead::seq 的高位保存分片编号，低位为分片内的序号
+const int shard_seq_bits = 40;
+
+// 遍历一个分片内起点落在该分片的 reads
+template <typename F>
+bool for_each_shard_read(const char *input_bam, htsThreadPool *thread_pool, Shard &shard, F on_read) {
+    samFile *in = sam_open(input_bam, "rb");
+    if (in == nullptr) {
+        std::cerr << "Error: could not open input BAM file " << input_bam << "\n";
+        return false;
+    }
+    if (thread_pool->pool != nullptr) {
+        hts_set_opt(in, HTS_OPT_THREAD_POOL, thread_pool);
+    }
+    bam_hdr_t *header = sam_hdr_read(in);
+    hts_idx_t *idx = header ? sam_index_load(in, input_bam) : nullptr;
+    hts_itr_t *iter = idx ? sam_itr_querys(idx, header, shard.region.c_str()) : nullptr;
+    if (iter == nullptr) {
+        std::cerr << "Error: could not query region " << shard.region << " in " << input_bam << "\n";
+        if (idx != nullptr) hts_idx_destroy(idx);
+        clean_up_resources(nullptr, in, nullptr, nullptr, header);
+        return false;
+    }
+
+    bam1_t *aln = bam_init1();
+    bool ok = true;
+    while (ok && read_record(in, iter, aln) >= 0) {
+        if (aln->core.tid == shard.tid && aln->core.pos < shard.beg) {
+            continue;
+        }
+        ok = on_read(aln, header);
+    }
+
+    hts_itr_destroy(iter);
+    hts_idx_destroy(idx);
+    clean_up_resources(aln, in, nullptr, nullptr, header);
+    return ok;
+}
+
+// 按 BGZF 块拼接各分片的 BAM。分片头信息所在块的剩余部分重新压缩，其后的块原样复制，并去掉各分片末尾的 EOF 块
+bool concatenate_bams(const std::vector<std::string> &parts, const char *output, bam_hdr_t *header) {
+    StageTimer timer(STAGE_WRITE);
+    static const uint8_t bgzf_eof[28] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    BGZF *out = bgzf_open(output, "w");
+    if (out == nullptr || bam_hdr_write(out, header) < 0) {
+        std::cerr << "Error: could not open output BAM file " << output << "\n";
+        if (out != nullptr) bgzf_close(out);
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(1 << 20);
+    for (const std::string &part : parts) {
+        BGZF *in = bgzf_open(part.c_str(), "r");
+        bam_hdr_t *part_header = in ? bam_hdr_read(in) : nullptr;
+        if (part_header == nullptr) {
+            std::cerr << "Error: could not read shard BAM " << part << "\n";
+            if (in != nullptr) bgzf_close(in);
+            bgzf_close(out);
+            return false;
+        }
+        bam_hdr_destroy(part_header);
+
+        if (in->block_offset < in->block_length) {
+            bgzf_write(out, static_cast<uint8_t*>(in->uncompressed_block) + in->block_offset, in->block_length - in->block_offset);
+        }
+        if (bgzf_flush(out) < 0) {
+            std::cerr << "Error: could not write output BAM file " << output << "\n";
+            bgzf_close(in);
+            bgzf_close(out);
+            return false;
+        }
+
+        // 末尾 28 字节暂不写出，读完后若为 EOF 块则丢弃
+        size_t held = 0;
+        ssize_t n;
+        while ((n = bgzf_raw_read(in, buffer.data() + held, buffer.size() - held)) > 0) {
+            size_t total = held + n;
+            size_t keep = std::min<size_t>(total, sizeof(bgzf_eof));
+            if (bgzf_raw_write(out, buffer.data(), total - keep) < 0) {
+                n = -1;
+                break;
+            }
+            memmove(buffer.data(), buffer.data() + total - keep, keep);
+            held = keep;
+        }
+        bool is_eof = held == sizeof(bgzf_eof) && memcmp(buffer.data(), bgzf_eof, held) == 0;
+        if (n < 0 || (!is_eof && bgzf_raw_write(out, buffer.data(), held) < 0)) {
+            std::cerr << "Error: could not copy shard BAM " << part << "\n";
+            bgzf_close(in);
+            bgzf_close(out);
+            return false;
+        }
+        bgzf_close(in);
+    }
+
+    return bgzf_close(out) == 0;
+}
+
+// 分片列表: 每条染色体（以及未比对的 reads）一个分片，或用户给定的互不重叠的区域，按基因组顺序排列
+bool build_shards(const char *input_bam, const std::vector<std::string> &regions, std::vector<std::unique_ptr<Shard>> &shards) {
+    samFile *in = sam_open(input_bam, "rb");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : nullptr;
+    if (header == nullptr) {
+        std::cerr << "Error: could not read BAM header from " << input_bam << "\n";
+        if (in != nullptr) sam_close(in);
+        return false;
+    }
+
+    if (regions.empty()) {
+        for (int tid = 0; tid < sam_hdr_nref(header); ++tid) {
+            auto shard = std::make_unique<Shard>();
+            shard->region = sam_hdr_tid2name(header, tid);
+            shard->tid = tid;
+            shard->end = UINT32_MAX;
+            shards.push_back(std::move(shard));
+        }
+        auto unmapped = std::make_unique<Shard>();
+        unmapped->region = "*";
+        shards.push_back(std::move(unmapped));
+    } else {
+        std::vector<std::pair<std::pair<uint64_t, hts_pos_t>, std::string>> sorted;
+        for (const std::string &region : regions) {
+            hts_pos_t beg, end;
+            const char *name_end = hts_parse_reg64(region.c_str(), &beg, &end);
+            int32_t tid = name_end ? sam_hdr_name2tid(header, region.substr(0, name_end - region.c_str()).c_str()) : -1;
+            if (tid < 0) {
+                std::cerr << "Error: unknown region " << region << "\n";
+                clean_up_resources(nullptr, in, nullptr, nullptr, header);
+                return false;
+            }
+            sorted.push_back({{coord_key(tid, beg), std::min<hts_pos_t>(end, UINT32_MAX)}, region});
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (const auto &item : sorted) {
+            auto shard = std::make_unique<Shard>();
+            shard->region = item.second;
+            shard->tid = item.first.first >> 32;
+            shard->beg = item.first.first & 0xffffffff;
+            shard->end = item.first.second;
+            // 重叠部分的 reads 会在两个分片中各处理一次，写出重复的记录
+            if (!shards.empty() && shards.back()->tid == shard->tid && shard->beg < shards.back()->end) {
+                std::cerr << "Error: regions " << shards.back()->region << " and " << shard->region << " overlap\n";
+                clean_up_resources(nullptr, in, nullptr, nullptr, header);
+                return false;
+            }
+            shards.push_back(std::move(shard));
+        }
+    }
+
+    clean_up_resources(nullptr, in, nullptr, nullptr, header);
+    return true;
+}
+
+// 在工作线程中依次处理各分片
+template <typename F>
+bool run_shard_tasks(std::vector<std::unique_ptr<Shard>> &shards, int n_threads, F task) {
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n_threads; ++t) {
+        workers.emplace_back([&] {
+            size_t k;
+            while (ok && (k = next++) < shards.size()) {
+                if (!task(k, *shards[k])) {
+                    ok = false;
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return ok;
+}
+
+// 按索引分片并行处理坐标排序的输入: 各分片先独立分组，mate 跨分片的组汇总后统一选择配对，
+// 再由各分片写出各自的 pass/fail BAM，最后按块拼接并建立索引
+int run_sharded(const char *input_bam, const char *output_pass_bam, const char *output_fail_bam, htsThreadPool *thread_pool,
+                const std::vector<std::string> &regions, int n_threads,
+                const FilterOptions &options, size_t max_pending, bool exact_groups, FilterStats &stats, int &processed_pairs) {
+    std::vector<std::unique_ptr<Shard>> shards;
+    if (!build_shards(input_bam, regions, shards)) {
+        return 1;
+    }
+
+    // 第一遍: 各分片内分组
+    bool ok = run_shard_tasks(shards, n_threads, [&](size_t k, Shard &shard) {
+        GroupEngine engine;
+        std::unique_ptr<CoordinateGrouper> grouper;
+        uint64_t shard_bits = static_cast<uint64_t>(k) << shard_seq_bits;
+        bool read_ok = for_each_shard_read(input_bam, thread_pool, shard, [&](bam1_t *aln, bam_hdr_t *header) {
+            if (!grouper) {
+                grouper.reset(new CoordinateGrouper(header, max_pending, exact_groups,
+                    std::string(output_pass_bam) + ".pending." + std::to_string(getpid()) + "." + std::to_string(k),
+                    [&](const std::string &qname, std::vector<PendingRead> &reads) {
+                        uint64_t seq1, seq2;
+                        if (choose_pending_pair(qname, reads, options, engine, shard.stats, shard.log, seq1, seq2)) {
+                            set_pass_bit(shard.pass_bits, seq1 & ((uint64_t(1) << shard_seq_bits) - 1));
+                            set_pass_bit(shard.pass_bits, seq2 & ((uint64_t(1) << shard_seq_bits) - 1));
+                            ++shard.processed_pairs;
+                        }
+                    }));
+                grouper->set_bounds(coord_key(shard.tid, shard.beg),
+                                    shard.tid < 0 ? UINT64_MAX : coord_key(shard.tid, shard.end));
+            }
+            if ((shard.records >> 6) >= shard.pass_bits.size()) {
+                shard.pass_bits.resize(shard.pass_bits.size() + 65536, 0);
+            }
+            if (!options.filter.accept(aln->core)) {
+                ++shard.stats.rejected;
+            } else if (is_masked(options, aln)) {
+                ++shard.stats.masked;
+            } else {
+                StageTimer timer(STAGE_GROUP);
+                if (!grouper->add(aln, shard_bits | shard.records)) {
+                    std::cerr << "Error: " << input_bam << " is not sorted by coordinate\n";
+                    return false;
+                }
+            }
+            ++shard.records;
+            CountItems(1);
+            return true;
+        });
+        if (grouper) {
+            grouper->finish([&](const std::string &qname, std::vector<PendingRead> &reads) {
+                shard.remaining.push_back({qname, std::move(reads)});
+            });
+        }
+        return read_ok;
+    });
+    if (!ok) {
+        return 1;
+    }
+
+    for (auto &shard : shards) {
+        std::cout << shard->log.str();
+        shard->log.str(std::string());
+        stats.merge(shard->stats);
+        processed_pairs += shard->processed_pairs;
+    }
+
+    // 跨分片汇总: 按分片顺序合并同名 reads 后选择配对
+    std::unordered_map<std::string, std::vector<PendingRead>> merged;
+    std::vector<std::string> order;
+    for (auto &shard : shards) {
+        for (auto &group : shard->remaining) {
+            auto it = merged.find(group.first);
+            if (it == merged.end()) {
+                it = merged.emplace(group.first, std::vector<PendingRead>()).first;
+                order.push_back(group.first);
+            }
+            it->second.insert(it->second.end(), group.second.begin(), group.second.end());
+        }
+        shard->remaining.clear();
+    }
+    GroupEngine engine;
+    for (const std::string &qname : order) {
+        uint64_t seq1, seq2;
+        if (choose_pending_pair(qname, merged[qname], options, engine, stats, std::cout, seq1, seq2)) {
+            for (uint64_t seq : {seq1, seq2}) {
+                set_pass_bit(shards[seq >> shard_seq_bits]->pass_bits, seq & ((uint64_t(1) << shard_seq_bits) - 1));
+            }
+            ++processed_pairs;
+        }
+    }
+    merged.clear();
+
+    // 第二遍: 各分片写出各自的 pass/fail BAM
+    std::string part_prefix = std::string(output_pass_bam) + ".shard." + std::to_string(getpid()) + ".";
+    ok = run_shard_tasks(shards, n_threads, [&](size_t k, Shard &shard) {
+        shard.pass_part = part_prefix + std::to_string(k) + ".pass.bam";
+        shard.fail_part = part_prefix + std::to_string(k) + ".fail.bam";
+        samFile *out_pass = nullptr;
+        samFile *out_fail = nullptr;
+        uint64_t seq = 0;
+        bool write_ok = for_each_shard_read(input_bam, thread_pool, shard, [&](bam1_t *aln, bam_hdr_t *header) {
+            if (out_pass == nullptr) {
+                out_pass = sam_open(shard.pass_part.c_str(), "wb");
+                out_fail = sam_open(shard.fail_part.c_str(), "wb");
+                if (out_pass == nullptr || out_fail == nullptr ||
+                    sam_hdr_write(out_pass, header) < 0 || sam_hdr_write(out_fail, header) < 0) {
+                    std::cerr << "Error: could not open shard BAM files " << shard.pass_part << "\n";
+                    return false;
+                }
+            }
+            bool pass = seq < shard.records && get_pass_bit(shard.pass_bits, seq);
+            ++seq;
+            if (write_record(pass ? out_pass : out_fail, header, aln) < 0) {
+                std::cerr << "Error: could not write alignment to shard BAM\n";
+                return false;
+            }
+            return true;
+        });
+        if (out_pass != nullptr) sam_close(out_pass);
+        if (out_fail != nullptr) sam_close(out_fail);
+        return write_ok;
+    });
+
+    // 拼接分片并建立 CSI 索引
+    std::vector<std::string> pass_parts, fail_parts;
+    for (auto &shard : shards) {
+        if (shard->records > 0) {
+            pass_parts.push_back(shard->pass_part);
+            fail_parts.push_back(shard->fail_part);
+        }
+    }
+    samFile *in = sam_open(input_bam, "rb");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : nullptr;
+    ok = ok && header != nullptr &&
+         concatenate_bams(pass_parts, output_pass_bam, header) && concatenate_bams(fail_parts, output_fail_bam, header) &&
+         sam_index_build(output_pass_bam, 14) == 0 && sam_index_build(output_fail_bam, 14) == 0;
+    clean_up_resources(nullptr, in, nullptr, nullptr, header);
+    for (size_t i = 0; i < pass_parts.size(); ++i) {
+        remove(pass_parts[i].c_str());
+        remove(fail_parts[i].c_str());
+    }
+    if (!ok) {
+        std::cerr << "Error: could not write sharded output BAM files\n";
+        return 1;
+    }
+    return 0;
+}
+
+// 批处理模式中一个已完成样本的记录。清单文件每行一个样本，行末是该行其余内容的 CRC32，
+// 中断时只写了一半的行校验不通过，该样本会被重新处理
+struct ManifestEntry {
+    std::string id;
+    uint64_t input_size = 0;
+    int64_t input_mtime = 0;
+    uint64_t pass_size = 0;
+    uint64_t fail_size = 0;
+    int pairs = 0;
+    double seconds = 0;
+};
+
+std::string format_manifest_line(const ManifestEntry &entry) {
+    std::ostringstream line;
+    line << entry.id << "\t" << entry.input_size << "\t" << entry.input_mtime << "\t" << entry.pass_size << "\t"
+         << entry.fail_size << "\t" << entry.pairs << "\t" << entry.seconds;
+    std::string text = line.str();
+    char crc[16];
+    snprintf(crc, sizeof(crc), "%08lx", crc32(0L, reinterpret_cast<const Bytef*>(text.data()), text.size()));
+    return text + "\t" + crc + "\n";
+}
+
+bool parse_manifest_line(const std::string &line, ManifestEntry &entry) {
+    size_t tab = line.rfind('\t');
+    if (tab == std::string::npos) {
+        return false;
+    }
+    std::string text = line.substr(0, tab);
+    char crc[16];
+    snprintf(crc, sizeof(crc), "%08lx", crc32(0L, reinterpret_cast<const Bytef*>(text.data()), text.size()));
+    if (line.compare(tab + 1, std::string::npos, crc) != 0) {
+        return false;
+    }
+    std::istringstream fields(text);
+    return static_cast<bool>(std::getline(fields, entry.id, '\t') >> entry.input_size >> entry.input_mtime
+                             >> entry.pass_size >> entry.fail_size >> entry.pairs >> entry.seconds);
+}
+
+bool stat_file(const std::string &path, uint64_t &size, int64_t &mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+// 清单中的样本只有在输入未改变、输出文件大小与记录一致时才跳过
+bool batch_sample_done(const ManifestEntry &entry, uint64_t input_size, int64_t input_mtime,
+                       const std::string &pass_bam, const std::string &fail_bam) {
+    uint64_t pass_size, fail_size;
+    int64_t mtime;
+    return entry.input_size == input_size && entry.input_mtime == input_mtime &&
+           stat_file(pass_bam, pass_size, mtime) && pass_size == entry.pass_size &&
+           stat_file(fail_bam, fail_size, mtime) && fail_size == entry.fail_size &&
+           access((pass_bam + ".csi").c_str(), F_OK) == 0 && access((fail_bam + ".csi").c_str(), F_OK) == 0;
+}
+
+// 批处理: 按 ID 列表处理 <bam_dir>/<id>.bam（坐标排序），输出 <output_dir>/<id>.pass.sorted.bam、
+// <id>.fail.sorted.bam 及其 CSI 索引和 <id>.log。n_jobs 个样本同时处理，空闲的 worker 从共享计数器领取下一个样本，
+// 所有样本的 BGZF 解压和压缩共用一个线程池。输出先写到 .part 文件，完成后改名并追加到清单，
+// 因此中断后重新运行只会处理清单中没有的样本
+int run_batch(const char *id_list_file, const char *bam_dir, const char *output_dir, const FilterOptions &options,
+              int n_threads, int n_jobs, size_t max_pending, bool exact_groups) {
+    std::ifstream id_list(id_list_file);
+    if (!id_list) {
+        std::cerr << "Error: ID list file " << id_list_file << " does not exist!\n";
+        return 1;
+    }
+    std::vector<std::string> ids;
+    std::string id;
+    while (std::getline(id_list, id)) {
+        id.erase(id.find_last_not_of(" \t\r") + 1);
+        if (!id.empty()) ids.push_back(id);
+    }
+
+    if (mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Error: could not create output directory " << output_dir << "\n";
+        return 1;
+    }
+    std::string manifest_file = std::string(output_dir) + "/filter_bam.manifest";
+    std::map<std::string, ManifestEntry> done;
+    std::ifstream manifest_in(manifest_file);
+    std::string line;
+    while (std::getline(manifest_in, line)) {
+        ManifestEntry entry;
+        if (parse_manifest_line(line, entry)) {
+            done[entry.id] = entry;
+        }
+    }
+    manifest_in.close();
+
+    // 只保留校验通过的行，丢弃中断时写了一半的行，之后的记录追加在完整的行之后
+    std::string manifest_tmp = manifest_file + ".tmp";
+    std::ofstream manifest_out(manifest_tmp);
+    for (const auto &item : done) {
+        manifest_out << format_manifest_line(item.second);
+    }
+    manifest_out.close();
+    if (manifest_out.fail() || rename(manifest_tmp.c_str(), manifest_file.c_str()) != 0) {
+        std::cerr << "Error: could not rewrite manifest " << manifest_file << "\n";
+        return 1;
+    }
+
+    // 跳过已完成的样本，其余样本按列表顺序排队
+    struct Sample {
+        std::string id;
+        std::string input;
+        std::string output;   // 输出文件名前缀
+        uint64_t input_size;
+        int64_t input_mtime;
+    };
+    std::vector<Sample> samples;
+    int skipped = 0;
+    int failed = 0;
+    for (const std::string &sample_id : ids) {
+        Sample sample{sample_id, std::string(bam_dir) + "/" + sample_id + ".bam", std::string(output_dir) + "/" + sample_id, 0, 0};
+        if (!stat_file(sample.input, sample.input_size, sample.input_mtime)) {
+            std::cerr << "Error: " << sample.input << " does not exist!\n";
+            ++failed;
+            continue;
+        }
+        auto it = done.find(sample_id);
+        if (it != done.end() && batch_sample_done(it->second, sample.input_size, sample.input_mtime,
+                                                  sample.output + ".pass.sorted.bam", sample.output + ".fail.sorted.bam")) {
+            std::cout << "Output files for " << sample_id << " already exist, skipping.\n";
+            ++skipped;
+            continue;
+        }
+        samples.push_back(sample);
+    }
+
+    htsThreadPool thread_pool = {nullptr, 0};
+    if (n_threads > 1) {
+        thread_pool.pool = hts_tpool_init(n_threads);
+        if (thread_pool.pool == nullptr) {
+            std::cerr << "Error: could not create thread pool\n";
+            return 1;
+        }
+    }
+    FILE *manifest = fopen(manifest_file.c_str(), "a");
+    if (manifest == nullptr) {
+        std::cerr << "Error: could not open manifest " << manifest_file << "\n";
+        if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+        return 1;
+    }
+
+    auto batch_start = std::chrono::steady_clock::now();
+    std::mutex report_mutex;
+    std::atomic<size_t> next(0);
+    uint64_t total_bytes = 0;
+    uint64_t total_pairs = 0;
+    int completed = 0;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::min<int>(n_jobs, samples.size()); ++t) {
+        workers.emplace_back([&] {
+            size_t k;
+            while ((k = next++) < samples.size()) {
+                const Sample &sample = samples[k];
+                auto start = std::chrono::steady_clock::now();
+                std::string pass_part = sample.output + ".pass.sorted.bam.part";
+                std::string fail_part = sample.output + ".fail.sorted.bam.part";
+                std::ofstream log(sample.output + ".log");
+                FilterStats stats;
+                int pairs = 0;
+                FilterOptions sample_options = options;  // --mask 按各样本自己的 header 绑定
+                int ret = !bind_mask(sample_options, sample.input.c_str()) ? 1 :
+                          run_coordinate_sorted(sample.input.c_str(), pass_part.c_str(), fail_part.c_str(), &thread_pool,
+                                                sample_options, max_pending, exact_groups, stats, pairs, log);
+                if (ret == 0 && options.log_level != LogLevel::off) {
+                    stats.write(log);
+                }
+                log << "Done! Processed " << pairs << " read pairs.\n";
+                log.close();
+
+                ManifestEntry entry;
+                entry.id = sample.id;
+                entry.input_size = sample.input_size;
+                entry.input_mtime = sample.input_mtime;
+                entry.pairs = pairs;
+                entry.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                int64_t mtime;
+                std::string pass_bam = sample.output + ".pass.sorted.bam";
+                std::string fail_bam = sample.output + ".fail.sorted.bam";
+                bool ok = ret == 0 && !log.fail() &&
+                          rename((pass_part + ".csi").c_str(), (pass_bam + ".csi").c_str()) == 0 &&
+                          rename((fail_part + ".csi").c_str(), (fail_bam + ".csi").c_str()) == 0 &&
+                          rename(pass_part.c_str(), pass_bam.c_str()) == 0 &&
+                          rename(fail_part.c_str(), fail_bam.c_str()) == 0 &&
+                          stat_file(pass_bam, entry.pass_size, mtime) && stat_file(fail_bam, entry.fail_size, mtime);
+
+                std::lock_guard<std::mutex> lock(report_mutex);
+                if (!ok) {
+                    std::cerr << "Error: processing " << sample.id << " failed, see " << sample.output << ".log\n";
+                    ++failed;
+                    continue;
+                }
+                std::string manifest_line = format_manifest_line(entry);
+                if (fputs(manifest_line.c_str(), manifest) < 0 || fflush(manifest) != 0 || fsync(fileno(manifest)) != 0) {
+                    std::cerr << "Error: could not write manifest " << manifest_file << "\n";
+                    ++failed;
+                    continue;
+                }
+                ++completed;
+                total_bytes += sample.input_size;
+                total_pairs += pairs;
+                std::cout << "Processed " << sample.id << ": " << pairs << " read pairs in " << entry.seconds << " s ("
+                          << sample.input_size / 1e6 / entry.seconds << " MB/s, "
+                          << pairs / entry.seconds << " pairs/s)\n" << std::flush;
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    fclose(manifest);
+    if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+    std::cout << "Batch: " << completed << " samples processed, " << skipped << " skipped, " << failed << " failed; " << total_pairs << " read pairs in " << seconds << " s ("
+              << total_bytes / 1e6 / seconds << " MB/s, " << total_pairs / seconds << " pairs/s)\n";
+    return failed == 0 ? 0 : 1;
+}
+
+// --benchmark: 将按名称分组的输入全部读入内存，分别测量 get_indel_count、is_proper_pair 和 process_read_group
+// 的耗时，以及 1..max_threads 个线程下读取、筛选和写出的端到端吞吐量。结果为 TSV:
+// 测试项、线程数、秒数、操作数、每次操作的纳秒数、每秒操作数
+void report_benchmark(const char *name, int threads, double seconds, uint64_t ops, const char *unit) {
+    std::cout << name << "\t" << threads << "\t" << seconds << "\t" << ops << "\t" << seconds * 1e9 / ops << "\t"
+              << ops / seconds << " " << unit << "/s\n" << std::flush;
+}
+
+int run_benchmark(const char *input_bam, const char *output_pass_bam, const char *output_fail_bam,
+                  const FilterOptions &options, int max_threads) {
+    samFile *in = sam_open(input_bam, "rb");
+    bam_hdr_t *header = in ? sam_hdr_read(in) : nullptr;
+    if (header == nullptr) {
+        std::cerr << "Error: could not read BAM file " << input_bam << "\n";
+        clean_up_resources(nullptr, in, nullptr, nullptr, nullptr);
+        return 1;
+    }
+    BamPool pool;
+    GroupReader reader(in, header, pool);
+    std::vector<std::vector<bam1_t*>> groups;
+    std::vector<bam1_t*> group;
+    while (reader.next(group)) {
+        groups.push_back(group);
+    }
+    clean_up_resources(nullptr, in, nullptr, nullptr, header);
+    uint64_t records = reader.records();
+    if (records == 0) {
+        std::cerr << "Error: " << input_bam << " has no records\n";
+        return 1;
+    }
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cout << "#benchmark\tthreads\tseconds\tops\tns_per_op\trate\n";
+    auto now = [] { return std::chrono::steady_clock::now(); };
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // 单条 read 的 CIGAR 扫描
+    auto start = now();
+    uint64_t indels = 0;
+    for (const auto &g : groups) {
+        for (bam1_t *aln : g) {
+            indels += get_indel_count(aln);
+        }
+    }
+    report_benchmark("get_indel_count", 1, seconds_since(start), records, "reads");
+
+    // 组内两两配对检查
+    start = now();
+    uint64_t checks = 0, proper = 0;
+    for (const auto &g : groups) {
+        for (size_t i = 0; i < g.size(); ++i) {
+            for (size_t j = i + 1; j < g.size(); ++j) {
+                proper += is_proper_pair(g[i], g[j], options.max_insert_size);
+                ++checks;
+            }
+        }
+    }
+    if (checks > 0) {
+        report_benchmark("is_proper_pair", 1, seconds_since(start), checks, "pairs");
+    }
+
+    // 内存中逐组筛选，不含读写；各线程处理连续的一段组
+    for (int threads : thread_counts) {
+        start = now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                GroupEngine engine;
+                GroupOutput out;
+                FilterStats stats;
+                std::ostream null_log(nullptr);  // 每个线程一个，避免共享流的状态位
+                std::vector<bam1_t*> current_group;
+                int processed_pairs = 0;
+                for (size_t k = groups.size() * t / threads; k < groups.size() * (t + 1) / threads; ++k) {
+                    current_group = groups[k];
+                    process_read_group(current_group, options, engine, out, stats, null_log, processed_pairs);
+                    out.pass.clear();
+                    out.fail.clear();
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        report_benchmark("process_read_group", threads, seconds_since(start), groups.size(), "groups");
+    }
+    for (auto &g : groups) {
+        pool.release(g);
+    }
+    groups.clear();
+
+    // 端到端: 读取、筛选并写出 BAM 文件
+    uint64_t input_size;
+    int64_t mtime;
+    stat_file(input_bam, input_size, mtime);
+    std::ostringstream log;
+    for (int threads : thread_counts) {
+        htsThreadPool thread_pool = {nullptr, 0};
+        if (threads > 1 && (thread_pool.pool = hts_tpool_init(threads)) == nullptr) {
+            std::cerr << "Error: could not create thread pool\n";
+            return 1;
+        }
+        FilterStats stats;
+        int processed_pairs = 0;
+        start = now();
+        int ret = run_name_grouped(input_bam, output_pass_bam, output_fail_bam, &thread_pool, options, threads,
+                                   stats, processed_pairs, log);
+        double seconds = seconds_since(start);
+        if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+        if (ret != 0) {
+            return ret;
+        }
+        report_benchmark("end_to_end", threads, seconds, records, "reads");
+        std::cout << "end_to_end_MB\t" << threads << "\t" << seconds << "\t" << input_size << "\t"
+                  << seconds * 1e9 / input_size << "\t" << input_size / 1e6 / seconds << " MB/s\n" << std::flush;
+        log.str(std::string());
+    }
+    std::cerr << "Checksum: " << indels << " indels, " << proper << " proper pairs\n";
+    return 0;
+}
+
+void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options] <input.bam> <output_pass.bam> <output_fail.bam> <mapQ_threshold> <max_insert_size> <max_snp> <max_indel>\n";
+    std::cerr << "       " << prog << " --batch [options] <id_list_file> <bam_directory> <output_directory> <mapQ_threshold> <max_insert_size> <max_snp> <max_indel>\n";
+    std::cerr << "  --threads N        use N threads for BGZF (de)compression and read group processing (default: 1)\n";
+    std::cerr << "  --coord-sorted     input is sorted by coordinate; pass/fail BAMs are written sorted by coordinate with CSI indexes\n";
+    std::cerr << "  --exact-groups     with --coord-sorted, group reads only after the whole input is read (for inputs with\n";
+    std::cerr << "                     secondary alignments that are not linked through mate or SA fields)\n";
+    std::cerr << "  --shard-by-contig  with an indexed coordinate-sorted input, process each contig on its own thread\n";
+    std::cerr << "  --regions R1,R2    like --shard-by-contig, but only for the given non-overlapping regions\n";
+    std::cerr << "  --max-pending N    with --coord-sorted, keep at most N unpaired reads in memory before spilling to disk (default: 10000000)\n";
+    std::cerr << "  --log-level L      off, summary (default: counters and histograms at exit), sampled (summary plus the\n";
+    std::cerr << "                     per-read log of one in every --log-sample read groups) or full (per-read log of every group)\n";
+    std::cerr << "  --log-sample N     with --log-level sampled, log one in every N read groups (default: 10000)\n";
+    std::cerr << "  --summary FILE     write the summary table to FILE instead of stdout\n";
+    std::cerr << "  --benchmark        with a name-grouped input, time get_indel_count, is_proper_pair and process_read_group\n";
+    std::cerr << "                     in memory, then the whole run at 1, 2, 4 .. --threads threads (the outputs are\n";
+    std::cerr << "                     overwritten on every run); prints a TSV table of timings\n";
+    std::cerr << "  --batch            process the coordinate-sorted <bam_directory>/<id>.bam of every ID in the list into\n";
+    std::cerr << "                     <output_directory>/<id>.{pass,fail}.sorted.bam and <id>.log; completed samples are recorded\n";
+    std::cerr << "                     in <output_directory>/filter_bam.manifest and skipped when the batch is run again\n";
+    std::cerr << "  --jobs N           with --batch, process N samples at once (default: threads / 4); --threads defaults to\n";
+    std::cerr << "                     the number of CPUs and sizes the BGZF thread pool shared by all samples\n";
+    std::cerr << "  --filter EXPR      before grouping, send reads that do not satisfy EXPR straight to the fail BAM, e.g.\n";
+    std::cerr << "                     '!secondary && !supplementary && !duplicate && abs(isize)<=1000'. Fields: mapq flag tid\n";
+    std::cerr << "                     pos mtid mpos isize and the flag bits paired proper unmapped munmap reverse mreverse\n";
+    std::cerr << "                     read1 read2 secondary qcfail duplicate supplementary. Reads with MAPQ below\n";
+    std::cerr << "                     <mapQ_threshold> are always rejected\n";
+    std::cerr << "  --mask F           send mapped reads that overlap a masked position of F straight to the fail BAM; F is a\n";
+    std::cerr << "                     mask written by build_position_mask, a .bed file or a 'chromosome position' list\n";
+    std::cerr << "  --progress S       every S seconds print the elapsed time, records read, records/s, peak RSS and the time\n";
+    std::cerr << "                     spent reading, grouping, scoring and writing to stderr\n";
+    std::cerr << "  --metrics FILE     write these timers and counters at the end of the run to FILE as JSON\n";
+}
+
+bool parse_log_level(const std::string &name, LogLevel &level) {
+    if (name == "off") {
+        level = LogLevel::off;
+    } else if (name == "summary") {
+        level = LogLevel::summary;
+    } else if (name == "sampled") {
+        level = LogLevel::sampled;
+    } else if (name == "full") {
+        level = LogLevel::full;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 汇总表写入 summary_file，未指定时写到标准输出
+int write_summary(const FilterOptions &options, const FilterStats &stats, const std::string &summary_file) {
+    if (options.log_level == LogLevel::off) {
+        return 0;
+    }
+    if (summary_file.empty()) {
+        stats.write(std::cout);
+        return 0;
+    }
+    std::ofstream out(summary_file);
+    stats.write(out);
+    if (!out) {
+        std::cerr << "Error: could not write summary file " << summary_file << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n_threads = 0;
+    int n_jobs = 0;
+    bool batch = false;
+    bool benchmark = false;
+    bool coord_sorted = false;
+    bool exact_groups = false;
+    bool shard_by_contig = false;
+    std::vector<std::string> regions;
+    size_t max_pending = 10000000;
+    FilterOptions options;
+    std::string summary_file;
+    std::string filter_expr;
+    std::string mask_file;
+    std::string metrics_file;
+    double progress_seconds = 0;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--threads" && i + 1 < argc) {
+            n_threads = std::stoi(argv[++i]);
+        } else if (opt == "--benchmark") {
+            benchmark = true;
+        } else if (opt == "--batch") {
+            batch = true;
+        } else if (opt == "--jobs" && i + 1 < argc) {
+            n_jobs = std::stoi(argv[++i]);
+        } else if (opt == "--coord-sorted") {
+            coord_sorted = true;
+        } else if (opt == "--shard-by-contig") {
+            shard_by_contig = true;
+        } else if (opt == "--regions" && i + 1 < argc) {
+            std::stringstream list(argv[++i]);
+            std::string region;
+            while (std::getline(list, region, ',')) {
+                if (!region.empty()) regions.push_back(region);
+            }
+        } else if (opt == "--exact-groups") {
+            exact_groups = true;
+        } else if (opt == "--max-pending" && i + 1 < argc) {
+            max_pending = std::stoul(argv[++i]);
+        } else if (opt == "--log-level" && i + 1 < argc) {
+            if (!parse_log_level(argv[++i], options.log_level)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == "--log-sample" && i + 1 < argc) {
+            options.log_sample = std::stoul(argv[++i]);
+        } else if (opt == "--summary" && i + 1 < argc) {
+            summary_file = argv[++i];
+        } else if (opt == "--filter" && i + 1 < argc) {
+            filter_expr = argv[++i];
+        } else if (opt == "--mask" && i + 1 < argc) {
+            mask_file = argv[++i];
+        } else if (opt == "--metrics" && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (opt == "--progress" && i + 1 < argc) {
+            progress_seconds = std::stod(argv[++i]);
+        } else if (opt.compare(0, 2, "--") == 0) {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (n_threads == 0) {
+        n_threads = batch ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+    }
+    if (n_jobs == 0) {
+        n_jobs = std::max(1, n_threads / 4);
+    }
+    if (args.size() != 7 || n_threads < 1 || n_jobs < 1 || options.log_sample == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *input_bam = args[0];
+    const char *output_pass_bam = args[1];
+    const char *output_fail_bam = args[2];
+    options.mapQ_threshold = std::stoi(args[3]);
+    options.max_insert_size = std::stoi(args[4]);
+    options.max_snp = std::stoi(args[5]);
+    options.max_indel = std::stoi(args[6]);
+
+    // mapQ_threshold 作为过滤表达式的一部分，与 --filter 同时生效
+    std::string expr = "mapq>=" + std::to_string(options.mapQ_threshold);
+    if (!filter_expr.empty()) {
+        expr += " && (" + filter_expr + ")";
+    }
+    std::string filter_error;
+    if (!options.filter.compile(expr, filter_error)) {
+        std::cerr << "Error: invalid filter expression '" << filter_expr << "': " << filter_error << "\n";
+        return 1;
+    }
+
+    // 屏蔽文件以只读方式映射，多个并行运行共享同一份页缓存
+    PositionMask mask;
+    if (!mask_file.empty()) {
+        std::string mask_error;
+        if (!LoadPositionMask(mask_file, mask, mask_error)) {
+            std::cerr << "Error: " << mask_error << "\n";
+            return 1;
+        }
+        options.mask = &mask;
+    }
+
+    if (!batch && !bind_mask(options, input_bam)) {
+        return 1;
+    }
+    if (benchmark) {
+        return run_benchmark(input_bam, output_pass_bam, output_fail_bam, options, n_threads);
+    }
+
+    // 未指定 --progress/--metrics 时 g_run_metrics 为空，各计时点只做一次判断
+    RunMetrics metrics;
+    if (!metrics_file.empty() || progress_seconds > 0) {
+        StartRunMetrics(metrics, METRICS_STAGES, "records", progress_seconds);
+    }
+    auto finish_metrics = [&](int ret) {
+        if (g_run_metrics == nullptr) {
+            return ret;
+        }
+        StopRunMetrics(metrics);
+        if (!metrics_file.empty() && !WriteRunMetrics(metrics, "filter_bam", metrics_file)) {
+            std::cerr << "Error: could not write metrics file " << metrics_file << "\n";
+            return ret != 0 ? ret : 1;
+        }
+        return ret;
+    };
+    if (batch) {
+        return finish_metrics(run_batch(args[0], args[1], args[2], options, n_threads, n_jobs, max_pending, exact_groups));
+    }
+
+    // 输入和两个输出共享一个 htslib 线程池，用于 BGZF 的解压和压缩
+    htsThreadPool thread_pool = {nullptr, 0};
+    if (n_threads > 1) {
+        thread_pool.pool = hts_tpool_init(n_threads);
+        if (thread_pool.pool == nullptr) {
+            std::cerr << "Error: could not create thread pool\n";
+            return finish_metrics(1);
+        }
+    }
+
+    FilterStats stats;
+    int processed_pairs = 0;
+    if (shard_by_contig || !regions.empty()) {
+        int ret = run_sharded(input_bam, output_pass_bam, output_fail_bam, &thread_pool, regions, n_threads,
+                              options, max_pending, exact_groups, stats, processed_pairs);
+        if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+        if (ret == 0) {
+            ret = write_summary(options, stats, summary_file);
+            std::cout << "Done! Processed " << processed_pairs << " read pairs.\n";
+        }
+        return finish_metrics(ret);
+    }
+    if (coord_sorted) {
+        int ret = run_coordinate_sorted(input_bam, output_pass_bam, output_fail_bam, &thread_pool,
+                                        options, max_pending, exact_groups, stats, processed_pairs, std::cout);
+        if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+        if (ret == 0) {
+            ret = write_summary(options, stats, summary_file);
+            std::cout << "Done! Processed " << processed_pairs << " read pairs.\n";
+        }
+        return finish_metrics(ret);
+    }
+
+    int ret = run_name_grouped(input_bam, output_pass_bam, output_fail_bam, &thread_pool, options, n_threads,
+                               stats, processed_pairs, std::cout);
+    // 线程池必须在所有文件关闭之后销毁
+    if (thread_pool.pool != nullptr) hts_tpool_destroy(thread_pool.pool);
+    if (ret == 0) {
+        ret = write_summary(options, stats, summary_file);
+        std::cout << "Done! Processed " << processed_pairs << " read pairs.\n";
+    }
+    return finish_metrics(ret);
+}
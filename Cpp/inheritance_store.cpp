@@ -0,0 +1,263 @@
+// Builds, summarizes and exports an inheritance store (inheritance_store.h), the memory-mapped
+// replacement of the MySQL tables f2inheritance, f2fragmentinheritance, f2fragmentinheritance_window100k
+// and f2inheritance_100k_allelecount.
+//
+// An export selects the groups (F2 and chromosome) of a chromosome, sex or F2 from the group index,
+// seeks each to the first window of the range by binary search on its runs, and writes the rows in
+// the TSV layout of the table. Groups are formatted in parallel and written in store order
+// (chromosome, then F2).
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include "inheritance_store.h"
+
+using namespace std;
+
+struct ExportOptions
+{
+    string table,chr,f2;
+    int sex;              // -1 both, 0 female, 1 male
+    StoreRange range;
+    int threads;
+};
+
+// Groups, F2, SNPs and runs of every chromosome
+void PrintStoreSummary(const InheritanceStore &store, const string &filename)
+{
+    uint64_t snps,snpruns,windowruns,g;
+    uint32_t c,sexes[2];
+
+    cout << filename << ": " << store.header->nf2 << " F2, " << store.header->nchroms << " chromosomes, "
+         << store.header->ngroups << " groups, window size " << store.header->window_size << ", " << store.size << " bytes\n";
+    cout << "Chr\tMales\tFemales\tSNPs\tSNPRuns\tWindowRuns\n";
+    for(c=0; c<store.header->nchroms; c++)
+    {
+        const InheritanceStoreChrom &chrom = store.chroms[c];
+        snps = snpruns = windowruns = 0;
+        sexes[0] = sexes[1] = 0;
+        for(g=chrom.first_group; g<chrom.first_group+chrom.ngroups; g++)
+        {
+            const InheritanceStoreGroup &group = store.groups[g];
+            sexes[store.f2s[group.f2].sex]++;
+            snps += group.nsnps;
+            snpruns += group.nsnpruns[0]+group.nsnpruns[1];
+            windowruns += group.nwindowruns[0]+group.nwindowruns[1];
+        }
+        cout << StoreChromName(store, c) << "\t" << sexes[1] << "\t" << sexes[0] << "\t" << snps << "\t" << snpruns << "\t" << windowruns << "\n";
+    }
+}
+
+// The groups an export covers, in store order
+bool SelectGroups(const InheritanceStore &store, const ExportOptions &options, vector<uint64_t> &groups, string &error)
+{
+    uint64_t first,last,g;
+    uint32_t f2 = UINT32_MAX;
+
+    first = 0;
+    last = store.header->ngroups;
+    if(options.chr!="")
+    {
+        auto it = store.chromindex.find(options.chr);
+        if(it==store.chromindex.end())
+        {
+            error = "chromosome " + options.chr + " is not in the store";
+            return false;
+        }
+        first = store.chroms[it->second].first_group;
+        last = first+store.chroms[it->second].ngroups;
+    }
+    if(options.f2!="")
+    {
+        auto it = store.f2index.find(options.f2);
+        if(it==store.f2index.end())
+        {
+            error = "F2 " + options.f2 + " is not in the store";
+            return false;
+        }
+        f2 = it->second;
+    }
+    for(g=first; g<last; g++)
+        if((f2==UINT32_MAX || store.groups[g].f2==f2) && (options.sex<0 || (int)store.f2s[store.groups[g].f2].sex==options.sex))
+            groups.push_back(g);
+    return true;
+}
+
+void FormatGroup(const InheritanceStore &store, const ExportOptions &options, uint64_t g, string &text)
+{
+    if(options.table=="snps")
+        AppendStoreSnps(store, g, options.range, text);
+    else if(options.table=="fragments")
+        AppendStoreFragments(store, g, options.range, text);
+    else if(options.table=="windows")
+        AppendStoreWindows(store, g, options.range, text);
+    else
+        AppendStoreAlleleCounts(store, g, options.range, text);
+}
+
+int ExportStore(const string &filename, const string &output, const ExportOptions &options)
+{
+    InheritanceStore store;
+    vector<uint64_t> groups;
+    string error;
+    size_t start,end,batch;
+    int i;
+
+    if(!OpenInheritanceStore(filename, store, error) || !SelectGroups(store, options, groups, error))
+    {
+        CloseInheritanceStore(store);
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    ofstream file;
+    if(output!="-")
+    {
+        file.open(output.c_str());
+        if(!file)
+        {
+            CloseInheritanceStore(store);
+            cerr << "Error: could not write " << output << endl;
+            return 1;
+        }
+    }
+    ostream &out = output=="-" ? cout : file;
+
+    // A batch of groups is formatted on the threads and written before the next one
+    batch = 64*options.threads;
+    for(start=0; start<groups.size(); start=end)
+    {
+        end = min(groups.size(), start+batch);
+        vector<string> texts(end-start);
+        atomic<size_t> next(start);
+        vector<thread> workers;
+        for(i=0; i<options.threads; i++)
+            workers.emplace_back([&]()
+            {
+                size_t k;
+                while((k = next++) < end)
+                    FormatGroup(store, options, groups[k], texts[k-start]);
+            });
+        for(auto &worker : workers)
+            worker.join();
+        for(const string &text : texts)
+            out << text;
+    }
+    out.flush();
+    CloseInheritanceStore(store);
+    if(!out)
+    {
+        cerr << "Error: could not write " << output << endl;
+        return 1;
+    }
+    return 0;
+}
+
+void PrintUsage(const char *program)
+{
+    cout << "Usage: " << program << " build store.inh [--snps f2.inheritance.txt] [--windows f2fragmentinheritance_window100k.txt]\n";
+    cout << "       [--window-size 100000]\n";
+    cout << "       " << program << " info store.inh\n";
+    cout << "       " << program << " export store.inh snps|fragments|windows|allelecount output.txt [--chr C]\n";
+    cout << "       [--range FIRST-LAST] [--sex male|female] [--f2 ID] [--threads N]\n";
+    cout << "  build     stores the per-SNP inheritance (f2 chr pos f1father f1mother) as runs of equal labels and the\n";
+    cout << "            window table (f2 chr window inheritance origin) as runs of equal windows, per F2 and chromosome;\n";
+    cout << "            the inputs may be gzipped, and the records of an F2 and chromosome must be contiguous.\n";
+    cout << "            --window-size is the window of the window table, used to select the SNPs of a window range.\n";
+    cout << "  info      prints the F2, SNPs and runs of every chromosome\n";
+    cout << "  export    writes a table in its TSV layout (output - for stdout):\n";
+    cout << "            snps         f2inheritance: f2 chr pos f1father f1mother\n";
+    cout << "            fragments    f2fragmentinheritance (f2inheritance.length.txt): f2 chr start end inheritance origin\n";
+    cout << "            windows      f2fragmentinheritance_window100k: f2 chr window inheritance origin\n";
+    cout << "            allelecount  f2inheritance_100k_allelecount: f2 chr window Pallelecount Mallelecount\n";
+    cout << "            --chr, --sex (males have odd ids) and --f2 select the groups, --range the windows (and the\n";
+    cout << "            SNPs and fragments in their bases); --threads N formats N groups at once.\n";
+}
+
+int main(int argc,char *argv[])
+{
+    InheritanceStoreBuilder builder;
+    ExportOptions options;
+    vector<string> args,snpfiles,windowfiles;
+    string error;
+    size_t k;
+    int i;
+
+    options.sex = -1;
+    options.threads = 1;
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--snps" && i+1<argc)
+            snpfiles.push_back(argv[++i]);
+        else if(opt=="--windows" && i+1<argc)
+            windowfiles.push_back(argv[++i]);
+        else if(opt=="--range" && i+1<argc)
+        {
+            string range = argv[++i];
+            size_t dash = range.find('-');
+            options.range.first = atol(range.substr(0, dash).c_str());
+            options.range.last = dash==string::npos ? options.range.first : atol(range.substr(dash+1).c_str());
+        }
+        else if(opt=="--window-size" && i+1<argc)
+            builder.window_size = atol(argv[++i]);
+        else if(opt=="--chr" && i+1<argc)
+            options.chr = argv[++i];
+        else if(opt=="--f2" && i+1<argc)
+            options.f2 = argv[++i];
+        else if(opt=="--sex" && i+1<argc)
+        {
+            string sex = argv[++i];
+            options.sex = sex=="male" ? 1 : sex=="female" ? 0 : -2;
+        }
+        else if(opt=="--threads" && i+1<argc)
+            options.threads = atoi(argv[++i]);
+        else
+            args.push_back(opt);
+    }
+
+    if(args.size()==2 && args[0]=="build" && (!snpfiles.empty() || !windowfiles.empty()) && builder.window_size>0)
+    {
+        for(k=0; k<snpfiles.size(); k++)
+            if(!LoadStoreSnps(builder, snpfiles[k], error))
+            {
+                cerr << "Error: " << error << endl;
+                return 1;
+            }
+        for(k=0; k<windowfiles.size(); k++)
+            if(!LoadStoreWindows(builder, windowfiles[k], error))
+            {
+                cerr << "Error: " << error << endl;
+                return 1;
+            }
+        if(!WriteInheritanceStore(builder, args[1]))
+        {
+            cerr << "Error: could not write " << args[1] << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if(args.size()==2 && args[0]=="info")
+    {
+        InheritanceStore store;
+        if(!OpenInheritanceStore(args[1], store, error))
+        {
+            cerr << "Error: " << error << endl;
+            return 1;
+        }
+        PrintStoreSummary(store, args[1]);
+        CloseInheritanceStore(store);
+        return 0;
+    }
+    if(args.size()==4 && args[0]=="export" && options.sex>=-1 && options.threads>=1 && options.range.first<=options.range.last
+       && (args[2]=="snps" || args[2]=="fragments" || args[2]=="windows" || args[2]=="allelecount"))
+    {
+        options.table = args[2];
+        return ExportStore(args[1], args[3], options);
+    }
+    PrintUsage(argv[0]);
+    return 0;
+}
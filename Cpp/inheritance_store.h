@@ -0,0 +1,768 @@
+// Indexed on-disk store of the F2 inheritance, in place of the MySQL tables f2inheritance,
+// f2fragmentinheritance, f2fragmentinheritance_window100k and f2inheritance_100k_allelecount.
+// Built once by inheritance_store from f2.inheritance.txt and the window table, then memory-mapped
+// read-only, so that range scans run on the page cache without a copy or a database server.
+//
+// Layout, little-endian, every array starting on an 8-byte boundary:
+//   InheritanceStoreHeader
+//   InheritanceStoreF2[nf2], InheritanceStoreChrom[nchroms], InheritanceStoreGroup[ngroups]
+//   per group: positions[nsnps] (uint32), SNP runs of the paternal and maternal labels,
+//              window runs of the paternal and maternal inheritances
+//   names: the F2 and chromosome names, not terminated
+// A group is one F2 and chromosome. The groups are sorted by chromosome and F2, so a chromosome is
+// one range of groups; F2 and chromosomes are in id order (numeric ids as numbers). A label run
+// covers the SNPs from its first one to the first one of the next run. A window run covers the
+// windows start..end that have the same number of rows of each inheritance; windows without rows
+// are not stored. Groups with the same SNP positions share one positions array.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "text_input.h"
+
+#define INHERITANCE_STORE_MAGIC "INHSTOR"
+#define INHERITANCE_STORE_VERSION 1
+#define STORE_PATERNAL 0
+#define STORE_MATERNAL 1
+
+struct InheritanceStoreHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t window_size;                 // bases per window of the window runs
+    uint32_t nf2,nchroms;
+    uint64_t ngroups;
+    uint64_t f2_offset,chrom_offset,group_offset;
+    uint64_t names_offset,names_length;
+};
+
+struct InheritanceStoreF2
+{
+    uint64_t name_offset;                 // relative to names_offset
+    uint32_t name_length;
+    uint32_t sex;                         // 1 male (odd id), 0 female
+};
+
+struct InheritanceStoreChrom
+{
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t ngroups;
+    uint64_t first_group;
+};
+
+struct InheritanceStoreGroup
+{
+    uint32_t f2,chrom;
+    uint32_t nsnps;
+    uint32_t nsnpruns[2],nwindowruns[2];  // STORE_PATERNAL, STORE_MATERNAL
+    uint32_t reserved;
+    uint64_t positions_offset;
+    uint64_t snpruns_offset[2],windowruns_offset[2];
+};
+
+// The label (f1father or f1mother) of the SNPs from first to the first SNP of the next run
+struct InheritanceSnpRun
+{
+    uint32_t first;
+    int32_t label;
+};
+
+// The windows start..end, each with count[i] rows of inheritance i
+struct InheritanceWindowRun
+{
+    uint32_t start,end;
+    uint16_t count[2];
+};
+
+// One F2 and chromosome while the store is built
+struct InheritanceBuildGroup
+{
+    uint32_t f2,chrom;
+    bool hassnps = false,haswindows = false;
+    std::vector<uint32_t> positions;
+    std::vector<InheritanceSnpRun> snpruns[2];
+    std::vector<InheritanceWindowRun> windowruns[2];
+};
+
+struct InheritanceStoreBuilder
+{
+    uint32_t window_size = 100000;
+    std::vector<std::string> f2ids,chroms;
+    std::unordered_map<std::string,uint32_t> f2index,chromindex;
+    std::map<std::pair<uint32_t,uint32_t>,size_t> groupindex;     // (f2, chrom)
+    std::vector<InheritanceBuildGroup> groups;
+};
+
+inline uint32_t StoreSexOfF2(const std::string &f2)
+{
+    return atol(f2.c_str())%2!=0 ? 1 : 0;
+}
+
+// The index of the group of an F2 and chromosome, created on first use
+inline size_t StoreBuildGroup(InheritanceStoreBuilder &builder, const char *f2, const char *chr)
+{
+    auto f = builder.f2index.emplace(f2, builder.f2ids.size());
+    if(f.second)
+        builder.f2ids.push_back(f2);
+    auto c = builder.chromindex.emplace(chr, builder.chroms.size());
+    if(c.second)
+        builder.chroms.push_back(chr);
+    auto g = builder.groupindex.emplace(std::make_pair(f.first->second, c.first->second), builder.groups.size());
+    if(g.second)
+    {
+        builder.groups.emplace_back();
+        builder.groups.back().f2 = f.first->second;
+        builder.groups.back().chrom = c.first->second;
+    }
+    return g.first->second;
+}
+
+// Sorts the records of a group by position and turns each label column into runs
+inline void FinishStoreSnps(InheritanceBuildGroup &group, std::vector<uint32_t> &pos, std::vector<int32_t> &labels)
+{
+    std::vector<size_t> order(pos.size());
+    size_t i;
+    int o;
+
+    for(i=0; i<order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return pos[a]<pos[b]; });
+    group.positions.resize(order.size());
+    for(i=0; i<order.size(); i++)
+    {
+        group.positions[i] = pos[order[i]];
+        for(o=0; o<2; o++)
+            if(group.snpruns[o].empty() || group.snpruns[o].back().label!=labels[order[i]*2+o])
+                group.snpruns[o].push_back(InheritanceSnpRun{(uint32_t)i, labels[order[i]*2+o]});
+    }
+    group.hassnps = true;
+    pos.clear();
+    labels.clear();
+}
+
+// Counts the rows of every window, origin and inheritance and merges equal neighbouring windows
+inline void FinishStoreWindows(InheritanceBuildGroup &group, std::vector<uint64_t> &rows)
+{
+    size_t i,k;
+    uint32_t window;
+    int o;
+
+    // A row is origin << 33 | window << 1 | inheritance
+    std::sort(rows.begin(), rows.end());
+    for(i=0; i<rows.size(); i=k)
+    {
+        InheritanceWindowRun run = {(uint32_t)(rows[i]>>1), (uint32_t)(rows[i]>>1), {0,0}};
+        o = rows[i]>>33;
+        window = run.start;
+        for(k=i; k<rows.size() && rows[k]>>1==rows[i]>>1; k++)
+            if(run.count[rows[k]&1]<UINT16_MAX)
+                run.count[rows[k]&1]++;
+        std::vector<InheritanceWindowRun> &runs = group.windowruns[o];
+        if(!runs.empty() && runs.back().end+1==window && runs.back().count[0]==run.count[0] && runs.back().count[1]==run.count[1])
+            runs.back().end = window;
+        else
+            runs.push_back(run);
+    }
+    group.haswindows = true;
+    rows.clear();
+}
+
+// f2.inheritance.txt (f2 chr pos f1father f1mother), plain or gzipped; the records of an F2 and
+// chromosome must be contiguous
+inline bool LoadStoreSnps(InheritanceStoreBuilder &builder, const std::string &filename, std::string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    std::vector<char*> fields;
+    std::vector<uint32_t> pos;
+    std::vector<int32_t> labels;
+    size_t group = SIZE_MAX;
+    std::string line;
+    size_t lineno = 0;
+    long p;
+
+    if(fp==NULL)
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    while(ReadGzLine(fp, line))
+    {
+        lineno++;
+        SplitFields(line, fields);
+        if(fields.empty())
+            continue;
+        if(fields.size()!=5)
+        {
+            error = filename + " line " + std::to_string(lineno) + ": expected 'f2 chr pos f1father f1mother'";
+            gzclose(fp);
+            return false;
+        }
+        size_t current = StoreBuildGroup(builder, fields[0], fields[1]);
+        if(current!=group)
+        {
+            if(group!=SIZE_MAX)
+                FinishStoreSnps(builder.groups[group], pos, labels);
+            group = current;
+            if(builder.groups[group].hassnps)
+            {
+                error = filename + " line " + std::to_string(lineno) + ": the records of F2 " + fields[0] + " chromosome " + fields[1] + " are not contiguous";
+                gzclose(fp);
+                return false;
+            }
+        }
+        p = atol(fields[2]);
+        if(p<0 || p>UINT32_MAX)
+        {
+            error = filename + " line " + std::to_string(lineno) + ": bad position";
+            gzclose(fp);
+            return false;
+        }
+        pos.push_back(p);
+        labels.push_back(atoi(fields[3]));
+        labels.push_back(atoi(fields[4]));
+    }
+    if(group!=SIZE_MAX)
+        FinishStoreSnps(builder.groups[group], pos, labels);
+    gzclose(fp);
+    return true;
+}
+
+// f2fragmentinheritance_window100k (f2 chr window inheritance origin), plain or gzipped; the records
+// of an F2 and chromosome must be contiguous
+inline bool LoadStoreWindows(InheritanceStoreBuilder &builder, const std::string &filename, std::string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    std::vector<char*> fields;
+    std::vector<uint64_t> rows;
+    size_t group = SIZE_MAX;
+    std::string line;
+    size_t lineno = 0;
+    long window;
+    int inheritance;
+
+    if(fp==NULL)
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    while(ReadGzLine(fp, line))
+    {
+        lineno++;
+        SplitFields(line, fields);
+        if(fields.empty())
+            continue;
+        window = fields.size()==5 ? atol(fields[2]) : -1;
+        inheritance = fields.size()==5 ? atoi(fields[3]) : -1;
+        if(fields.size()!=5 || window<0 || window>=UINT32_MAX || (inheritance!=0 && inheritance!=1)
+           || (strcmp(fields[4], "P")!=0 && strcmp(fields[4], "M")!=0))
+        {
+            error = filename + " line " + std::to_string(lineno) + ": expected 'f2 chr window inheritance origin'";
+            gzclose(fp);
+            return false;
+        }
+        size_t current = StoreBuildGroup(builder, fields[0], fields[1]);
+        if(current!=group)
+        {
+            if(group!=SIZE_MAX)
+                FinishStoreWindows(builder.groups[group], rows);
+            group = current;
+            if(builder.groups[group].haswindows)
+            {
+                error = filename + " line " + std::to_string(lineno) + ": the records of F2 " + fields[0] + " chromosome " + fields[1] + " are not contiguous";
+                gzclose(fp);
+                return false;
+            }
+        }
+        rows.push_back((uint64_t)(fields[4][0]=='M' ? STORE_MATERNAL : STORE_PATERNAL) << 33 | (uint64_t)window << 1 | inheritance);
+    }
+    if(group!=SIZE_MAX)
+        FinishStoreWindows(builder.groups[group], rows);
+    gzclose(fp);
+    return true;
+}
+
+inline uint64_t AlignInheritanceStore(uint64_t offset)
+{
+    return (offset+7) & ~(uint64_t)7;
+}
+
+// Writes size bytes at offset, after zeros up to it
+inline bool WriteStoreAt(FILE *fp, uint64_t &written, uint64_t offset, const void *data, size_t size)
+{
+    static const char zeros[8] = {0};
+    if(offset<written || offset-written>sizeof(zeros))
+        return false;
+    if(fwrite(zeros, 1, offset-written, fp)!=offset-written || (size>0 && fwrite(data, 1, size, fp)!=size))
+        return false;
+    written = offset+size;
+    return true;
+}
+
+// Lays the store out and writes it; false when the file cannot be written
+inline bool WriteInheritanceStore(const InheritanceStoreBuilder &builder, const std::string &filename)
+{
+    InheritanceStoreHeader header;
+    std::vector<InheritanceStoreF2> f2s;
+    std::vector<InheritanceStoreChrom> chroms;
+    std::vector<InheritanceStoreGroup> groups;
+    std::vector<uint32_t> f2order,chromorder,f2rank,chromrank;
+    std::vector<size_t> order,shared;
+    std::unordered_multimap<uint64_t,size_t> positionhash;
+    std::string names;
+    uint64_t offset,written,hash;
+    size_t i,g;
+    bool ok;
+    int o;
+
+    f2order.resize(builder.f2ids.size());
+    f2rank.resize(builder.f2ids.size());
+    for(i=0; i<f2order.size(); i++)
+        f2order[i] = i;
+    std::sort(f2order.begin(), f2order.end(), [&](uint32_t a, uint32_t b) { return IdLess(builder.f2ids[a], builder.f2ids[b]); });
+    chromorder.resize(builder.chroms.size());
+    chromrank.resize(builder.chroms.size());
+    for(i=0; i<chromorder.size(); i++)
+        chromorder[i] = i;
+    std::sort(chromorder.begin(), chromorder.end(), [&](uint32_t a, uint32_t b) { return IdLess(builder.chroms[a], builder.chroms[b]); });
+
+    for(i=0; i<f2order.size(); i++)
+    {
+        const std::string &id = builder.f2ids[f2order[i]];
+        f2rank[f2order[i]] = i;
+        f2s.push_back(InheritanceStoreF2{names.size(), (uint32_t)id.size(), StoreSexOfF2(id)});
+        names += id;
+    }
+    for(i=0; i<chromorder.size(); i++)
+    {
+        const std::string &id = builder.chroms[chromorder[i]];
+        chromrank[chromorder[i]] = i;
+        chroms.push_back(InheritanceStoreChrom{names.size(), (uint32_t)id.size(), 0, 0});
+        names += id;
+    }
+
+    order.resize(builder.groups.size());
+    for(i=0; i<order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        const InheritanceBuildGroup &x = builder.groups[a],&y = builder.groups[b];
+        if(chromrank[x.chrom]!=chromrank[y.chrom])
+            return chromrank[x.chrom]<chromrank[y.chrom];
+        return f2rank[x.f2]<f2rank[y.f2];
+    });
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INHERITANCE_STORE_MAGIC, sizeof(INHERITANCE_STORE_MAGIC));
+    header.version = INHERITANCE_STORE_VERSION;
+    header.window_size = builder.window_size;
+    header.nf2 = f2s.size();
+    header.nchroms = chroms.size();
+    header.ngroups = order.size();
+    header.f2_offset = AlignInheritanceStore(sizeof(header));
+    header.chrom_offset = AlignInheritanceStore(header.f2_offset+f2s.size()*sizeof(InheritanceStoreF2));
+    header.group_offset = AlignInheritanceStore(header.chrom_offset+chroms.size()*sizeof(InheritanceStoreChrom));
+    offset = AlignInheritanceStore(header.group_offset+order.size()*sizeof(InheritanceStoreGroup));
+
+    // Offsets of the arrays; a positions array equal to one of an earlier group is not stored again
+    shared.assign(order.size(), SIZE_MAX);
+    for(g=0; g<order.size(); g++)
+    {
+        const InheritanceBuildGroup &b = builder.groups[order[g]];
+        InheritanceStoreGroup d;
+        memset(&d, 0, sizeof(d));
+        d.f2 = f2rank[b.f2];
+        d.chrom = chromrank[b.chrom];
+        d.nsnps = b.positions.size();
+        if(chroms[d.chrom].ngroups++==0)
+            chroms[d.chrom].first_group = g;
+
+        hash = 1469598103934665603ULL ^ d.chrom;
+        for(uint32_t p : b.positions)
+            hash = (hash ^ p)*1099511628211ULL;
+        auto range = positionhash.equal_range(hash);
+        for(auto it=range.first; it!=range.second && shared[g]==SIZE_MAX; ++it)
+            if(builder.groups[order[it->second]].positions==b.positions && groups[it->second].chrom==d.chrom)
+                shared[g] = it->second;
+        if(shared[g]!=SIZE_MAX)
+            d.positions_offset = groups[shared[g]].positions_offset;
+        else
+        {
+            positionhash.emplace(hash, g);
+            d.positions_offset = offset;
+            offset = AlignInheritanceStore(offset+b.positions.size()*sizeof(uint32_t));
+        }
+        for(o=0; o<2; o++)
+        {
+            d.nsnpruns[o] = b.snpruns[o].size();
+            d.snpruns_offset[o] = offset;
+            offset = AlignInheritanceStore(offset+b.snpruns[o].size()*sizeof(InheritanceSnpRun));
+        }
+        for(o=0; o<2; o++)
+        {
+            d.nwindowruns[o] = b.windowruns[o].size();
+            d.windowruns_offset[o] = offset;
+            offset = AlignInheritanceStore(offset+b.windowruns[o].size()*sizeof(InheritanceWindowRun));
+        }
+        groups.push_back(d);
+    }
+    header.names_offset = offset;
+    header.names_length = names.size();
+
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if(fp==NULL)
+        return false;
+    written = 0;
+    ok = WriteStoreAt(fp, written, 0, &header, sizeof(header))
+         && WriteStoreAt(fp, written, header.f2_offset, f2s.data(), f2s.size()*sizeof(InheritanceStoreF2))
+         && WriteStoreAt(fp, written, header.chrom_offset, chroms.data(), chroms.size()*sizeof(InheritanceStoreChrom))
+         && WriteStoreAt(fp, written, header.group_offset, groups.data(), groups.size()*sizeof(InheritanceStoreGroup));
+    for(g=0; g<order.size() && ok; g++)
+    {
+        const InheritanceBuildGroup &b = builder.groups[order[g]];
+        if(shared[g]==SIZE_MAX)
+            ok = WriteStoreAt(fp, written, groups[g].positions_offset, b.positions.data(), b.positions.size()*sizeof(uint32_t));
+        for(o=0; o<2 && ok; o++)
+            ok = WriteStoreAt(fp, written, groups[g].snpruns_offset[o], b.snpruns[o].data(), b.snpruns[o].size()*sizeof(InheritanceSnpRun));
+        for(o=0; o<2 && ok; o++)
+            ok = WriteStoreAt(fp, written, groups[g].windowruns_offset[o], b.windowruns[o].data(), b.windowruns[o].size()*sizeof(InheritanceWindowRun));
+    }
+    ok = ok && WriteStoreAt(fp, written, header.names_offset, names.data(), names.size()) && !ferror(fp);
+    return fclose(fp)==0 && ok;
+}
+
+// A mapped store; the pointers point into the mapping
+struct InheritanceStore
+{
+    void *map = NULL;
+    size_t size = 0;
+    const InheritanceStoreHeader *header = NULL;
+    const InheritanceStoreF2 *f2s = NULL;
+    const InheritanceStoreChrom *chroms = NULL;
+    const InheritanceStoreGroup *groups = NULL;
+    const char *names = NULL;
+    std::unordered_map<std::string,uint32_t> f2index,chromindex;
+};
+
+// The arrays of one group
+struct InheritanceGroupView
+{
+    const InheritanceStoreGroup *group;
+    const uint32_t *positions;
+    const InheritanceSnpRun *snpruns[2];
+    const InheritanceWindowRun *windowruns[2];
+};
+
+inline void CloseInheritanceStore(InheritanceStore &store)
+{
+    if(store.map)
+        munmap(store.map, store.size);
+    store = InheritanceStore();
+}
+
+// True when the array of n elements at offset lies in the file on an 8-byte boundary
+inline bool StoreArrayFits(const InheritanceStore &store, uint64_t offset, uint64_t n, uint64_t size)
+{
+    return offset%8==0 && offset<=store.size && n<=(store.size-offset)/size;
+}
+
+// Maps a file written by inheritance_store and checks its layout
+inline bool OpenInheritanceStore(const std::string &filename, InheritanceStore &store, std::string &error)
+{
+    struct stat st;
+    const char *base;
+    uint64_t i;
+    int fd,o;
+
+    store = InheritanceStore();
+    fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0 || fstat(fd, &st)!=0)
+    {
+        if(fd>=0) close(fd);
+        error = "could not open " + filename;
+        return false;
+    }
+    store.size = st.st_size;
+    if(store.size>=sizeof(InheritanceStoreHeader))
+        store.map = mmap(NULL, store.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(store.map==NULL || store.map==MAP_FAILED)
+    {
+        store.map = NULL;
+        error = filename + " is not an inheritance store";
+        return false;
+    }
+    base = static_cast<const char*>(store.map);
+    store.header = reinterpret_cast<const InheritanceStoreHeader*>(base);
+    if(memcmp(store.header->magic, INHERITANCE_STORE_MAGIC, sizeof(INHERITANCE_STORE_MAGIC))!=0
+       || store.header->version!=INHERITANCE_STORE_VERSION)
+    {
+        error = filename + " is not an inheritance store of version " + std::to_string(INHERITANCE_STORE_VERSION);
+        CloseInheritanceStore(store);
+        return false;
+    }
+    if(!StoreArrayFits(store, store.header->f2_offset, store.header->nf2, sizeof(InheritanceStoreF2))
+       || !StoreArrayFits(store, store.header->chrom_offset, store.header->nchroms, sizeof(InheritanceStoreChrom))
+       || !StoreArrayFits(store, store.header->group_offset, store.header->ngroups, sizeof(InheritanceStoreGroup))
+       || store.header->names_offset>store.size || store.header->names_length>store.size-store.header->names_offset)
+    {
+        error = filename + " is truncated";
+        CloseInheritanceStore(store);
+        return false;
+    }
+    store.f2s = reinterpret_cast<const InheritanceStoreF2*>(base+store.header->f2_offset);
+    store.chroms = reinterpret_cast<const InheritanceStoreChrom*>(base+store.header->chrom_offset);
+    store.groups = reinterpret_cast<const InheritanceStoreGroup*>(base+store.header->group_offset);
+    store.names = base+store.header->names_offset;
+
+    for(i=0; i<store.header->nf2; i++)
+    {
+        const InheritanceStoreF2 &f = store.f2s[i];
+        if(f.name_offset+f.name_length>store.header->names_length)
+        {
+            error = filename + " has a bad F2 entry";
+            CloseInheritanceStore(store);
+            return false;
+        }
+        store.f2index[std::string(store.names+f.name_offset, f.name_length)] = i;
+    }
+    for(i=0; i<store.header->nchroms; i++)
+    {
+        const InheritanceStoreChrom &c = store.chroms[i];
+        if(c.name_offset+c.name_length>store.header->names_length || c.first_group+c.ngroups>store.header->ngroups)
+        {
+            error = filename + " has a bad chromosome entry";
+            CloseInheritanceStore(store);
+            return false;
+        }
+        store.chromindex[std::string(store.names+c.name_offset, c.name_length)] = i;
+    }
+    for(i=0; i<store.header->ngroups; i++)
+    {
+        const InheritanceStoreGroup &g = store.groups[i];
+        bool ok = g.f2<store.header->nf2 && g.chrom<store.header->nchroms
+                  && StoreArrayFits(store, g.positions_offset, g.nsnps, sizeof(uint32_t));
+        for(o=0; o<2 && ok; o++)
+            ok = StoreArrayFits(store, g.snpruns_offset[o], g.nsnpruns[o], sizeof(InheritanceSnpRun))
+                 && StoreArrayFits(store, g.windowruns_offset[o], g.nwindowruns[o], sizeof(InheritanceWindowRun))
+                 && (g.nsnps==0 || g.nsnpruns[o]>0);
+        if(!ok)
+        {
+            error = filename + " has a bad group entry";
+            CloseInheritanceStore(store);
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string StoreF2Name(const InheritanceStore &store, uint32_t f2)
+{
+    return std::string(store.names+store.f2s[f2].name_offset, store.f2s[f2].name_length);
+}
+
+inline std::string StoreChromName(const InheritanceStore &store, uint32_t chrom)
+{
+    return std::string(store.names+store.chroms[chrom].name_offset, store.chroms[chrom].name_length);
+}
+
+inline InheritanceGroupView StoreGroupView(const InheritanceStore &store, uint64_t g)
+{
+    const char *base = static_cast<const char*>(store.map);
+    const InheritanceStoreGroup &group = store.groups[g];
+    InheritanceGroupView view;
+    int o;
+
+    view.group = &group;
+    view.positions = reinterpret_cast<const uint32_t*>(base+group.positions_offset);
+    for(o=0; o<2; o++)
+    {
+        view.snpruns[o] = reinterpret_cast<const InheritanceSnpRun*>(base+group.snpruns_offset[o]);
+        view.windowruns[o] = reinterpret_cast<const InheritanceWindowRun*>(base+group.windowruns_offset[o]);
+    }
+    return view;
+}
+
+// The run of an origin holding SNP i
+inline uint32_t StoreSnpRunOf(const InheritanceGroupView &view, int origin, uint32_t i)
+{
+    const InheritanceSnpRun *runs = view.snpruns[origin];
+    uint32_t n = view.group->nsnpruns[origin];
+    return std::upper_bound(runs, runs+n, i, [](uint32_t x, const InheritanceSnpRun &run) { return x<run.first; })-runs-1;
+}
+
+// The first window run of an origin that ends at or after window
+inline uint32_t StoreWindowRunFrom(const InheritanceGroupView &view, int origin, uint32_t window)
+{
+    const InheritanceWindowRun *runs = view.windowruns[origin];
+    uint32_t n = view.group->nwindowruns[origin];
+    return std::lower_bound(runs, runs+n, window, [](const InheritanceWindowRun &run, uint32_t x) { return run.end<x; })-runs;
+}
+
+// The rows of each inheritance of an origin in a window, {0, 0} when there are none
+inline void StoreWindowCounts(const InheritanceGroupView &view, int origin, uint32_t window, uint16_t count[2])
+{
+    uint32_t r = StoreWindowRunFrom(view, origin, window);
+    bool in = r<view.group->nwindowruns[origin] && view.windowruns[origin][r].start<=window;
+
+    count[0] = in ? view.windowruns[origin][r].count[0] : 0;
+    count[1] = in ? view.windowruns[origin][r].count[1] : 0;
+}
+
+// What the export of a group keeps: the windows first..last (SNPs and fragments in the bases
+// of these windows)
+struct StoreRange
+{
+    uint32_t first = 0,last = UINT32_MAX;
+};
+
+// f2inheritance rows: f2 chr pos f1father f1mother
+inline void AppendStoreSnps(const InheritanceStore &store, uint64_t g, const StoreRange &range, std::string &out)
+{
+    InheritanceGroupView view = StoreGroupView(store, g);
+    const InheritanceStoreGroup &group = *view.group;
+    uint64_t from = (uint64_t)range.first*store.header->window_size,to = ((uint64_t)range.last+1)*store.header->window_size;
+    std::string prefix = StoreF2Name(store, group.f2) + "\t" + StoreChromName(store, group.chrom) + "\t";
+    uint32_t i,r[2];
+    int o;
+
+    i = std::lower_bound(view.positions, view.positions+group.nsnps, from)-view.positions;
+    if(i>=group.nsnps)
+        return;
+    for(o=0; o<2; o++)
+        r[o] = StoreSnpRunOf(view, o, i);
+    for(; i<group.nsnps && view.positions[i]<to; i++)
+    {
+        out += prefix;
+        out += std::to_string(view.positions[i]);
+        for(o=0; o<2; o++)
+        {
+            while(r[o]+1<group.nsnpruns[o] && view.snpruns[o][r[o]+1].first<=i)
+                r[o]++;
+            out += '\t';
+            out += std::to_string(view.snpruns[o][r[o]].label);
+        }
+        out += '\n';
+    }
+}
+
+// f2fragmentinheritance rows (f2inheritance.length.txt): f2 chr start end inheritance origin, the
+// maternal fragments first; a fragment is kept when it overlaps the range
+inline void AppendStoreFragments(const InheritanceStore &store, uint64_t g, const StoreRange &range, std::string &out)
+{
+    InheritanceGroupView view = StoreGroupView(store, g);
+    const InheritanceStoreGroup &group = *view.group;
+    uint64_t from = (uint64_t)range.first*store.header->window_size,to = ((uint64_t)range.last+1)*store.header->window_size;
+    std::string prefix = StoreF2Name(store, group.f2) + "\t" + StoreChromName(store, group.chrom) + "\t";
+    uint32_t r,last;
+    int o;
+
+    if(group.nsnps==0)
+        return;
+    for(int k=0; k<2; k++)
+    {
+        o = k==0 ? STORE_MATERNAL : STORE_PATERNAL;
+        for(r=0; r<group.nsnpruns[o]; r++)
+        {
+            const InheritanceSnpRun &run = view.snpruns[o][r];
+            last = r+1<group.nsnpruns[o] ? view.snpruns[o][r+1].first-1 : group.nsnps-1;
+            if(view.positions[last]<from || view.positions[run.first]>=to)
+                continue;
+            out += prefix;
+            out += std::to_string(view.positions[run.first]);
+            out += '\t';
+            out += std::to_string(view.positions[last]);
+            out += '\t';
+            out += std::to_string(((run.label%2)+2)%2);
+            out += o==STORE_MATERNAL ? "\tM\n" : "\tP\n";
+        }
+    }
+}
+
+// Calls emit(window, paternal counts, maternal counts) for every window of the range with rows,
+// in window order
+template <class Emit>
+inline void ScanStoreWindows(const InheritanceGroupView &view, const StoreRange &range, Emit emit)
+{
+    static const uint16_t none[2] = {0,0};
+    const InheritanceStoreGroup &group = *view.group;
+    uint32_t r[2],n[2];
+    uint64_t window,next;
+    const uint16_t *count[2];
+    int o;
+
+    for(o=0; o<2; o++)
+    {
+        r[o] = StoreWindowRunFrom(view, o, range.first);
+        n[o] = group.nwindowruns[o];
+    }
+    for(window=range.first; window<=range.last; window=next)
+    {
+        next = UINT64_MAX;
+        for(o=0; o<2; o++)
+        {
+            while(r[o]<n[o] && view.windowruns[o][r[o]].end<window)
+                r[o]++;
+            if(r[o]<n[o])
+                next = std::min(next, std::max(window, (uint64_t)view.windowruns[o][r[o]].start));
+        }
+        if(next==UINT64_MAX || next>range.last)
+            break;
+        window = next;
+        for(o=0; o<2; o++)
+            count[o] = r[o]<n[o] && view.windowruns[o][r[o]].start<=window ? view.windowruns[o][r[o]].count : none;
+        emit((uint32_t)window, count[STORE_PATERNAL], count[STORE_MATERNAL]);
+        next = window+1;
+    }
+}
+
+// f2fragmentinheritance_window100k rows: f2 chr window inheritance origin, ordered by window,
+// origin (M first) and inheritance
+inline void AppendStoreWindows(const InheritanceStore &store, uint64_t g, const StoreRange &range, std::string &out)
+{
+    InheritanceGroupView view = StoreGroupView(store, g);
+    std::string prefix = StoreF2Name(store, view.group->f2) + "\t" + StoreChromName(store, view.group->chrom) + "\t";
+
+    ScanStoreWindows(view, range, [&](uint32_t window, const uint16_t *paternal, const uint16_t *maternal)
+    {
+        std::string w = std::to_string(window);
+        int inh,k;
+        for(inh=0; inh<2; inh++)
+            for(k=0; k<maternal[inh]; k++)
+                out += prefix + w + (inh ? "\t1\tM\n" : "\t0\tM\n");
+        for(inh=0; inh<2; inh++)
+            for(k=0; k<paternal[inh]; k++)
+                out += prefix + w + (inh ? "\t1\tP\n" : "\t0\tP\n");
+    });
+}
+
+// f2inheritance_100k_allelecount rows: f2 chr window Pallelecount Mallelecount, the number of
+// different inheritances of each parent in the window (2 for a recombination in it)
+inline void AppendStoreAlleleCounts(const InheritanceStore &store, uint64_t g, const StoreRange &range, std::string &out)
+{
+    InheritanceGroupView view = StoreGroupView(store, g);
+    std::string prefix = StoreF2Name(store, view.group->f2) + "\t" + StoreChromName(store, view.group->chrom) + "\t";
+
+    ScanStoreWindows(view, range, [&](uint32_t window, const uint16_t *paternal, const uint16_t *maternal)
+    {
+        out += prefix;
+        out += std::to_string(window);
+        out += '\t';
+        out += std::to_string((paternal[0]>0)+(paternal[1]>0));
+        out += '\t';
+        out += std::to_string((maternal[0]>0)+(maternal[1]>0));
+        out += '\n';
+    });
+}
@@ -0,0 +1,315 @@
+// Expands the inheritance of the F2 into sliding windows, the table f2fragmentinheritance_window100k
+// that "2. F2 inheritance fragment processing and trait association preparation.R" builds row by row.
+//
+// The input is either the per-SNP f2.inheritance.txt (f2 chromosome position paternal maternal, from
+// shapeit_transmission or the R script) or the fragments f2inheritance.length.txt (f2 chromosome start
+// end inheritance origin). It is read once, one F2 and chromosome at a time; the records of an F2 and
+// chromosome must be contiguous. Every group is turned into fragments, then into the windows
+// floor(start/W)..floor(end/W) of every fragment, and the windows without informative SNPs are
+// filled by the midpoint rule of the R script. Groups are expanded in parallel and written in input
+// order, each sorted by window, origin and inheritance, ready for LOAD DATA.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+#include "text_input.h"
+
+using namespace std;
+
+struct WindowOptions
+{
+    long windowsize;
+    string sexchr;        // not filled, and without the paternal windows of males (odd F2 ids)
+    int threads;
+};
+
+// The SNPs [start,end] of a chromosome inherited from one grandparent
+struct InheritanceFragment
+{
+    long start,end;
+    int inheritance;      // label % 2: 1 for the LW haplotypes 5 and 11, 0 for the MIN haplotypes 6 and 12
+    char origin;          // 'P' paternal or 'M' maternal
+};
+
+struct WindowRow
+{
+    long window;
+    int inheritance;
+    char origin;
+};
+
+// The records of one F2 and chromosome, and their expansion
+struct InheritanceGroup
+{
+    string f2,chr;
+    vector<long> pos;
+    vector<int> paternal,maternal;
+    vector<InheritanceFragment> fragments;
+    vector<WindowRow> rows;
+    string windowtext,fragmenttext;
+};
+
+// Blocks of SNPs with the same label of one parent, as in the first part of the R script
+void AddFragments(InheritanceGroup &group, const vector<int> &labels, char origin)
+{
+    size_t start,i;
+
+    for(start=0; start<labels.size(); start=i)
+    {
+        for(i=start+1; i<labels.size() && labels[i]==labels[start]; i++)
+            ;
+        group.fragments.push_back(InheritanceFragment{group.pos[start], group.pos[i-1], labels[start]%2, origin});
+    }
+}
+
+// Per-SNP records become fragments, maternal ones first as in f2inheritance.length.txt
+void MakeFragments(InheritanceGroup &group)
+{
+    vector<size_t> order(group.pos.size());
+    vector<long> pos;
+    vector<int> paternal,maternal;
+    size_t i;
+
+    for(i=0; i<order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return group.pos[a]<group.pos[b]; });
+    for(i=0; i<order.size(); i++)
+    {
+        pos.push_back(group.pos[order[i]]);
+        paternal.push_back(group.paternal[order[i]]);
+        maternal.push_back(group.maternal[order[i]]);
+    }
+    group.pos.swap(pos);
+    AddFragments(group, maternal, 'M');
+    AddFragments(group, paternal, 'P');
+}
+
+// Fills the windows missing between two windows of one parent: up to the midpoint with the
+// inheritance before the gap, the midpoint with both inheritances and after it with the
+// inheritance after the gap. The windows are the distinct (window, inheritance) pairs sorted by
+// window and inheritance
+void FillWindowGaps(vector<WindowRow> &rows, char origin)
+{
+    vector<pair<long,int> > windows;
+    size_t k;
+    long recpos,m;
+
+    for(const WindowRow &row : rows)
+        if(row.origin==origin)
+            windows.push_back(make_pair(row.window, row.inheritance));
+    sort(windows.begin(), windows.end());
+    windows.erase(unique(windows.begin(), windows.end()), windows.end());
+    for(k=0; k+1<windows.size(); k++)
+    {
+        if(windows[k+1].first-windows[k].first<=1)
+            continue;
+        recpos = (windows[k+1].first+windows[k].first)/2;
+        for(m=windows[k].first+1; m<recpos; m++)
+            rows.push_back(WindowRow{m, windows[k].second, origin});
+        rows.push_back(WindowRow{recpos, windows[k].second, origin});
+        rows.push_back(WindowRow{recpos, 1-windows[k].second, origin});
+        for(m=recpos+1; m<windows[k+1].first; m++)
+            rows.push_back(WindowRow{m, windows[k+1].second, origin});
+    }
+}
+
+bool IsMale(const string &f2)
+{
+    char *end;
+    long id = strtol(f2.c_str(), &end, 10);
+    return *end==0 && id%2!=0;
+}
+
+void ExpandGroup(InheritanceGroup &group, const WindowOptions &options, bool writefragments)
+{
+    bool sexchr = group.chr==options.sexchr;
+    long w;
+
+    if(!group.pos.empty())
+        MakeFragments(group);
+    for(const InheritanceFragment &frag : group.fragments)
+    {
+        if(sexchr && frag.origin=='P' && IsMale(group.f2))
+            continue;
+        for(w=frag.start/options.windowsize; w<=frag.end/options.windowsize; w++)
+            group.rows.push_back(WindowRow{w, frag.inheritance, frag.origin});
+    }
+    if(!sexchr)
+    {
+        FillWindowGaps(group.rows, 'P');
+        FillWindowGaps(group.rows, 'M');
+    }
+    stable_sort(group.rows.begin(), group.rows.end(), [](const WindowRow &a, const WindowRow &b)
+    {
+        if(a.window!=b.window)
+            return a.window<b.window;
+        if(a.origin!=b.origin)
+            return a.origin<b.origin;
+        return a.inheritance<b.inheritance;
+    });
+
+    string prefix = group.f2 + "\t" + group.chr + "\t";
+    for(const WindowRow &row : group.rows)
+    {
+        group.windowtext += prefix;
+        group.windowtext += to_string(row.window);
+        group.windowtext += '\t';
+        group.windowtext += to_string(row.inheritance);
+        group.windowtext += '\t';
+        group.windowtext += row.origin;
+        group.windowtext += '\n';
+    }
+    if(writefragments)
+        for(const InheritanceFragment &frag : group.fragments)
+            group.fragmenttext += prefix + to_string(frag.start) + "\t" + to_string(frag.end) + "\t" +
+                                  to_string(frag.inheritance) + "\t" + frag.origin + "\n";
+}
+
+// Adds one record to the group; false when it is neither a per-SNP record nor a fragment
+bool AddRecord(InheritanceGroup &group, const vector<string> &fields)
+{
+    if(fields.size()==5)
+    {
+        group.pos.push_back(atol(fields[2].c_str()));
+        group.paternal.push_back(atoi(fields[3].c_str()));
+        group.maternal.push_back(atoi(fields[4].c_str()));
+        return true;
+    }
+    if(fields.size()==6 && (fields[5]=="P" || fields[5]=="M"))
+    {
+        group.fragments.push_back(InheritanceFragment{atol(fields[2].c_str()), atol(fields[3].c_str()), atoi(fields[4].c_str()), fields[5][0]});
+        return true;
+    }
+    return false;
+}
+
+int main(int argc,char *argv[])
+{
+    WindowOptions options = {100000, "23", 1};
+    vector<string> args,fields;
+    string fragmentfile,line;
+    size_t batch,lineno;
+    bool more;
+    int i;
+
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--window" && i+1<argc)
+            options.windowsize = atol(argv[++i]);
+        else if(opt=="--threads" && i+1<argc)
+            options.threads = atoi(argv[++i]);
+        else if(opt=="--sex-chr" && i+1<argc)
+            options.sexchr = argv[++i];
+        else if(opt=="--fragments" && i+1<argc)
+            fragmentfile = argv[++i];
+        else
+            args.push_back(opt);
+    }
+    if(args.size()!=2 || options.windowsize<1 || options.threads<1)
+    {
+        cout << "Usage: " << argv[0] << " f2.inheritance.txt f2fragmentinheritance_window100k.txt [--window 100000] [--threads N]\n";
+        cout << "       [--sex-chr 23] [--fragments f2inheritance.length.txt]\n";
+        cout << "  The input (plain or gzipped) has 'f2 chromosome position paternal maternal' per SNP, or the fragments\n";
+        cout << "  'f2 chromosome start end inheritance origin'; the records of an F2 and chromosome must be contiguous.\n";
+        cout << "  The output has 'f2 chromosome window inheritance origin' for every window of every fragment, window\n";
+        cout << "  being floor(position / --window) and inheritance 1 for the alleles 5 and 11 and 0 for 6 and 12.\n";
+        cout << "  Windows without informative SNPs between two windows of a parent are filled up to the midpoint\n";
+        cout << "  with the inheritance before the gap and after it with the inheritance after the gap; the midpoint\n";
+        cout << "  window gets both.\n";
+        cout << "  --threads N     expand N F2 and chromosomes at once\n";
+        cout << "  --sex-chr C     chromosome C is not filled, and the paternal windows of males (odd F2 ids) are dropped\n";
+        cout << "  --fragments F   with a per-SNP input, also write its fragments to F (f2inheritance.length.txt)\n";
+        return 0;
+    }
+
+    gzFile in = gzopen(args[0].c_str(), "r");
+    if(in==NULL)
+    {
+        cerr << "Error: could not open " << args[0] << endl;
+        return 1;
+    }
+    ofstream out(args[1].c_str()),fragments;
+    if(!out)
+    {
+        cerr << "Error: could not write " << args[1] << endl;
+        return 1;
+    }
+    if(fragmentfile!="")
+    {
+        fragments.open(fragmentfile.c_str());
+        if(!fragments)
+        {
+            cerr << "Error: could not write " << fragmentfile << endl;
+            return 1;
+        }
+    }
+
+    // A batch of groups is read, expanded on the threads and written before the next one is read
+    batch = 16*options.threads;
+    lineno = 0;
+    more = ReadGzLine(in, line);
+    while(more)
+    {
+        vector<InheritanceGroup> groups;
+        while(more)
+        {
+            lineno++;
+            SplitFields(line, fields);
+            if(!fields.empty())
+            {
+                if(groups.empty() || groups.back().f2!=fields[0] || groups.back().chr!=fields[1])
+                {
+                    if(groups.size()==batch)
+                        break;
+                    groups.emplace_back();
+                    groups.back().f2 = fields[0];
+                    groups.back().chr = fields[1];
+                }
+                if(!AddRecord(groups.back(), fields))
+                {
+                    cerr << "Error: " << args[0] << " line " << lineno << ": expected 5 or 6 columns" << endl;
+                    return 1;
+                }
+            }
+            more = ReadGzLine(in, line);
+        }
+        // The line that starts the next batch is read again
+        if(more)
+            lineno--;
+
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        for(i=0; i<options.threads; i++)
+            workers.emplace_back([&]()
+            {
+                size_t g;
+                while((g = next++) < groups.size())
+                    ExpandGroup(groups[g], options, fragments.is_open());
+            });
+        for(auto &worker : workers)
+            worker.join();
+        for(const InheritanceGroup &group : groups)
+        {
+            out << group.windowtext;
+            if(fragments.is_open())
+                fragments << group.fragmenttext;
+        }
+    }
+    gzclose(in);
+    out.close();
+    if(fragments.is_open())
+        fragments.close();
+    if(!out || fragments.fail())
+    {
+        cerr << "Error: could not write the outputs" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,477 @@
+// The λ of the hybrid effects in every FST bin and sex, as get_lambda and calculate_lambda of
+// "5. construction of genetic diversity and heterosis analysis tables.R" fit them with fitdistr,
+// with bootstrap standard errors and confidence intervals.
+//
+// The FST windows (fst100k, or the vcftools .windowed.weir.fst) give the bin bounds, the quantiles
+// of WEIGHTED_FST over the autosomes with negative values set to 0, and the bin of every window. The
+// deviation table (window_trait_stat output, or window100k_single_site_trait_stat_mutant_deviation_from_mean
+// exported with a header) is then read once, and the effects abs(mutantdev - dev) <= 0.3 of both
+// sexes are bucketed by the bin of their window. Both estimates depend on the data only through the
+// mean effect: the fitdistr λ is 1/mean, and the MLE of an exponential truncated at 0.3 solves
+// 1/λ - 0.3/(exp(0.3λ)-1) = mean. A bootstrap resample therefore only needs the sum of n effects
+// drawn with replacement. The resamples of all bins and sexes are split into chunks and run on
+// the threads. Each resample has its own random stream, so the results do not depend on the
+// number of threads.
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <strings.h>
+#include <zlib.h>
+#include "text_input.h"
+
+using namespace std;
+
+#define NSEXES 2              // 0 female, 1 male, as the femaledev and maledev columns
+#define SAMPLE_LANES 8
+#define SAMPLE_BLOCK 1024       // a multiple of SAMPLE_LANES
+#define CHUNK_REPLICATES 16
+
+struct LambdaOptions
+{
+    int bins;
+    double maxeffect;
+    int maxchr;               // effects of the chromosomes below it (a.chr < 23)
+    int fstmaxchr;            // quantiles over the chromosomes 1 to it (chr BETWEEN 1 AND 18)
+    long windowsize;          // converts the BIN_START of a vcftools file to a window
+    int replicates;
+    double level;
+    uint64_t seed;
+    int threads;
+};
+
+// The effects of one bin and sex, and the means of their bootstrap resamples
+struct LambdaBin
+{
+    double fststart,fstend;
+    vector<double> effects;
+    vector<double> means;
+};
+
+// The column of the first of the names in a header, ignoring case; -1 when there is none
+int FindColumn(const vector<char*> &header, const vector<string> &names)
+{
+    size_t i;
+
+    for(const string &name : names)
+        for(i=0; i<header.size(); i++)
+            if(strcasecmp(header[i], name.c_str())==0)
+                return i;
+    return -1;
+}
+
+// A number, or false for \N, NULL, NA and other text
+bool ParseNumber(const char *field, double &value)
+{
+    char *end;
+    value = strtod(field, &end);
+    return end!=field && *end==0 && isfinite(value);
+}
+
+uint64_t WindowKey(long chr, long window)
+{
+    return (uint64_t)chr << 32 | (uint32_t)window;
+}
+
+// R quantile() of type 7 of sorted values
+double Quantile(const vector<double> &sorted, double p)
+{
+    double index = (sorted.size()-1)*p;
+    size_t lo = floor(index),hi = ceil(index);
+    double h = index-lo;
+
+    if(h==0 || sorted[hi]==sorted[lo])
+        return sorted[lo];
+    return (1-h)*sorted[lo]+h*sorted[hi];
+}
+
+// A bound as sprintf("%f") puts it into the SQL of get_lambda
+double SqlBound(double value)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%f", value);
+    return atof(buffer);
+}
+
+// Reads the FST windows, makes the bins of the quantiles and the bin of every window (-1 for none)
+bool LoadFstBins(const string &filename, const LambdaOptions &options, vector<LambdaBin> &bins,
+                 unordered_map<uint64_t,int> &windowbin, string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    vector<char*> fields;
+    vector<long> chrs,windows;
+    vector<double> fsts,autosomal;
+    string line;
+    int chrcol,windowcol,startcol,fstcol,b;
+    size_t i;
+    double fst;
+
+    if(fp==NULL || !ReadGzLine(fp, line))
+    {
+        if(fp)
+            gzclose(fp);
+        error = "could not read " + filename;
+        return false;
+    }
+    SplitFields(line, fields);
+    chrcol = FindColumn(fields, {"chr", "CHROM"});
+    windowcol = FindColumn(fields, {"window"});
+    startcol = FindColumn(fields, {"BIN_START"});
+    fstcol = FindColumn(fields, {"WEIGHTED_FST"});
+    if(chrcol<0 || (windowcol<0 && startcol<0) || fstcol<0)
+    {
+        gzclose(fp);
+        error = filename + " needs a header with chr (or CHROM), window (or BIN_START) and WEIGHTED_FST";
+        return false;
+    }
+    while(ReadGzLine(fp, line))
+    {
+        SplitFields(line, fields);
+        if(fields.size()<=max(chrcol, max(windowcol, max(startcol, fstcol))) || !ParseNumber(fields[fstcol], fst))
+            continue;
+        chrs.push_back(atol(fields[chrcol]));
+        windows.push_back(windowcol>=0 ? atol(fields[windowcol]) : (atol(fields[startcol])-1)/options.windowsize);
+        fsts.push_back(fst);
+        if(chrs.back()>=1 && chrs.back()<=options.fstmaxchr)
+            autosomal.push_back(max(fst, 0.0));
+    }
+    gzclose(fp);
+    if(autosomal.empty())
+    {
+        error = filename + " has no FST of the chromosomes 1 to " + to_string(options.fstmaxchr);
+        return false;
+    }
+
+    // fstq <- quantile(fst$WEIGHTED_FST, probs = seq(0, 1, step_size)); a bin is [max(0, fstq[i]), fstq[i+1])
+    sort(autosomal.begin(), autosomal.end());
+    bins.resize(options.bins);
+    for(b=0; b<options.bins; b++)
+    {
+        bins[b].fststart = Quantile(autosomal, b*(1.0/options.bins));
+        bins[b].fstend = Quantile(autosomal, (b+1)*(1.0/options.bins));
+    }
+    for(i=0; i<fsts.size(); i++)
+    {
+        for(b=0; b<options.bins; b++)
+            if(fsts[i]>=SqlBound(max(0.0, bins[b].fststart)) && fsts[i]<SqlBound(bins[b].fstend))
+                break;
+        windowbin[WindowKey(chrs[i], windows[i])] = b<options.bins ? b : -1;
+    }
+    return true;
+}
+
+// Buckets abs(mutantdev - dev) of both sexes by the bin of the window
+bool LoadEffects(const string &filename, const LambdaOptions &options, const unordered_map<uint64_t,int> &windowbin,
+                 vector<LambdaBin> bins[NSEXES], string &error)
+{
+    static const char *sexnames[NSEXES] = {"female","male"};
+    gzFile fp = gzopen(filename.c_str(), "r");
+    vector<char*> fields;
+    string line;
+    int chrcol,windowcol,devcol[NSEXES],mutantcol[NSEXES],lastcol,s;
+    long chr;
+    double dev,mutant,effect;
+
+    if(fp==NULL || !ReadGzLine(fp, line))
+    {
+        if(fp)
+            gzclose(fp);
+        error = "could not read " + filename;
+        return false;
+    }
+    SplitFields(line, fields);
+    chrcol = FindColumn(fields, {"chr"});
+    windowcol = FindColumn(fields, {"window"});
+    lastcol = max(chrcol, windowcol);
+    for(s=0; s<NSEXES; s++)
+    {
+        devcol[s] = FindColumn(fields, {string(sexnames[s]) + "dev"});
+        mutantcol[s] = FindColumn(fields, {string(sexnames[s]) + "mutantdev"});
+        lastcol = max(lastcol, max(devcol[s], mutantcol[s]));
+        if(devcol[s]<0 || mutantcol[s]<0)
+            chrcol = -1;
+    }
+    if(chrcol<0 || windowcol<0)
+    {
+        gzclose(fp);
+        error = filename + " needs a header with chr, window, maledev, femaledev, malemutantdev and femalemutantdev";
+        return false;
+    }
+    while(ReadGzLine(fp, line))
+    {
+        SplitFields(line, fields);
+        if(fields.size()<=lastcol)
+            continue;
+        chr = atol(fields[chrcol]);
+        if(chr>=options.maxchr)
+            continue;
+        auto it = windowbin.find(WindowKey(chr, atol(fields[windowcol])));
+        if(it==windowbin.end() || it->second<0)
+            continue;
+        for(s=0; s<NSEXES; s++)
+            if(ParseNumber(fields[devcol[s]], dev) && ParseNumber(fields[mutantcol[s]], mutant))
+            {
+                effect = fabs(mutant-dev);
+                if(effect<=options.maxeffect)
+                    bins[s][it->second].effects.push_back(effect);
+            }
+    }
+    gzclose(fp);
+    return true;
+}
+
+uint64_t SplitMix64(uint64_t &x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z>>30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z>>27))*0x94d049bb133111ebULL;
+    return z ^ (z>>31);
+}
+
+// Mean of n values drawn with replacement. Eight xoshiro128+ streams side by side make eight
+// indices per step, mapped to [0, n) by a multiply and shift; the step is 32-bit arithmetic that
+// the compiler vectorizes, and the gathered values go to eight separate sums
+double ResampleMean(const double *values, uint32_t n, uint64_t key)
+{
+    uint32_t s0[SAMPLE_LANES],s1[SAMPLE_LANES],s2[SAMPLE_LANES],s3[SAMPLE_LANES],index[SAMPLE_BLOCK],t;
+    double sum[SAMPLE_LANES] = {0};
+    uint32_t i,j,m;
+    int k;
+
+    for(k=0; k<SAMPLE_LANES; k++)
+    {
+        uint64_t a = SplitMix64(key),b = SplitMix64(key);
+        s0[k] = a;
+        s1[k] = a>>32;
+        s2[k] = b;
+        s3[k] = (b>>32) | 1;
+    }
+    // Blocks of indices are made first and gathered after, which keeps the generator in registers
+    for(i=0; i<n; i+=SAMPLE_BLOCK)
+    {
+        m = min((uint32_t)SAMPLE_BLOCK, n-i);
+        for(j=0; j<m; j+=SAMPLE_LANES)
+            for(k=0; k<SAMPLE_LANES; k++)
+            {
+                index[j+k] = ((uint64_t)(s0[k]+s3[k])*n) >> 32;
+                t = s1[k] << 9;
+                s2[k] ^= s0[k];
+                s3[k] ^= s1[k];
+                s1[k] ^= s2[k];
+                s0[k] ^= s3[k];
+                s2[k] ^= t;
+                s3[k] = (s3[k] << 11) | (s3[k] >> 21);
+            }
+        for(j=0; j+SAMPLE_LANES<=m; j+=SAMPLE_LANES)
+            for(k=0; k<SAMPLE_LANES; k++)
+                sum[k] += values[index[j+k]];
+        for(; j<m; j++)
+            sum[0] += values[index[j]];
+    }
+    for(k=1; k<SAMPLE_LANES; k++)
+        sum[0] += sum[k];
+    return sum[0]/n;
+}
+
+// The MLE of λ of an exponential truncated at t for a mean effect: the root of
+// 1/λ - t/(exp(λt)-1) = mean, which falls from t to 0 as λ goes from -inf to inf (t/2 at 0)
+double TruncatedLambda(double mean, double t)
+{
+    auto expected = [t](double lambda)
+    {
+        return fabs(lambda*t)<1e-8 ? t/2-lambda*t*t/12 : 1/lambda-t/expm1(lambda*t);
+    };
+    double lo = -1/t,hi = 1/t,mid;
+    int i;
+
+    if(!(mean>0 && mean<t))
+        return mean<=0 ? INFINITY : -INFINITY;
+    while(expected(lo)<mean)
+        lo *= 2;
+    while(expected(hi)>mean)
+        hi *= 2;
+    for(i=0; i<200 && hi-lo>1e-12*fabs(hi); i++)
+    {
+        mid = (lo+hi)/2;
+        if(expected(mid)>mean)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (lo+hi)/2;
+}
+
+// Bootstrap standard deviation and percentile interval of an estimate
+void BootstrapSummary(vector<double> estimates, double level, double &se, double &low, double &high)
+{
+    double sum = 0,sum2 = 0;
+
+    for(double x : estimates)
+    {
+        sum += x;
+        sum2 += x*x;
+    }
+    se = estimates.size()>1 ? sqrt(max(0.0, (sum2-sum*sum/estimates.size())/(estimates.size()-1))) : NAN;
+    sort(estimates.begin(), estimates.end());
+    low = estimates.empty() ? NAN : Quantile(estimates, (1-level)/2);
+    high = estimates.empty() ? NAN : Quantile(estimates, 1-(1-level)/2);
+}
+
+void WriteValue(ostream &out, double value)
+{
+    if(isnan(value))
+        out << "\tNA";
+    else
+        out << "\t" << value;
+}
+
+int main(int argc,char *argv[])
+{
+    static const char *sexlabels[NSEXES] = {"Female","Male"};
+    LambdaOptions options = {20, 0.3, 23, 18, 100000, 2000, 0.95, 1, 1};
+    vector<LambdaBin> bins[NSEXES];
+    unordered_map<uint64_t,int> windowbin;
+    vector<string> args;
+    vector<pair<int,int> > tasks;       // (sex * bins + bin, first replicate)
+    string error;
+    int i,s,b;
+
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--threads" && i+1<argc)
+            options.threads = atoi(argv[++i]);
+        else if(opt=="--bootstrap" && i+1<argc)
+            options.replicates = atoi(argv[++i]);
+        else if(opt=="--level" && i+1<argc)
+            options.level = atof(argv[++i]);
+        else if(opt=="--seed" && i+1<argc)
+            options.seed = strtoull(argv[++i], NULL, 10);
+        else if(opt=="--bins" && i+1<argc)
+            options.bins = atoi(argv[++i]);
+        else if(opt=="--max-effect" && i+1<argc)
+            options.maxeffect = atof(argv[++i]);
+        else if(opt=="--max-chr" && i+1<argc)
+            options.maxchr = atoi(argv[++i]);
+        else if(opt=="--fst-max-chr" && i+1<argc)
+            options.fstmaxchr = atoi(argv[++i]);
+        else if(opt=="--window" && i+1<argc)
+            options.windowsize = atol(argv[++i]);
+        else
+            args.push_back(opt);
+    }
+    if(args.size()!=3 || options.threads<1 || options.replicates<0 || options.bins<1 || !(options.maxeffect>0)
+       || !(options.level>0 && options.level<1) || options.windowsize<1)
+    {
+        cout << "Usage: " << argv[0] << " deviation.tsv fst100k.txt lambda.tsv [--threads N] [--bootstrap 2000] [--level 0.95]\n";
+        cout << "       [--seed 1] [--bins 20] [--max-effect 0.3] [--max-chr 23] [--fst-max-chr 18] [--window 100000]\n";
+        cout << "  deviation.tsv is window_trait_stat output (or the deviation table with a header): the hybrid effect\n";
+        cout << "  of a sex is abs(mutantdev - dev), and effects up to --max-effect of the chromosomes below --max-chr are fitted.\n";
+        cout << "  fst100k.txt has the columns chr, window and WEIGHTED_FST, or is a vcftools .windowed.weir.fst\n";
+        cout << "  (CHROM, BIN_START, WEIGHTED_FST; window = (BIN_START-1) / --window). The bins are the --bins quantiles\n";
+        cout << "  of WEIGHTED_FST over the chromosomes 1 to --fst-max-chr, negative values being 0.\n";
+        cout << "  lambda.tsv has for every sex and bin the number and mean of the effects, λ of fitdistr (1/mean) and\n";
+        cout << "  the MLE of λ of an exponential truncated at --max-effect, each with the standard error and the\n";
+        cout << "  --level percentile interval of --bootstrap resamples; --seed fixes the resamples.\n";
+        cout << "  --threads N   run the resamples on N threads\n";
+        return 0;
+    }
+    if(!LoadFstBins(args[1], options, bins[0], windowbin, error))
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    bins[1] = bins[0];
+    if(!LoadEffects(args[0], options, windowbin, bins, error))
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    ofstream out(args[2].c_str());
+    if(!out)
+    {
+        cerr << "Error: could not write " << args[2] << endl;
+        return 1;
+    }
+
+    // Chunks of resamples of the bins with effects, the largest bins first
+    for(s=0; s<NSEXES; s++)
+        for(b=0; b<options.bins; b++)
+            if(!bins[s][b].effects.empty())
+            {
+                bins[s][b].means.resize(options.replicates);
+                for(i=0; i<options.replicates; i+=CHUNK_REPLICATES)
+                    tasks.push_back(make_pair(s*options.bins+b, i));
+            }
+    stable_sort(tasks.begin(), tasks.end(), [&](const pair<int,int> &x, const pair<int,int> &y)
+    {
+        return bins[x.first/options.bins][x.first%options.bins].effects.size()>bins[y.first/options.bins][y.first%options.bins].effects.size();
+    });
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for(i=0; i<options.threads; i++)
+        workers.emplace_back([&]()
+        {
+            size_t task;
+            int r;
+            while((task = next++) < tasks.size())
+            {
+                int sb = tasks[task].first;
+                LambdaBin &bin = bins[sb/options.bins][sb%options.bins];
+                for(r=tasks[task].second; r<min(options.replicates, tasks[task].second+CHUNK_REPLICATES); r++)
+                    bin.means[r] = ResampleMean(bin.effects.data(), bin.effects.size(),
+                                                options.seed*0x9e3779b97f4a7c15ULL ^ ((uint64_t)sb << 32) ^ r);
+            }
+        });
+    for(auto &worker : workers)
+        worker.join();
+
+    out << setprecision(8);
+    out << "sex\tbin\tfst_start\tfst_end\tn\tmean_effect\tlambda\tlambda_se\tlambda_low\tlambda_high"
+        << "\ttruncated_lambda\ttruncated_se\ttruncated_low\ttruncated_high\n";
+    for(s=0; s<NSEXES; s++)
+        for(b=0; b<options.bins; b++)
+        {
+            const LambdaBin &bin = bins[s][b];
+            vector<double> lambdas,truncated;
+            double sum = 0,mean,se,low,high;
+            for(double x : bin.effects)
+                sum += x;
+            mean = bin.effects.empty() ? NAN : sum/bin.effects.size();
+            for(double m : bin.means)
+            {
+                lambdas.push_back(1/m);
+                truncated.push_back(TruncatedLambda(m, options.maxeffect));
+            }
+            out << sexlabels[s] << "\t" << b+1 << "\t" << bin.fststart << "\t" << bin.fstend << "\t" << bin.effects.size();
+            WriteValue(out, mean);
+            WriteValue(out, bin.effects.empty() ? NAN : 1/mean);
+            BootstrapSummary(lambdas, options.level, se, low, high);
+            WriteValue(out, se);
+            WriteValue(out, low);
+            WriteValue(out, high);
+            WriteValue(out, bin.effects.empty() ? NAN : TruncatedLambda(mean, options.maxeffect));
+            BootstrapSummary(truncated, options.level, se, low, high);
+            WriteValue(out, se);
+            WriteValue(out, low);
+            WriteValue(out, high);
+            out << "\n";
+        }
+    out.close();
+    if(!out)
+    {
+        cerr << "Error: could not write " << args[2] << endl;
+        return 1;
+    }
+    return 0;
+}
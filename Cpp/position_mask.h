@@ -0,0 +1,400 @@
+// Per-chromosome position mask (excluded SNPs, paralog or low-complexity regions), built once by
+// build_position_mask and memory-mapped read-only by xie_unphased_vcf_for_heterozygote_stat
+// (--exclude) and filter_bam (--mask), so that concurrent runs share one copy in the page cache.
+//
+// Layout, little-endian, every array starting on an 8-byte boundary:
+//   PositionMaskHeader
+//   PositionMaskChromDesc[nchroms]
+//   per chromosome: starts[nintervals], ends[nintervals], buckets[nbuckets] (uint32)
+//   names: the chromosome names, not terminated
+// Intervals are 0-based half-open, sorted and merged. buckets[b] is the first interval ending
+// after b << bucket_shift, so a lookup jumps to its bucket and steps over the few intervals that
+// end inside it before the position.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define POSITION_MASK_MAGIC "POSMASK"
+#define POSITION_MASK_VERSION 1
+#define POSITION_MASK_BUCKET_SHIFT 12     // 4-kb buckets
+
+struct PositionMaskHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nchroms;
+    uint32_t bucket_shift;
+    uint32_t reserved;
+    uint64_t names_offset,names_length;
+};
+
+struct PositionMaskChromDesc
+{
+    uint64_t name_offset;                 // relative to names_offset
+    uint32_t name_length;
+    uint32_t nintervals;
+    uint64_t starts_offset,ends_offset;
+    uint64_t buckets_offset;
+    uint32_t nbuckets;
+    uint32_t reserved;
+};
+
+// Intervals collected from site lists and BED files, per chromosome
+struct PositionMaskBuilder
+{
+    std::map<std::string, std::vector<std::pair<uint32_t,uint32_t> > > intervals;
+};
+
+inline void AddMaskInterval(PositionMaskBuilder &builder, const std::string &chr, uint32_t start, uint32_t end)
+{
+    if(start<end)
+        builder.intervals[chr].push_back(std::make_pair(start, end));
+}
+
+// Splits a line at spaces and tabs (and a trailing CR)
+inline void SplitMaskLine(const std::string &line, std::vector<std::string> &cols)
+{
+    std::istringstream in(line);
+    std::string col;
+    cols.clear();
+    while(in >> col)
+        cols.push_back(col);
+}
+
+// "chromosome position" lines with 1-based positions, as excluded.snps.list and
+// vcftools --exclude-positions; '#' lines are comments
+inline bool LoadMaskSites(PositionMaskBuilder &builder, const std::string &filename, std::string &error)
+{
+    std::ifstream in(filename.c_str());
+    std::vector<std::string> cols;
+    std::string line;
+    long pos;
+
+    if(!in)
+    {
+        error = "could not read " + filename;
+        return false;
+    }
+    while(getline(in, line))
+    {
+        SplitMaskLine(line, cols);
+        if(cols.size()<2 || cols[0][0]=='#')
+            continue;
+        pos = atol(cols[1].c_str());
+        if(pos<1 || pos>UINT32_MAX)
+        {
+            error = filename + " has a bad position: " + line;
+            return false;
+        }
+        AddMaskInterval(builder, cols[0], pos-1, pos);
+    }
+    return true;
+}
+
+// BED intervals (0-based start, exclusive end); track, browser and '#' lines are skipped
+inline bool LoadMaskBed(PositionMaskBuilder &builder, const std::string &filename, std::string &error)
+{
+    std::ifstream in(filename.c_str());
+    std::vector<std::string> cols;
+    std::string line;
+    long start,end;
+
+    if(!in)
+    {
+        error = "could not read " + filename;
+        return false;
+    }
+    while(getline(in, line))
+    {
+        SplitMaskLine(line, cols);
+        if(cols.size()<3 || cols[0][0]=='#' || cols[0]=="track" || cols[0]=="browser")
+            continue;
+        start = atol(cols[1].c_str());
+        end = atol(cols[2].c_str());
+        if(start<0 || end<start || end>UINT32_MAX)
+        {
+            error = filename + " has a bad interval: " + line;
+            return false;
+        }
+        AddMaskInterval(builder, cols[0], start, end);
+    }
+    return true;
+}
+
+inline uint64_t AlignPositionMask(uint64_t offset)
+{
+    return (offset+7) & ~(uint64_t)7;
+}
+
+// Sorts and merges the intervals and lays the mask out as it is stored in a file
+inline void SerializePositionMask(const PositionMaskBuilder &builder, std::vector<char> &data)
+{
+    PositionMaskHeader header;
+    std::vector<PositionMaskChromDesc> desc;
+    std::vector<std::vector<uint32_t> > starts,ends,buckets;
+    std::string names;
+    uint64_t offset;
+    uint32_t b;
+    size_t i,k;
+
+    for(const auto &chr : builder.intervals)
+    {
+        std::vector<std::pair<uint32_t,uint32_t> > sorted = chr.second;
+        std::vector<uint32_t> s,e,first;
+        std::sort(sorted.begin(), sorted.end());
+        for(const auto &interval : sorted)
+        {
+            if(!e.empty() && interval.first<=e.back())
+                e.back() = std::max(e.back(), interval.second);
+            else
+            {
+                s.push_back(interval.first);
+                e.push_back(interval.second);
+            }
+        }
+        first.resize(e.empty() ? 0 : ((e.back()-1) >> POSITION_MASK_BUCKET_SHIFT)+1);
+        for(b=0,k=0; b<first.size(); b++)
+        {
+            while(k<e.size() && e[k]<=((uint64_t)b << POSITION_MASK_BUCKET_SHIFT))
+                k++;
+            first[b] = k;
+        }
+        PositionMaskChromDesc d;
+        memset(&d, 0, sizeof(d));
+        d.name_offset = names.size();
+        d.name_length = chr.first.size();
+        d.nintervals = s.size();
+        d.nbuckets = first.size();
+        names += chr.first;
+        desc.push_back(d);
+        starts.push_back(s);
+        ends.push_back(e);
+        buckets.push_back(first);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POSITION_MASK_MAGIC, sizeof(POSITION_MASK_MAGIC));
+    header.version = POSITION_MASK_VERSION;
+    header.nchroms = desc.size();
+    header.bucket_shift = POSITION_MASK_BUCKET_SHIFT;
+    offset = AlignPositionMask(sizeof(header)+desc.size()*sizeof(PositionMaskChromDesc));
+    for(i=0; i<desc.size(); i++)
+    {
+        desc[i].starts_offset = offset;
+        offset = AlignPositionMask(offset+starts[i].size()*sizeof(uint32_t));
+        desc[i].ends_offset = offset;
+        offset = AlignPositionMask(offset+ends[i].size()*sizeof(uint32_t));
+        desc[i].buckets_offset = offset;
+        offset = AlignPositionMask(offset+buckets[i].size()*sizeof(uint32_t));
+    }
+    header.names_offset = offset;
+    header.names_length = names.size();
+
+    data.assign(offset+names.size(), 0);
+    memcpy(data.data(), &header, sizeof(header));
+    if(!desc.empty())
+        memcpy(data.data()+sizeof(header), desc.data(), desc.size()*sizeof(PositionMaskChromDesc));
+    for(i=0; i<desc.size(); i++)
+    {
+        if(!starts[i].empty())
+        {
+            memcpy(data.data()+desc[i].starts_offset, starts[i].data(), starts[i].size()*sizeof(uint32_t));
+            memcpy(data.data()+desc[i].ends_offset, ends[i].data(), ends[i].size()*sizeof(uint32_t));
+            memcpy(data.data()+desc[i].buckets_offset, buckets[i].data(), buckets[i].size()*sizeof(uint32_t));
+        }
+    }
+    memcpy(data.data()+offset, names.data(), names.size());
+}
+
+// Returns false when the file cannot be written
+inline bool WritePositionMask(const PositionMaskBuilder &builder, const std::string &filename)
+{
+    std::vector<char> data;
+    FILE *fp;
+
+    SerializePositionMask(builder, data);
+    fp = fopen(filename.c_str(), "wb");
+    if(fp==NULL)
+        return false;
+    fwrite(data.data(), 1, data.size(), fp);
+    bool ok = !ferror(fp);
+    return fclose(fp)==0 && ok;
+}
+
+// The intervals of one chromosome; the pointers point into the mapping (or the owned copy)
+struct PositionMaskChrom
+{
+    const uint32_t *starts = NULL;
+    const uint32_t *ends = NULL;
+    const uint32_t *buckets = NULL;
+    uint32_t nintervals = 0;
+    uint32_t nbuckets = 0;
+    uint32_t shift = POSITION_MASK_BUCKET_SHIFT;
+};
+
+struct PositionMask
+{
+    void *map = NULL;
+    size_t size = 0;
+    std::vector<char> owned;              // a mask built in memory from a text list
+    std::vector<PositionMaskChrom> chroms;
+    std::unordered_map<std::string,uint32_t> index;
+};
+
+inline void ClosePositionMask(PositionMask &mask)
+{
+    if(mask.map)
+        munmap(mask.map, mask.size);
+    mask = PositionMask();
+}
+
+// Checks the layout of a serialized mask and indexes its chromosomes
+inline bool IndexPositionMask(PositionMask &mask, const char *base, const std::string &filename, std::string &error)
+{
+    const PositionMaskHeader *header = reinterpret_cast<const PositionMaskHeader*>(base);
+    const PositionMaskChromDesc *desc;
+    uint32_t i;
+
+    if(mask.size<sizeof(PositionMaskHeader) || memcmp(header->magic, POSITION_MASK_MAGIC, sizeof(POSITION_MASK_MAGIC))!=0
+       || header->version!=POSITION_MASK_VERSION)
+    {
+        error = filename + " is not a position mask of version " + std::to_string(POSITION_MASK_VERSION);
+        return false;
+    }
+    desc = reinterpret_cast<const PositionMaskChromDesc*>(base+sizeof(PositionMaskHeader));
+    if(sizeof(PositionMaskHeader)+(uint64_t)header->nchroms*sizeof(PositionMaskChromDesc)>mask.size
+       || header->names_offset+header->names_length>mask.size || header->bucket_shift>=32)
+    {
+        error = filename + " is truncated";
+        return false;
+    }
+    for(i=0; i<header->nchroms; i++)
+    {
+        const PositionMaskChromDesc &d = desc[i];
+        if(d.starts_offset%8!=0 || d.ends_offset%8!=0 || d.buckets_offset%8!=0
+           || d.starts_offset+(uint64_t)d.nintervals*4>mask.size || d.ends_offset+(uint64_t)d.nintervals*4>mask.size
+           || d.buckets_offset+(uint64_t)d.nbuckets*4>mask.size || d.name_offset+d.name_length>header->names_length)
+        {
+            error = filename + " has a bad chromosome entry";
+            return false;
+        }
+        PositionMaskChrom chrom;
+        chrom.starts = reinterpret_cast<const uint32_t*>(base+d.starts_offset);
+        chrom.ends = reinterpret_cast<const uint32_t*>(base+d.ends_offset);
+        chrom.buckets = reinterpret_cast<const uint32_t*>(base+d.buckets_offset);
+        chrom.nintervals = d.nintervals;
+        chrom.nbuckets = d.nbuckets;
+        chrom.shift = header->bucket_shift;
+        mask.index[std::string(base+header->names_offset+d.name_offset, d.name_length)] = mask.chroms.size();
+        mask.chroms.push_back(chrom);
+    }
+    return true;
+}
+
+// Maps a file written by build_position_mask
+inline bool OpenPositionMask(const std::string &filename, PositionMask &mask, std::string &error)
+{
+    struct stat st;
+    int fd;
+
+    mask = PositionMask();
+    fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0 || fstat(fd, &st)!=0)
+    {
+        if(fd>=0) close(fd);
+        error = "could not open " + filename;
+        return false;
+    }
+    mask.size = st.st_size;
+    if(mask.size>=sizeof(PositionMaskHeader))
+        mask.map = mmap(NULL, mask.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mask.map==NULL || mask.map==MAP_FAILED)
+    {
+        mask.map = NULL;
+        error = filename + " is not a position mask";
+        return false;
+    }
+    if(!IndexPositionMask(mask, static_cast<const char*>(mask.map), filename, error))
+    {
+        ClosePositionMask(mask);
+        return false;
+    }
+    return true;
+}
+
+// True when the file starts with the mask magic
+inline bool IsPositionMaskFile(const std::string &filename)
+{
+    char magic[8] = {0};
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if(fp==NULL)
+        return false;
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return n==sizeof(magic) && memcmp(magic, POSITION_MASK_MAGIC, sizeof(POSITION_MASK_MAGIC))==0;
+}
+
+// A mask file is mapped; a ".bed" file or a site list is read and built in memory
+inline bool LoadPositionMask(const std::string &filename, PositionMask &mask, std::string &error)
+{
+    PositionMaskBuilder builder;
+    bool bed;
+
+    if(IsPositionMaskFile(filename))
+        return OpenPositionMask(filename, mask, error);
+    bed = filename.size()>=4 && filename.compare(filename.size()-4, 4, ".bed")==0;
+    if(!(bed ? LoadMaskBed(builder, filename, error) : LoadMaskSites(builder, filename, error)))
+        return false;
+    mask = PositionMask();
+    SerializePositionMask(builder, mask.owned);
+    mask.size = mask.owned.size();
+    return IndexPositionMask(mask, mask.owned.data(), filename, error);
+}
+
+// NULL when the chromosome has nothing masked
+inline const PositionMaskChrom *FindMaskChrom(const PositionMask &mask, const std::string &chr)
+{
+    auto it = mask.index.find(chr);
+    return it==mask.index.end() ? NULL : &mask.chroms[it->second];
+}
+
+// Is the 0-based position masked
+inline bool IsMaskedPosition(const PositionMaskChrom &chrom, uint64_t pos)
+{
+    uint64_t b = pos >> chrom.shift;
+    uint32_t i;
+    if(b>=chrom.nbuckets)
+        return false;
+    i = chrom.buckets[b];
+    while(i<chrom.nintervals && chrom.ends[i]<=pos)
+        i++;
+    return i<chrom.nintervals && chrom.starts[i]<=pos;
+}
+
+// Does any masked position fall in [beg, end)
+inline bool IsMaskedInterval(const PositionMaskChrom &chrom, uint64_t beg, uint64_t end)
+{
+    uint64_t b = beg >> chrom.shift;
+    uint32_t i;
+    if(b>=chrom.nbuckets || beg>=end)
+        return false;
+    i = chrom.buckets[b];
+    while(i<chrom.nintervals && chrom.ends[i]<=beg)
+        i++;
+    return i<chrom.nintervals && chrom.starts[i]<end;
+}
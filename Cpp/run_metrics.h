@@ -0,0 +1,190 @@
+// Per-stage timers and counters, peak RSS and progress reports of filter_bam and
+// xie_unphased_vcf_for_heterozygote_stat (--progress SECONDS, --metrics FILE).
+//
+// All instrumentation goes through g_run_metrics, which stays NULL unless one of the options is
+// given: a disabled StageTimer or CountItems is one load and a predictable branch, without any
+// clock call or atomic operation. A timer started inside another one (a window flush during the
+// scan of a site) is taken out of the enclosing stage, so the stages do not overlap; their times
+// are summed over the threads that run them and can add up to more than the wall time.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+struct RunMetrics
+{
+    std::vector<std::string> stages;
+    std::unique_ptr<std::atomic<uint64_t>[]> nanoseconds,calls;
+    std::string unit;                      // what items counts, e.g. "records" or "sites"
+    std::atomic<uint64_t> items{0};
+    std::chrono::steady_clock::time_point start;
+    double interval = 0;                   // seconds between progress lines, 0 for none
+    std::thread progress;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    ~RunMetrics();
+};
+
+inline RunMetrics *g_run_metrics = NULL;
+
+// Peak resident set size of the process in kB
+inline long PeakRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+inline double RunSeconds(const RunMetrics &metrics)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - metrics.start).count();
+}
+
+// One progress line: elapsed time, items and their rate, peak RSS and the time of each stage
+inline std::string FormatRunProgress(const RunMetrics &metrics)
+{
+    std::ostringstream out;
+    double seconds = RunSeconds(metrics);
+    uint64_t items = metrics.items.load(std::memory_order_relaxed);
+    size_t i;
+
+    out << std::fixed << std::setprecision(1) << "[progress] " << seconds << " s, " << items << " " << metrics.unit
+        << " (" << (seconds>0 ? items/seconds : 0) << "/s), peak RSS " << PeakRssKb()/1024 << " MB";
+    for(i=0; i<metrics.stages.size(); i++)
+        out << ", " << metrics.stages[i] << " " << metrics.nanoseconds[i].load(std::memory_order_relaxed)*1e-9 << " s";
+    return out.str();
+}
+
+// Makes metrics the active instance and starts the progress thread when interval > 0
+inline void StartRunMetrics(RunMetrics &metrics, const std::vector<std::string> &stages, const std::string &unit, double interval)
+{
+    size_t i;
+
+    metrics.stages = stages;
+    metrics.nanoseconds.reset(new std::atomic<uint64_t>[stages.size()]);
+    metrics.calls.reset(new std::atomic<uint64_t>[stages.size()]);
+    for(i=0; i<stages.size(); i++)
+    {
+        metrics.nanoseconds[i] = 0;
+        metrics.calls[i] = 0;
+    }
+    metrics.unit = unit;
+    metrics.interval = interval;
+    metrics.start = std::chrono::steady_clock::now();
+    g_run_metrics = &metrics;
+    if(interval>0)
+        metrics.progress = std::thread([&metrics]()
+        {
+            std::unique_lock<std::mutex> guard(metrics.lock);
+            while(!metrics.wake.wait_for(guard, std::chrono::duration<double>(metrics.interval), [&metrics]() { return metrics.stopping; }))
+                fprintf(stderr, "%s\n", FormatRunProgress(metrics).c_str());
+        });
+}
+
+// Stops the progress thread (printing a last line) and deactivates the instance
+inline void StopRunMetrics(RunMetrics &metrics)
+{
+    if(metrics.progress.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(metrics.lock);
+            metrics.stopping = true;
+        }
+        metrics.wake.notify_all();
+        metrics.progress.join();
+        fprintf(stderr, "%s\n", FormatRunProgress(metrics).c_str());
+    }
+    g_run_metrics = NULL;
+}
+
+// An error return leaves the progress thread running; it is stopped here
+inline RunMetrics::~RunMetrics()
+{
+    if(progress.joinable())
+        StopRunMetrics(*this);
+}
+
+// The final metrics as one JSON object; false when the file cannot be written
+inline bool WriteRunMetrics(const RunMetrics &metrics, const std::string &tool, const std::string &filename)
+{
+    std::ofstream out(filename.c_str());
+    double seconds = RunSeconds(metrics);
+    uint64_t items = metrics.items.load();
+    size_t i;
+
+    out << std::setprecision(6) << std::fixed;
+    out << "{\n  \"tool\": \"" << tool << "\",\n  \"wall_seconds\": " << seconds << ",\n  \"peak_rss_kb\": " << PeakRssKb()
+        << ",\n  \"" << metrics.unit << "\": " << items << ",\n  \"" << metrics.unit << "_per_second\": " << (seconds>0 ? items/seconds : 0)
+        << ",\n  \"stages\": {";
+    for(i=0; i<metrics.stages.size(); i++)
+        out << (i ? "," : "") << "\n    \"" << metrics.stages[i] << "\": {\"seconds\": " << metrics.nanoseconds[i].load()*1e-9
+            << ", \"calls\": " << metrics.calls[i].load() << "}";
+    out << "\n  }\n}\n";
+    out.close();
+    return !out.fail();
+}
+
+// Adds the time until the end of its scope to a stage of the active metrics
+class StageTimer
+{
+public:
+    explicit StageTimer(int stage) : metrics_(g_run_metrics), stage_(stage)
+    {
+        if(metrics_)
+        {
+            parent_ = Current();
+            Current() = this;
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StageTimer()
+    {
+        if(metrics_)
+        {
+            uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start_).count();
+            metrics_->nanoseconds[stage_].fetch_add(elapsed-nested_, std::memory_order_relaxed);
+            metrics_->calls[stage_].fetch_add(1, std::memory_order_relaxed);
+            if(parent_)
+                parent_->nested_ += elapsed;
+            Current() = parent_;
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer &operator=(const StageTimer&) = delete;
+
+private:
+    // The innermost running timer of the thread
+    static StageTimer *&Current()
+    {
+        static thread_local StageTimer *timer = NULL;
+        return timer;
+    }
+
+    RunMetrics *metrics_;
+    int stage_;
+    StageTimer *parent_ = NULL;
+    uint64_t nested_ = 0;
+    std::chrono::steady_clock::time_point start_;
+};
+
+inline void CountItems(uint64_t n)
+{
+    if(g_run_metrics)
+        g_run_metrics->items.fetch_add(n, std::memory_order_relaxed);
+}
@@ -0,0 +1,562 @@
+// Assigns the F1->F2 transmission of every SNP and the recombination breakpoints of the F2 from the
+// shapeit haplotypes (.haps/.sample), as the R functions GetScore, StepHap and correcting_haplotype
+// of "1. determination of recombination breakpoints and allelic transmission.R" do.
+//
+// Each haplotype of the F1 and F2 is packed into 64-bit words, one bit per SNP: the mismatches of two
+// haplotypes are the set bits of their XOR, the scores of the 8 phase configurations are popcounts,
+// and StepHap jumps from one mismatch to the next instead of walking the SNPs. The paternal and
+// maternal haplotypes of an F2 are kept as fragments (runs of SNPs with the same label) while they
+// are corrected. The F2 are traced in parallel; the output is written in the order of the .sample file.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <zlib.h>
+#include "text_input.h"
+
+using namespace std;
+
+// Labels of the grandparental haplotypes: 5/6 are the paternal/maternal haplotypes of the F1 male and
+// 11/12 those of the F1 female; a label is flipped to the other haplotype of its F1 by flag - label
+#define F1MALE_HAP1 5
+#define F1MALE_HAP2 6
+#define F1FEMALE_HAP1 11
+#define F1FEMALE_HAP2 12
+#define F1MALE_FLAG (F1MALE_HAP1+F1MALE_HAP2)
+#define F1FEMALE_FLAG (F1FEMALE_HAP1+F1FEMALE_HAP2)
+
+struct TransmissionOptions
+{
+    int minfraglen;       // fragments of at most this many SNPs are switching errors
+    int mindiffs;         // fragments with at most this many SNPs het in the F1 are switched back
+    int threads;
+};
+
+// An F2 with its parents, as indexes into the .sample file
+struct Family
+{
+    int f2,f1male,f1female;
+};
+
+// The SNPs of one chromosome and the packed haplotypes of the F1 and F2
+struct HapData
+{
+    vector<string> sampleids;
+    vector<Family> families;
+    vector<string> chrom,pos;
+    size_t nsites,nwords;
+    vector<int> packed;                  // first packed haplotype of each sample, -1 when not kept
+    vector<vector<uint64_t> > haps;
+};
+
+// A run of SNPs [begin,end) with the same label
+struct Fragment
+{
+    size_t begin,end;
+    int label;
+};
+typedef vector<Fragment> Fragments;
+
+struct FamilyResult
+{
+    Fragments paternal,maternal;
+    string inheritance,breakpoints;
+};
+
+// Samples of the .sample file (ID_1 ID_2 missing father mother ...) after its two header lines.
+// The F2 are the samples whose father and mother both have their own parents in the file, as the
+// joins of the R script select them
+bool LoadSamples(const string &filename, HapData &data)
+{
+    ifstream in(filename.c_str());
+    vector<string> fathers,mothers,fields;
+    unordered_map<string,int> index;
+    string line;
+    int lineno,i;
+
+    if(!in)
+        return false;
+    lineno = 0;
+    while(getline(in, line))
+    {
+        if(lineno++<2)
+            continue;
+        SplitFields(line, fields);
+        if(fields.empty())
+            continue;
+        if(fields.size()<5)
+            return false;
+        index[fields[1]] = data.sampleids.size();
+        data.sampleids.push_back(fields[1]);
+        fathers.push_back(fields[3]);
+        mothers.push_back(fields[4]);
+    }
+
+    auto parent = [&](const vector<string> &parents, int sample) -> int
+    {
+        auto it = index.find(parents[sample]);
+        return it==index.end() ? -1 : it->second;
+    };
+    for(i=0; i<data.sampleids.size(); i++)
+    {
+        Family family = {i, parent(fathers, i), parent(mothers, i)};
+        if(family.f1male<0 || family.f1female<0)
+            continue;
+        if(parent(fathers, family.f1male)<0 || parent(mothers, family.f1male)<0 ||
+           parent(fathers, family.f1female)<0 || parent(mothers, family.f1female)<0)
+            continue;
+        data.families.push_back(family);
+    }
+    return true;
+}
+
+// Reads the .haps file (chromosome, SNP id, position, alleles, then two 0/1 columns per sample) and
+// packs the haplotypes of the F1 and F2 of the families
+bool LoadHaplotypes(const string &filename, HapData &data, string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    vector<vector<uint64_t> > &haps = data.haps;
+    vector<int> kept;
+    string line;
+    const char *p;
+    size_t nhaps,site,h;
+    int field,k;
+
+    if(fp==NULL)
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    data.packed.assign(data.sampleids.size(), -1);
+    for(const Family &family : data.families)
+        for(int sample : {family.f2, family.f1male, family.f1female})
+            if(data.packed[sample]<0)
+            {
+                data.packed[sample] = 2*kept.size();
+                kept.push_back(sample);
+            }
+    nhaps = 2*data.sampleids.size();
+    haps.assign(2*kept.size(), vector<uint64_t>());
+
+    // The columns of the packed haplotypes, in file order
+    vector<pair<size_t,int> > columns;
+    for(k=0; k<kept.size(); k++)
+    {
+        columns.push_back(make_pair(2*kept[k], 2*k));
+        columns.push_back(make_pair(2*kept[k]+1, 2*k+1));
+    }
+    sort(columns.begin(), columns.end());
+
+    site = 0;
+    while(ReadGzLine(fp, line))
+    {
+        if(line.empty())
+            continue;
+        p = line.c_str();
+        const char *start[3];
+        for(field=0; field<5 && *p; field++)
+        {
+            if(field<3)
+                start[field] = p;
+            while(*p && *p!=' ' && *p!='\t')
+                p++;
+            if(field==0)
+                data.chrom.push_back(string(start[0], p-start[0]));
+            else if(field==2)
+                data.pos.push_back(string(start[2], p-start[2]));
+            while(*p==' ' || *p=='\t')
+                p++;
+        }
+        if((site & 63)==0)
+            for(auto &hap : haps)
+                hap.push_back(0);
+        k = 0;
+        for(h=0; h<nhaps && *p; h++)
+        {
+            if(*p!='0' && *p!='1')
+                break;
+            if(k<columns.size() && columns[k].first==h)
+            {
+                if(*p=='1')
+                    haps[columns[k].second][site>>6] |= uint64_t(1) << (site & 63);
+                k++;
+            }
+            p++;
+            while(*p==' ' || *p=='\t')
+                p++;
+        }
+        if(field<5 || h!=nhaps || *p)
+        {
+            gzclose(fp);
+            error = filename + " line " + to_string(site+1) + ": expected 5 columns and " + to_string(nhaps) + " 0/1 haplotypes";
+            return false;
+        }
+        site++;
+    }
+    gzclose(fp);
+    data.nsites = site;
+    data.nwords = (site+63)/64;
+    return true;
+}
+
+// GetScore summed over the SNPs
+size_t CountMismatches(const vector<uint64_t> &a, const vector<uint64_t> &b)
+{
+    size_t count = 0,w;
+    for(w=0; w<a.size(); w++)
+        count += __builtin_popcountll(a[w]^b[w]);
+    return count;
+}
+
+// Mismatches of a and b at the SNPs [begin,end)
+size_t CountMismatches(const vector<uint64_t> &a, const vector<uint64_t> &b, size_t begin, size_t end)
+{
+    size_t count = 0,w;
+    uint64_t bits;
+
+    for(w=begin>>6; w<<6 < end; w++)
+    {
+        bits = a[w]^b[w];
+        if(w==begin>>6)
+            bits &= ~uint64_t(0) << (begin & 63);
+        if((w+1)<<6 > end)
+            bits &= ~uint64_t(0) >> (64-(end & 63));
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+// First SNP from on where a and b differ, or nsites
+size_t NextMismatch(const vector<uint64_t> &a, const vector<uint64_t> &b, size_t from, size_t nsites)
+{
+    size_t w = from>>6;
+    uint64_t bits;
+
+    if(from>=nsites)
+        return nsites;
+    bits = (a[w]^b[w]) & (~uint64_t(0) << (from & 63));
+    while(bits==0)
+    {
+        if(++w==a.size())
+            return nsites;
+        bits = a[w]^b[w];
+    }
+    return min(nsites, (w<<6)+__builtin_ctzll(bits));
+}
+
+// Appends the SNPs [begin,end), joining them to the last fragment when it has the same label
+void AppendFragment(Fragments &frags, size_t begin, size_t end, int label)
+{
+    if(begin>=end)
+        return;
+    if(!frags.empty() && frags.back().label==label)
+        frags.back().end = end;
+    else
+        frags.push_back(Fragment{begin, end, label});
+}
+
+void MergeFragments(Fragments &frags)
+{
+    Fragments merged;
+    for(const Fragment &frag : frags)
+        AppendFragment(merged, frag.begin, frag.end, frag.label);
+    frags.swap(merged);
+}
+
+// StepHap: the F2 haplotype x encoded by the F1 haplotypes y and z. Up to the first mismatch with
+// either of them x follows the one that mismatches later; on a mismatch with both, x stays with the
+// last one it followed (y at the start). Label 0 is kept where x matches both to the end without
+// having followed either, as in the R function
+Fragments StepHap(const vector<uint64_t> &x, const vector<uint64_t> &y, const vector<uint64_t> &z, int ylabel, int zlabel, size_t nsites)
+{
+    Fragments frags;
+    size_t done,firsty,firstz;
+    int lastparent;
+
+    done = 0;
+    lastparent = 0;
+    while(done<nsites)
+    {
+        firsty = NextMismatch(x, y, done, nsites);
+        firstz = NextMismatch(x, z, done, nsites);
+        if(firsty==nsites || firstz==nsites)
+        {
+            if(firsty==nsites && firstz<nsites)
+                AppendFragment(frags, done, nsites, ylabel);
+            else if(firstz==nsites && firsty<nsites)
+                AppendFragment(frags, done, nsites, zlabel);
+            else
+                AppendFragment(frags, done, nsites, lastparent);
+            break;
+        }
+        if(firsty==firstz)
+        {
+            AppendFragment(frags, done, firsty+1, lastparent>0 ? lastparent : ylabel);
+            done = firsty+1;
+        }
+        else if(firstz>firsty)
+        {
+            AppendFragment(frags, done, firstz, zlabel);
+            done = firstz;
+            lastparent = zlabel;
+        }
+        else
+        {
+            AppendFragment(frags, done, firsty, ylabel);
+            done = firsty;
+            lastparent = ylabel;
+        }
+    }
+    return frags;
+}
+
+size_t CountLabel(const Fragments &frags, int label)
+{
+    size_t count = 0;
+    for(const Fragment &frag : frags)
+        if(frag.label==label)
+            count += frag.end-frag.begin;
+    return count;
+}
+
+void RelabelFragments(Fragments &frags, int from, int to)
+{
+    for(Fragment &frag : frags)
+        if(frag.label==from)
+            frag.label = to;
+    MergeFragments(frags);
+}
+
+// correcting_haplotype: (1) a label carried by at most 3 SNPs is a genotyping error, (2) fragments of
+// at most minfraglen SNPs are switching errors and are flipped until none is left, (3) fragments with
+// at most mindiffs SNPs het in the F1 (hap1, hap2) are flipped. The R loop of step 2 never ends
+// when all fragments are short; here it stops
+void CorrectHaplotype(Fragments &frags, int columnflag, const vector<uint64_t> &hap1, const vector<uint64_t> &hap2, const TransmissionOptions &options)
+{
+    size_t nshort,i;
+    int first,second;
+
+    if(frags.empty())
+        return;
+    first = frags[0].label;
+    second = first;
+    for(i=1; i<frags.size() && second==first; i++)
+        second = frags[i].label;
+    if(second==first)
+        return;
+    if(CountLabel(frags, first)<=3)
+    {
+        RelabelFragments(frags, first, second);
+        return;
+    }
+    if(CountLabel(frags, second)<=3)
+    {
+        RelabelFragments(frags, second, first);
+        return;
+    }
+
+    while(frags.size()>=2)
+    {
+        nshort = 0;
+        for(const Fragment &frag : frags)
+            if(frag.end-frag.begin<=options.minfraglen)
+                nshort++;
+        if(nshort==0 || nshort==frags.size())
+            break;
+        for(Fragment &frag : frags)
+            if(frag.end-frag.begin<=options.minfraglen)
+                frag.label = columnflag-frag.label;
+        MergeFragments(frags);
+    }
+
+    if(frags.size()>=2)
+    {
+        for(Fragment &frag : frags)
+            if(CountMismatches(hap1, hap2, frag.begin, frag.end)<=options.mindiffs)
+                frag.label = columnflag-frag.label;
+        MergeFragments(frags);
+    }
+}
+
+// Chooses the phase of the F2 by the 8 configurations of the R script, then traces and corrects its
+// paternal and maternal haplotypes
+void TraceFamily(const HapData &data, const Family &family, const TransmissionOptions &options, FamilyResult &result)
+{
+    const vector<uint64_t> *f2[2],*male[2],*female[2];
+    size_t score[8],best;
+    int swap,a,b,k;
+
+    for(k=0; k<2; k++)
+    {
+        f2[k] = &data.haps[data.packed[family.f2]+k];
+        male[k] = &data.haps[data.packed[family.f1male]+k];
+        female[k] = &data.haps[data.packed[family.f1female]+k];
+    }
+    for(swap=0; swap<2; swap++)
+        for(a=0; a<2; a++)
+            for(b=0; b<2; b++)
+                score[swap*4+a*2+b] = CountMismatches(*f2[swap], *male[a]) + CountMismatches(*f2[1-swap], *female[b]);
+    best = min_element(score, score+8)-score;
+    swap = best<4 ? 0 : 1;
+
+    result.paternal = StepHap(*f2[swap], *male[0], *male[1], F1MALE_HAP1, F1MALE_HAP2, data.nsites);
+    result.maternal = StepHap(*f2[1-swap], *female[0], *female[1], F1FEMALE_HAP1, F1FEMALE_HAP2, data.nsites);
+    CorrectHaplotype(result.paternal, F1MALE_FLAG, *male[0], *male[1], options);
+    CorrectHaplotype(result.maternal, F1FEMALE_FLAG, *female[0], *female[1], options);
+}
+
+// f2 chromosome position paternal maternal, one line per SNP
+void FormatInheritance(const HapData &data, const Family &family, FamilyResult &result)
+{
+    const string &id = data.sampleids[family.f2];
+    size_t site,p,m;
+
+    result.inheritance.clear();
+    p = m = 0;
+    for(site=0; site<data.nsites; site++)
+    {
+        while(result.paternal[p].end<=site)
+            p++;
+        while(result.maternal[m].end<=site)
+            m++;
+        result.inheritance += id;
+        result.inheritance += '\t';
+        result.inheritance += data.chrom[site];
+        result.inheritance += '\t';
+        result.inheritance += data.pos[site];
+        result.inheritance += '\t';
+        result.inheritance += to_string(result.paternal[p].label);
+        result.inheritance += '\t';
+        result.inheritance += to_string(result.maternal[m].label);
+        result.inheritance += '\n';
+    }
+}
+
+// f2 f1male f1female chromosome left right P|M: the label changes between the SNPs left and right
+void FormatBreakpoints(const HapData &data, const Family &family, FamilyResult &result)
+{
+    const Fragments *haps[2] = {&result.paternal, &result.maternal};
+    const char *side[2] = {"P", "M"};
+    size_t i,k;
+    int h;
+
+    result.breakpoints.clear();
+    for(h=0; h<2; h++)
+        for(i=0; i+1<haps[h]->size(); i++)
+        {
+            k = (*haps[h])[i].end-1;
+            result.breakpoints += data.sampleids[family.f2] + "\t" + data.sampleids[family.f1male] + "\t" + data.sampleids[family.f1female] + "\t" +
+                                  data.chrom[k] + "\t" + data.pos[k] + "\t" + data.pos[k+1] + "\t" + side[h] + "\n";
+        }
+}
+
+// Traces the families of one chromosome on options.threads threads, a batch at a time so that only
+// the text of a batch is held in memory, and appends it to the outputs in family order
+void TraceChromosome(const HapData &data, const TransmissionOptions &options, ostream &inheritance, ostream &breakpoints)
+{
+    vector<FamilyResult> results;
+    size_t batch,first,count;
+    int i;
+
+    batch = 4*max(1, options.threads);
+    results.resize(batch);
+    for(first=0; first<data.families.size(); first+=batch)
+    {
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        count = min(batch, data.families.size()-first);
+        for(i=0; i<max(1, options.threads); i++)
+            workers.emplace_back([&]()
+            {
+                size_t f;
+                while((f = next++) < count)
+                {
+                    const Family &family = data.families[first+f];
+                    TraceFamily(data, family, options, results[f]);
+                    FormatInheritance(data, family, results[f]);
+                    FormatBreakpoints(data, family, results[f]);
+                }
+            });
+        for(auto &worker : workers)
+            worker.join();
+        for(size_t f=0; f<count; f++)
+        {
+            inheritance << results[f].inheritance;
+            breakpoints << results[f].breakpoints;
+        }
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    TransmissionOptions options = {50, 10, 1};
+    vector<string> args;
+    string error;
+    int i;
+
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--threads" && i+1<argc)
+            options.threads = atoi(argv[++i]);
+        else if(opt=="--min-frag-len" && i+1<argc)
+            options.minfraglen = atoi(argv[++i]);
+        else if(opt=="--min-diffs" && i+1<argc)
+            options.mindiffs = atoi(argv[++i]);
+        else
+            args.push_back(opt);
+    }
+    if(args.size()<3 || options.threads<1)
+    {
+        cout << "Usage: " << argv[0] << " f2.inheritance.txt f2.recombination.txt chr1.phased.duohmm [chr2.phased.duohmm ...] [--threads N]\n";
+        cout << "       [--min-frag-len 50] [--min-diffs 10]\n";
+        cout << "  Reads PREFIX.haps (plain or gzipped) and PREFIX.sample of every shapeit output prefix. The F2 are\n";
+        cout << "  the samples whose parents have their own parents in the .sample file.\n";
+        cout << "  f2.inheritance.txt gets 'f2 chromosome position paternal maternal' for every F2 and SNP, the\n";
+        cout << "  paternal allele being 5 or 6 (F1 male's paternal or maternal haplotype) and the maternal allele\n";
+        cout << "  11 or 12 (F1 female's); f2.recombination.txt gets 'f2 f1male f1female chromosome left right P|M'\n";
+        cout << "  for every change of allele between two adjacent SNPs.\n";
+        cout << "  --threads N        trace N F2 at once\n";
+        cout << "  --min-frag-len L   fragments of at most L SNPs are switching errors (correcting_haplotype minfraglen)\n";
+        cout << "  --min-diffs D      fragments with at most D SNPs het in the F1 are switched back (mindiffs)\n";
+        return 0;
+    }
+
+    ofstream inheritance(args[0].c_str()),breakpoints(args[1].c_str());
+    if(!inheritance || !breakpoints)
+    {
+        cerr << "Error: could not write " << (inheritance ? args[1] : args[0]) << endl;
+        return 1;
+    }
+    for(i=2; i<args.size(); i++)
+    {
+        HapData data;
+        if(!LoadSamples(args[i]+".sample", data))
+        {
+            cerr << "Error: could not read " << args[i] << ".sample" << endl;
+            return 1;
+        }
+        if(!LoadHaplotypes(args[i]+".haps", data, error))
+        {
+            cerr << "Error: " << error << endl;
+            return 1;
+        }
+        cerr << args[i] << ": " << data.families.size() << " F2, " << data.nsites << " SNPs" << endl;
+        if(data.nsites>0)
+            TraceChromosome(data, options, inheritance, breakpoints);
+    }
+    inheritance.close();
+    breakpoints.close();
+    if(!inheritance || !breakpoints)
+    {
+        cerr << "Error: could not write the outputs" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <htslib/sam.h>
+#include <htslib/hts.h>
+
+// 生成用于测试 filter_bam 性能的模拟 BAM 文件: 每个片段一组同名 reads，
+// 可设置多重比对、单端 read、不协调配对的比例以及 NM、Indel 和插入片段长度的分布
+
+struct SimulateOptions {
+    uint64_t pairs = 1000000;
+    int contigs = 18;
+    int64_t contig_length = 100000000;
+    int read_length = 150;
+    double insert_mean = 350;
+    double insert_sd = 50;
+    double multimap_rate = 0.1;     // 带有次要比对的片段比例
+    int max_extra = 4;              // 每个多重比对片段额外的次要比对配对数，在 1..max_extra 中均匀抽取
+    double unpaired_rate = 0.02;    // 只有一条 read 的片段比例
+    double discordant_rate = 0.01;  // 两条 read 比对到不同染色体的片段比例
+    double nm_mean = 1.5;           // 每条 read 错配数的均值 (泊松分布)
+    double indel_mean = 0.1;        // 每条 read Indel 数的均值 (泊松分布)
+    bool coord_sorted = false;
+    uint64_t seed = 1;
+};
+
+class ReadSimulator {
+public:
+    ReadSimulator(const SimulateOptions &options)
+        : options_(options), rng_(options.seed), nm_(options.nm_mean), indel_(options.indel_mean),
+          insert_(options.insert_mean, options.insert_sd), unit_(0.0, 1.0) {}
+
+    // 生成第 i 个片段的所有 reads，追加到 out
+    void fragment(uint64_t i, std::vector<bam1_t*> &out) {
+        std::string qname = "sim." + std::to_string(i);
+        double u = unit_(rng_);
+        if (u < options_.unpaired_rate) {
+            int32_t tid = random_tid();
+            hts_pos_t pos = random_pos(options_.read_length);
+            out.push_back(make_read(qname, BAM_FPAIRED | BAM_FMUNMAP | BAM_FREAD1, tid, pos, 60, tid, pos, 0));
+            return;
+        }
+        bool multimap = unit_(rng_) < options_.multimap_rate;
+        uint8_t mapq = multimap ? std::uniform_int_distribution<int>(0, 10)(rng_) : 60;
+        if (u < options_.unpaired_rate + options_.discordant_rate) {
+            int32_t tid1 = random_tid(), tid2 = (tid1 + 1) % options_.contigs;
+            hts_pos_t pos1 = random_pos(options_.read_length), pos2 = random_pos(options_.read_length);
+            out.push_back(make_read(qname, BAM_FPAIRED | BAM_FMREVERSE | BAM_FREAD1, tid1, pos1, mapq, tid2, pos2, 0));
+            out.push_back(make_read(qname, BAM_FPAIRED | BAM_FREVERSE | BAM_FREAD2, tid2, pos2, mapq, tid1, pos1, 0));
+        } else {
+            add_pair(qname, 0, mapq, out);
+        }
+        if (multimap) {
+            int extra = std::uniform_int_distribution<int>(1, options_.max_extra)(rng_);
+            for (int k = 0; k < extra; ++k) {
+                add_pair(qname, BAM_FSECONDARY, 0, out);
+            }
+        }
+    }
+
+private:
+    int32_t random_tid() {
+        return std::uniform_int_distribution<int32_t>(0, options_.contigs - 1)(rng_);
+    }
+
+    hts_pos_t random_pos(int64_t span) {
+        return std::uniform_int_distribution<hts_pos_t>(0, std::max<int64_t>(options_.contig_length - span, 1) - 1)(rng_);
+    }
+
+    // 一对方向相反的 reads，左侧 read 为正链；read1 随机位于左侧或右侧
+    void add_pair(const std::string &qname, uint16_t extra_flag, uint8_t mapq, std::vector<bam1_t*> &out) {
+        int64_t insert = std::max<int64_t>(options_.read_length, std::llround(insert_(rng_)));
+        int32_t tid = random_tid();
+        hts_pos_t left = random_pos(insert);
+        hts_pos_t right = left + insert - options_.read_length;
+        uint16_t left_read = unit_(rng_) < 0.5 ? BAM_FREAD1 : BAM_FREAD2;
+        uint16_t right_read = left_read == BAM_FREAD1 ? BAM_FREAD2 : BAM_FREAD1;
+        uint16_t flag = BAM_FPAIRED | BAM_FPROPER_PAIR | extra_flag;
+        out.push_back(make_read(qname, flag | BAM_FMREVERSE | left_read, tid, left, mapq, tid, right, insert));
+        out.push_back(make_read(qname, flag | BAM_FREVERSE | right_read, tid, right, mapq, tid, left, -insert));
+    }
+
+    // 随机插入 Indel 构造 CIGAR，NM 为错配数加上 Indel 的碱基数
+    bam1_t *make_read(const std::string &qname, uint16_t flag, int32_t tid, hts_pos_t pos, uint8_t mapq,
+                      int32_t mtid, hts_pos_t mpos, hts_pos_t isize) {
+        int length = options_.read_length;
+        int n_indel = std::min(indel_(rng_), length / 10);
+        std::vector<int> breaks;
+        for (int k = 0; k < n_indel; ++k) {
+            breaks.push_back(std::uniform_int_distribution<int>(5, length - 5)(rng_));
+        }
+        std::sort(breaks.begin(), breaks.end());
+
+        cigar_.clear();
+        int nm = nm_(rng_);
+        int query = 0;
+        for (int b : breaks) {
+            if (b > query) {
+                cigar_.push_back(bam_cigar_gen(b - query, BAM_CMATCH));
+                query = b;
+            }
+            int indel_length = std::uniform_int_distribution<int>(1, 3)(rng_);
+            bool insertion = unit_(rng_) < 0.5 && query + indel_length < length;
+            if (insertion) {
+                cigar_.push_back(bam_cigar_gen(indel_length, BAM_CINS));
+                query += indel_length;
+            } else {
+                cigar_.push_back(bam_cigar_gen(indel_length, BAM_CDEL));
+            }
+            nm += indel_length;
+        }
+        if (length > query) {
+            cigar_.push_back(bam_cigar_gen(length - query, BAM_CMATCH));
+        }
+
+        static const char bases[] = "ACGT";
+        seq_.resize(length);
+        for (char &c : seq_) {
+            c = bases[rng_() & 3];
+        }
+        qual_.assign(length, 30);
+
+        bam1_t *aln = bam_init1();
+        if (bam_set1(aln, qname.size(), qname.c_str(), flag, tid, pos, mapq, cigar_.size(), cigar_.data(),
+                     mtid, mpos, isize, length, seq_.data(), qual_.data(), 8) < 0) {
+            std::cerr << "Error: could not build alignment record\n";
+            exit(1);
+        }
+        int32_t nm_value = nm;
+        bam_aux_append(aln, "NM", 'i', 4, reinterpret_cast<uint8_t*>(&nm_value));
+        return aln;
+    }
+
+    const SimulateOptions &options_;
+    std::mt19937_64 rng_;
+    std::poisson_distribution<int> nm_;
+    std::poisson_distribution<int> indel_;
+    std::normal_distribution<double> insert_;
+    std::uniform_real_distribution<double> unit_;
+    std::vector<uint32_t> cigar_;
+    std::string seq_;
+    std::string qual_;
+};
+
+void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options] <output.bam>\n";
+    std::cerr << "  --pairs N            number of read-name groups (fragments) (default: 1000000)\n";
+    std::cerr << "  --contigs N          number of contigs (default: 18)\n";
+    std::cerr << "  --contig-length N    length of each contig (default: 100000000)\n";
+    std::cerr << "  --read-length N      read length (default: 150)\n";
+    std::cerr << "  --insert-mean X      mean insert size (default: 350)\n";
+    std::cerr << "  --insert-sd X        insert size standard deviation (default: 50)\n";
+    std::cerr << "  --multimap-rate X    fraction of fragments with secondary alignments (default: 0.1)\n";
+    std::cerr << "  --max-extra N        secondary pairs per multi-mapped fragment, uniform in 1..N (default: 4)\n";
+    std::cerr << "  --unpaired-rate X    fraction of fragments with a single read (default: 0.02)\n";
+    std::cerr << "  --discordant-rate X  fraction of fragments with mates on different contigs (default: 0.01)\n";
+    std::cerr << "  --nm-mean X          mean number of mismatches per read (default: 1.5)\n";
+    std::cerr << "  --indel-mean X       mean number of indels per read (default: 0.1)\n";
+    std::cerr << "  --coord-sorted       sort the output by coordinate (default: reads grouped by name);\n";
+    std::cerr << "                       keeps all records in memory\n";
+    std::cerr << "  --seed N             random seed (default: 1)\n";
+}
+
+int main(int argc, char *argv[]) {
+    SimulateOptions options;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        bool has_value = i + 1 < argc;
+        if (opt == "--pairs" && has_value) {
+            options.pairs = std::stoull(argv[++i]);
+        } else if (opt == "--contigs" && has_value) {
+            options.contigs = std::stoi(argv[++i]);
+        } else if (opt == "--contig-length" && has_value) {
+            options.contig_length = std::stoll(argv[++i]);
+        } else if (opt == "--read-length" && has_value) {
+            options.read_length = std::stoi(argv[++i]);
+        } else if (opt == "--insert-mean" && has_value) {
+            options.insert_mean = std::stod(argv[++i]);
+        } else if (opt == "--insert-sd" && has_value) {
+            options.insert_sd = std::stod(argv[++i]);
+        } else if (opt == "--multimap-rate" && has_value) {
+            options.multimap_rate = std::stod(argv[++i]);
+        } else if (opt == "--max-extra" && has_value) {
+            options.max_extra = std::stoi(argv[++i]);
+        } else if (opt == "--unpaired-rate" && has_value) {
+            options.unpaired_rate = std::stod(argv[++i]);
+        } else if (opt == "--discordant-rate" && has_value) {
+            options.discordant_rate = std::stod(argv[++i]);
+        } else if (opt == "--nm-mean" && has_value) {
+            options.nm_mean = std::stod(argv[++i]);
+        } else if (opt == "--indel-mean" && has_value) {
+            options.indel_mean = std::stod(argv[++i]);
+        } else if (opt == "--coord-sorted") {
+            options.coord_sorted = true;
+        } else if (opt == "--seed" && has_value) {
+            options.seed = std::stoull(argv[++i]);
+        } else if (opt.compare(0, 2, "--") == 0) {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 1 || options.contigs < 2 || options.read_length < 20 || options.max_extra < 1 ||
+        options.contig_length < 10 * (options.insert_mean + 10 * options.insert_sd)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    sam_hdr_t *header = sam_hdr_init();
+    if (options.coord_sorted) {
+        sam_hdr_add_line(header, "HD", "VN", "1.6", "SO", "coordinate", nullptr);
+    } else {
+        sam_hdr_add_line(header, "HD", "VN", "1.6", "SO", "unsorted", "GO", "query", nullptr);
+    }
+    std::string length = std::to_string(options.contig_length);
+    for (int i = 0; i < options.contigs; ++i) {
+        std::string name = "chr" + std::to_string(i + 1);
+        sam_hdr_add_line(header, "SQ", "SN", name.c_str(), "LN", length.c_str(), nullptr);
+    }
+
+    samFile *out = sam_open(args[0], "wb");
+    if (out == nullptr || sam_hdr_write(out, header) < 0) {
+        std::cerr << "Error: could not open output BAM file " << args[0] << "\n";
+        return 1;
+    }
+
+    ReadSimulator simulator(options);
+    std::vector<bam1_t*> reads;
+    uint64_t records = 0;
+    for (uint64_t i = 0; i < options.pairs; ++i) {
+        size_t first = options.coord_sorted ? reads.size() : 0;
+        simulator.fragment(i, reads);
+        records += reads.size() - first;
+        if (options.coord_sorted) {
+            continue;
+        }
+        for (bam1_t *aln : reads) {
+            if (sam_write1(out, header, aln) < 0) {
+                std::cerr << "Error: could not write alignment to " << args[0] << "\n";
+                return 1;
+            }
+            bam_destroy1(aln);
+        }
+        reads.clear();
+    }
+
+    if (options.coord_sorted) {
+        std::stable_sort(reads.begin(), reads.end(), [](const bam1_t *a, const bam1_t *b) {
+            return a->core.tid != b->core.tid ? a->core.tid < b->core.tid : a->core.pos < b->core.pos;
+        });
+        for (bam1_t *aln : reads) {
+            if (sam_write1(out, header, aln) < 0) {
+                std::cerr << "Error: could not write alignment to " << args[0] << "\n";
+                return 1;
+            }
+            bam_destroy1(aln);
+        }
+    }
+
+    sam_close(out);
+    sam_hdr_destroy(header);
+    std::cout << "Wrote " << records << " records for " << options.pairs << " fragments to " << args[0] << "\n";
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Line reading and field splitting shared by the programs that read the text tables of the
+// pipeline (shapeit output, inheritance and window tables), plain or gzipped alike through zlib.
+#pragma once
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Reads one line of a plain or gzipped file; false at the end
+inline bool ReadGzLine(gzFile fp, std::string &line)
+{
+    char buffer[65536];
+    size_t len;
+
+    line.clear();
+    while(gzgets(fp, buffer, sizeof(buffer)))
+    {
+        line += buffer;
+        len = line.size();
+        if(len>0 && line[len-1]=='\n')
+        {
+            line.resize(len-1);
+            if(len>1 && line[len-2]=='\r')
+                line.resize(len-2);
+            return true;
+        }
+    }
+    return !line.empty();
+}
+
+// Cuts the line at spaces and tabs in place; fields point into it. For loaders of large tables
+inline void SplitFields(std::string &line, std::vector<char*> &fields)
+{
+    char *p = &line[0],*end = p+line.size();
+
+    fields.clear();
+    while(p<end)
+    {
+        while(p<end && (*p==' ' || *p=='\t'))
+            *p++ = 0;
+        if(p<end)
+            fields.push_back(p);
+        while(p<end && *p!=' ' && *p!='\t')
+            p++;
+    }
+}
+
+// The whitespace-separated fields of a line, copied
+inline void SplitFields(const std::string &line, std::vector<std::string> &fields)
+{
+    std::istringstream in(line);
+    std::string field;
+
+    fields.clear();
+    while(in >> field)
+        fields.push_back(field);
+}
+
+// Numeric ids (F2, chromosomes, traits) sort as numbers, before the others
+inline bool IdLess(const std::string &a, const std::string &b)
+{
+    char *enda,*endb;
+    long x = strtol(a.c_str(), &enda, 10),y = strtol(b.c_str(), &endb, 10);
+    bool numa = *enda==0 && !a.empty(),numb = *endb==0 && !b.empty();
+
+    if(numa!=numb)
+        return numa;
+    if(numa && x!=y)
+        return x<y;
+    return a<b;
+}
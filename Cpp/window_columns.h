@@ -0,0 +1,270 @@
+// Binary columnar table of window statistics, written by xie_unphased_vcf_for_heterozygote_stat --binary
+// and read back (memory-mapped) by dump_window_columns.
+//
+// Layout, little-endian, every column starting on an 8-byte boundary so that a mapped file can
+// be read in place:
+//   WindowColumnsHeader
+//   WindowColumnDesc[ncols]
+//   column data: nrows values of each column, one column after the other
+//   metadata: "key=value\n" lines (the TSV header line, the columns the TSV leaves out, ...)
+//   dictionary: NUL-terminated strings referenced by COLUMN_DICT values (chromosome names)
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WINDOW_COLUMNS_MAGIC "HETCOLS"
+#define WINDOW_COLUMNS_VERSION 1
+
+enum WindowColumnType
+{
+    COLUMN_INT32 = 1,
+    COLUMN_INT64 = 2,
+    COLUMN_FLOAT32 = 3,
+    COLUMN_DICT = 4      // uint32 index into the dictionary
+};
+
+struct WindowColumnsHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t ncols;
+    uint64_t nrows;
+    uint64_t meta_offset,meta_length;
+    uint64_t dict_offset;
+    uint32_t dict_count;
+    uint32_t reserved;
+};
+
+struct WindowColumnDesc
+{
+    char name[24];
+    uint32_t type;
+    uint32_t width;
+    uint64_t offset;
+};
+
+inline uint32_t WindowColumnWidth(uint32_t type)
+{
+    return type==COLUMN_INT64 ? 8 : 4;
+}
+
+// Columns are filled row by row in memory and written out at the end
+struct WindowColumnsWriter
+{
+    std::vector<std::string> names;
+    std::vector<uint32_t> types;
+    std::vector<std::vector<char> > data;
+    std::vector<std::string> dict;
+    std::unordered_map<std::string,uint32_t> dictids;
+    std::string meta;
+    uint64_t nrows = 0;
+};
+
+inline int AddWindowColumn(WindowColumnsWriter &writer, const std::string &name, uint32_t type)
+{
+    writer.names.push_back(name);
+    writer.types.push_back(type);
+    writer.data.emplace_back();
+    return writer.names.size()-1;
+}
+
+inline void AppendWindowColumn(WindowColumnsWriter &writer, int col, const void *value)
+{
+    const char *bytes = static_cast<const char*>(value);
+    writer.data[col].insert(writer.data[col].end(), bytes, bytes+WindowColumnWidth(writer.types[col]));
+}
+
+inline void AppendInt32(WindowColumnsWriter &writer, int col, int32_t value) { AppendWindowColumn(writer, col, &value); }
+inline void AppendInt64(WindowColumnsWriter &writer, int col, int64_t value) { AppendWindowColumn(writer, col, &value); }
+inline void AppendFloat32(WindowColumnsWriter &writer, int col, float value) { AppendWindowColumn(writer, col, &value); }
+
+inline void AppendDict(WindowColumnsWriter &writer, int col, const std::string &value)
+{
+    auto it = writer.dictids.find(value);
+    if(it==writer.dictids.end())
+    {
+        it = writer.dictids.emplace(value, writer.dict.size()).first;
+        writer.dict.push_back(value);
+    }
+    AppendWindowColumn(writer, col, &it->second);
+}
+
+inline void AddWindowMeta(WindowColumnsWriter &writer, const std::string &key, const std::string &value)
+{
+    writer.meta += key + "=" + value + "\n";
+}
+
+inline uint64_t AlignWindowColumn(uint64_t offset)
+{
+    return (offset+7) & ~(uint64_t)7;
+}
+
+// Returns false when the file cannot be written
+inline bool WriteWindowColumns(const WindowColumnsWriter &writer, const std::string &filename)
+{
+    WindowColumnsHeader header;
+    std::vector<WindowColumnDesc> desc(writer.names.size());
+    std::vector<char> padding(8, 0);
+    uint64_t offset;
+    size_t i;
+    FILE *fp;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WINDOW_COLUMNS_MAGIC, sizeof(WINDOW_COLUMNS_MAGIC));
+    header.version = WINDOW_COLUMNS_VERSION;
+    header.ncols = writer.names.size();
+    header.nrows = writer.nrows;
+    offset = AlignWindowColumn(sizeof(header)+desc.size()*sizeof(WindowColumnDesc));
+    for(i=0; i<desc.size(); i++)
+    {
+        memset(&desc[i], 0, sizeof(desc[i]));
+        strncpy(desc[i].name, writer.names[i].c_str(), sizeof(desc[i].name)-1);
+        desc[i].type = writer.types[i];
+        desc[i].width = WindowColumnWidth(writer.types[i]);
+        desc[i].offset = offset;
+        offset = AlignWindowColumn(offset+writer.data[i].size());
+    }
+    header.meta_offset = offset;
+    header.meta_length = writer.meta.size();
+    header.dict_offset = offset+writer.meta.size();
+    header.dict_count = writer.dict.size();
+
+    fp = fopen(filename.c_str(), "wb");
+    if(fp==NULL)
+        return false;
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(desc.data(), sizeof(WindowColumnDesc), desc.size(), fp);
+    offset = sizeof(header)+desc.size()*sizeof(WindowColumnDesc);
+    for(i=0; i<desc.size(); i++)
+    {
+        fwrite(padding.data(), 1, desc[i].offset-offset, fp);
+        fwrite(writer.data[i].data(), 1, writer.data[i].size(), fp);
+        offset = desc[i].offset+writer.data[i].size();
+    }
+    fwrite(padding.data(), 1, header.meta_offset-offset, fp);
+    fwrite(writer.meta.data(), 1, writer.meta.size(), fp);
+    for(const std::string &value : writer.dict)
+        fwrite(value.c_str(), 1, value.size()+1, fp);
+    bool ok = !ferror(fp);
+    return fclose(fp)==0 && ok;
+}
+
+// A mapped table; the column pointers point into the mapping
+struct WindowColumnsReader
+{
+    void *map = NULL;
+    size_t size = 0;
+    const WindowColumnsHeader *header = NULL;
+    const WindowColumnDesc *columns = NULL;
+    std::string meta;
+    std::vector<const char*> dict;
+};
+
+inline void CloseWindowColumns(WindowColumnsReader &reader)
+{
+    if(reader.map)
+        munmap(reader.map, reader.size);
+    reader = WindowColumnsReader();
+}
+
+// Maps the file and checks its layout; error describes the first problem found
+inline bool OpenWindowColumns(const std::string &filename, WindowColumnsReader &reader, std::string &error)
+{
+    struct stat st;
+    const char *base,*p,*end;
+    uint32_t i;
+    int fd;
+
+    reader = WindowColumnsReader();
+    fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0 || fstat(fd, &st)!=0)
+    {
+        if(fd>=0) close(fd);
+        error = "could not open " + filename;
+        return false;
+    }
+    reader.size = st.st_size;
+    if(reader.size>=sizeof(WindowColumnsHeader))
+        reader.map = mmap(NULL, reader.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(reader.map==NULL || reader.map==MAP_FAILED)
+    {
+        reader.map = NULL;
+        error = filename + " is not a window column file";
+        return false;
+    }
+    base = static_cast<const char*>(reader.map);
+    reader.header = reinterpret_cast<const WindowColumnsHeader*>(base);
+    if(memcmp(reader.header->magic, WINDOW_COLUMNS_MAGIC, sizeof(WINDOW_COLUMNS_MAGIC))!=0 || reader.header->version!=WINDOW_COLUMNS_VERSION)
+    {
+        CloseWindowColumns(reader);
+        error = filename + " is not a window column file of version " + std::to_string(WINDOW_COLUMNS_VERSION);
+        return false;
+    }
+    reader.columns = reinterpret_cast<const WindowColumnDesc*>(base+sizeof(WindowColumnsHeader));
+    if(sizeof(WindowColumnsHeader)+reader.header->ncols*sizeof(WindowColumnDesc)>reader.size
+       || reader.header->meta_offset+reader.header->meta_length>reader.size || reader.header->dict_offset>reader.size)
+    {
+        CloseWindowColumns(reader);
+        error = filename + " is truncated";
+        return false;
+    }
+    for(i=0; i<reader.header->ncols; i++)
+    {
+        const WindowColumnDesc &col = reader.columns[i];
+        if(col.width!=WindowColumnWidth(col.type) || col.offset%8!=0 || col.offset+reader.header->nrows*col.width>reader.size)
+        {
+            CloseWindowColumns(reader);
+            error = filename + " has a bad column " + std::string(col.name, strnlen(col.name, sizeof(col.name)));
+            return false;
+        }
+    }
+    reader.meta.assign(base+reader.header->meta_offset, reader.header->meta_length);
+    p = base+reader.header->dict_offset;
+    end = base+reader.size;
+    for(i=0; i<reader.header->dict_count && p<end; i++)
+    {
+        reader.dict.push_back(p);
+        p = static_cast<const char*>(memchr(p, 0, end-p));
+        if(p==NULL)
+            break;
+        p++;
+    }
+    if(reader.dict.size()!=reader.header->dict_count || p==NULL)
+    {
+        CloseWindowColumns(reader);
+        error = filename + " has a truncated dictionary";
+        return false;
+    }
+    return true;
+}
+
+inline const void *WindowColumnData(const WindowColumnsReader &reader, uint32_t col)
+{
+    return static_cast<const char*>(reader.map)+reader.columns[col].offset;
+}
+
+// Value of a metadata key, "" when absent
+inline std::string WindowColumnsMeta(const WindowColumnsReader &reader, const std::string &key)
+{
+    size_t pos = 0,end;
+    while(pos<reader.meta.size())
+    {
+        end = reader.meta.find('\n', pos);
+        if(end==std::string::npos)
+            end = reader.meta.size();
+        if(reader.meta.compare(pos, key.size()+1, key+"=")==0)
+            return reader.meta.substr(pos+key.size()+1, end-pos-key.size()-1);
+        pos = end+1;
+    }
+    return "";
+}
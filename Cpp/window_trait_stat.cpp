@@ -0,0 +1,489 @@
+// Per-window trait statistics of the four paternal/maternal genotype classes, the tables
+// window100k_single_site_trait_stat and window100k_single_site_trait_stat_mutant_deviation_from_mean
+// that "2. F2 inheritance fragment processing and trait association preparation.R" builds with MySQL.
+//
+// The trait file (f2_trait_name_trait_value.csv) is loaded as a dense F2 x trait matrix of value sums
+// and counts, a row per F2 padded to a multiple of 8 traits. The window table (inheritance_windows
+// output) becomes one genotype code per F2 and window; windows where an F2 has more than two rows
+// (a recombination inside the window) or not exactly one paternal and one maternal row are left out
+// for that F2, as the SQL does. For every window the F2 are bucketed by class and sex, and each
+// bucket sums its rows of the matrix: the sums and counts of all traits of a bucket are one
+// contiguous loop that the compiler vectorizes. Windows are reduced in parallel and written in
+// chromosome and window order.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <zlib.h>
+#include "text_input.h"
+
+using namespace std;
+
+#define NCLASSES 4            // paternal*2 + maternal inheritance
+#define NSEXES 2              // f2 % 2: 1 male, 0 female
+#define NBUCKETS (NCLASSES*NSEXES)
+#define TRAIT_PAD 8
+
+// Value sums and row counts of every F2 and trait; an F2 without a value has count 0
+struct TraitMatrix
+{
+    vector<string> f2ids,traitids;
+    unordered_map<string,int> f2index;
+    vector<int> sex;
+    size_t ntraits,stride;
+    vector<double> sum,count;          // f2 * stride + trait
+    vector<double> mean[NSEXES];       // mean of each trait over the F2 of a sex
+    vector<bool> hasmean[NSEXES];
+};
+
+// Genotype codes of the F2 in the windows of one chromosome, window * nf2 + f2. A code holds the
+// number of paternal and maternal rows (2 bits each) and their inheritances
+struct ChromWindows
+{
+    string chr;
+    long nwindows;
+    vector<uint8_t> codes;
+};
+
+#define CODE_PCOUNT(c) ((c) & 3)
+#define CODE_MCOUNT(c) (((c)>>2) & 3)
+#define CODE_PINH(c) (((c)>>4) & 1)
+#define CODE_MINH(c) (((c)>>5) & 1)
+
+struct BucketSums
+{
+    vector<double> sum,count;          // bucket * stride + trait
+};
+
+// Comma-separated fields without their double quotes
+void SplitCsv(const string &line, vector<string> &fields)
+{
+    string field;
+    bool quoted = false;
+
+    fields.clear();
+    for(char c : line)
+    {
+        if(c=='"')
+            quoted = !quoted;
+        else if(c==',' && !quoted)
+        {
+            fields.push_back(field);
+            field.clear();
+        }
+        else if(c!='\r')
+            field += c;
+    }
+    fields.push_back(field);
+}
+
+int SexOfF2(const string &f2)
+{
+    return atol(f2.c_str())%2!=0 ? 1 : 0;
+}
+
+// The long-format trait file with the columns f2, trait_id and trait_value. A duplicated F2 and trait
+// counts twice, as in the SQL join
+bool LoadTraits(const string &filename, TraitMatrix &traits, string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    vector<string> fields;
+    vector<int> f2col,traitcol;
+    vector<double> values;
+    unordered_map<string,int> traitindex;
+    string line;
+    int col[3] = {-1,-1,-1};
+    size_t i;
+
+    if(fp==NULL || !ReadGzLine(fp, line))
+    {
+        if(fp)
+            gzclose(fp);
+        error = "could not read " + filename;
+        return false;
+    }
+    SplitCsv(line, fields);
+    for(i=0; i<fields.size(); i++)
+    {
+        if(fields[i]=="f2")
+            col[0] = i;
+        else if(fields[i]=="trait_id")
+            col[1] = i;
+        else if(fields[i]=="trait_value")
+            col[2] = i;
+    }
+    if(col[0]<0 || col[1]<0 || col[2]<0)
+    {
+        gzclose(fp);
+        error = filename + " needs the columns f2, trait_id and trait_value";
+        return false;
+    }
+    while(ReadGzLine(fp, line))
+    {
+        SplitCsv(line, fields);
+        if(fields.size()<=max(col[0], max(col[1], col[2])) || fields[col[2]]=="" || fields[col[2]]=="NA")
+            continue;
+        auto f2 = traits.f2index.emplace(fields[col[0]], traits.f2ids.size());
+        if(f2.second)
+            traits.f2ids.push_back(fields[col[0]]);
+        auto trait = traitindex.emplace(fields[col[1]], traits.traitids.size());
+        if(trait.second)
+            traits.traitids.push_back(fields[col[1]]);
+        f2col.push_back(f2.first->second);
+        traitcol.push_back(trait.first->second);
+        values.push_back(atof(fields[col[2]].c_str()));
+    }
+    gzclose(fp);
+
+    // Traits in id order
+    vector<int> order(traits.traitids.size()),rank(traits.traitids.size());
+    for(i=0; i<order.size(); i++)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&](int a, int b) { return IdLess(traits.traitids[a], traits.traitids[b]); });
+    vector<string> sorted;
+    for(i=0; i<order.size(); i++)
+    {
+        rank[order[i]] = i;
+        sorted.push_back(traits.traitids[order[i]]);
+    }
+    traits.traitids.swap(sorted);
+
+    traits.ntraits = traits.traitids.size();
+    traits.stride = (traits.ntraits+TRAIT_PAD-1)/TRAIT_PAD*TRAIT_PAD;
+    traits.sum.assign(traits.f2ids.size()*traits.stride, 0);
+    traits.count.assign(traits.f2ids.size()*traits.stride, 0);
+    for(i=0; i<values.size(); i++)
+    {
+        traits.sum[f2col[i]*traits.stride+rank[traitcol[i]]] += values[i];
+        traits.count[f2col[i]*traits.stride+rank[traitcol[i]]] += 1;
+    }
+    for(const string &f2 : traits.f2ids)
+        traits.sex.push_back(SexOfF2(f2));
+
+    // f2_trait_name_trait_value_copy1_mean: the mean of each trait over the F2 of each sex
+    for(int s=0; s<NSEXES; s++)
+    {
+        vector<double> sum(traits.ntraits, 0),count(traits.ntraits, 0);
+        for(size_t f=0; f<traits.f2ids.size(); f++)
+            if(traits.sex[f]==s)
+                for(size_t t=0; t<traits.ntraits; t++)
+                {
+                    sum[t] += traits.sum[f*traits.stride+t];
+                    count[t] += traits.count[f*traits.stride+t];
+                }
+        traits.mean[s].assign(traits.ntraits, 0);
+        traits.hasmean[s].assign(traits.ntraits, false);
+        for(size_t t=0; t<traits.ntraits; t++)
+            if(count[t]>0)
+            {
+                traits.mean[s][t] = sum[t]/count[t];
+                traits.hasmean[s][t] = true;
+            }
+    }
+    return true;
+}
+
+// The window table 'f2 chromosome window inheritance origin'; rows of F2 without traits are skipped
+bool LoadWindows(const string &filename, const TraitMatrix &traits, vector<ChromWindows> &chroms, string &error)
+{
+    gzFile fp = gzopen(filename.c_str(), "r");
+    unordered_map<string,int> chromindex;
+    vector<string> fields;
+    string line;
+    size_t nf2 = traits.f2ids.size(),lineno;
+    long window;
+    uint8_t *code;
+    int inheritance,shift;
+
+    if(fp==NULL)
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    lineno = 0;
+    while(ReadGzLine(fp, line))
+    {
+        lineno++;
+        SplitFields(line, fields);
+        if(fields.empty())
+            continue;
+        if(fields.size()!=5 || (fields[4]!="P" && fields[4]!="M"))
+        {
+            gzclose(fp);
+            error = filename + " line " + to_string(lineno) + ": expected 'f2 chromosome window inheritance P|M'";
+            return false;
+        }
+        auto f2 = traits.f2index.find(fields[0]);
+        if(f2==traits.f2index.end())
+            continue;
+        auto chrom = chromindex.emplace(fields[1], chroms.size());
+        if(chrom.second)
+            chroms.push_back(ChromWindows{fields[1], 0, vector<uint8_t>()});
+        ChromWindows &windows = chroms[chrom.first->second];
+        window = atol(fields[2].c_str());
+        inheritance = atoi(fields[3].c_str()) & 1;
+        if(window<0)
+            continue;
+        if(window>=windows.nwindows)
+        {
+            windows.nwindows = window+1;
+            windows.codes.resize(windows.nwindows*nf2, 0);
+        }
+        code = &windows.codes[window*nf2+f2->second];
+        shift = fields[4]=="P" ? 0 : 2;
+        if(((*code>>shift) & 3)<3)
+            *code += 1<<shift;
+        *code |= inheritance<<(4+shift/2);
+    }
+    gzclose(fp);
+    sort(chroms.begin(), chroms.end(), [](const ChromWindows &a, const ChromWindows &b) { return IdLess(a.chr, b.chr); });
+    return true;
+}
+
+// The bucket (class*2 + sex) of an F2 in a window, -1 when the window is left out for it
+inline int WindowBucket(uint8_t code, int sex)
+{
+    if(CODE_PCOUNT(code)!=1 || CODE_MCOUNT(code)!=1)
+        return -1;
+    return (CODE_PINH(code)*2+CODE_MINH(code))*NSEXES+sex;
+}
+
+// Segmented reduction of one window: the F2 are bucketed by class and sex, and the matrix rows
+// of each bucket are summed
+void ReduceWindow(const TraitMatrix &traits, const uint8_t *codes, vector<int> &members, BucketSums &sums)
+{
+    size_t nf2 = traits.f2ids.size(),stride = traits.stride;
+    int start[NBUCKETS+1],fill[NBUCKETS];
+    int b,f;
+
+    memset(start, 0, sizeof(start));
+    for(f=0; f<nf2; f++)
+        if((b = WindowBucket(codes[f], traits.sex[f]))>=0)
+            start[b+1]++;
+    for(b=0; b<NBUCKETS; b++)
+    {
+        start[b+1] += start[b];
+        fill[b] = start[b];
+    }
+    members.resize(start[NBUCKETS]);
+    for(f=0; f<nf2; f++)
+        if((b = WindowBucket(codes[f], traits.sex[f]))>=0)
+            members[fill[b]++] = f;
+
+    sums.sum.assign(NBUCKETS*stride, 0);
+    sums.count.assign(NBUCKETS*stride, 0);
+    for(b=0; b<NBUCKETS; b++)
+    {
+        double *sum = &sums.sum[b*stride],*count = &sums.count[b*stride];
+        for(int k=start[b]; k<start[b+1]; k++)
+        {
+            const double *rowsum = &traits.sum[members[k]*stride],*rowcount = &traits.count[members[k]*stride];
+            for(size_t t=0; t<stride; t++)
+            {
+                sum[t] += rowsum[t];
+                count[t] += rowcount[t];
+            }
+        }
+    }
+}
+
+// Appends a double as %.10g, or \N (NULL) when it is not finite; to_chars is several times faster
+// than snprintf on the tens of millions of values of a genome
+void AppendValue(string &out, double value)
+{
+    char buffer[32];
+    if(!isfinite(value))
+        out += "\\N";
+    else
+        out.append(buffer, to_chars(buffer, buffer+sizeof(buffer), value, chars_format::general, 10).ptr);
+}
+
+// Statistics of one class: counts and mean trait of each sex, NaN for a sex without values
+struct ClassStat
+{
+    long count[NSEXES];
+    double trait[NSEXES];
+};
+
+// Rows of both tables for one window
+void FormatWindow(const TraitMatrix &traits, const string &chr, long window, const BucketSums &sums, bool autosome, string *stat, string &deviation)
+{
+    ClassStat cls[NCLASSES];
+    char prefix[96];
+    size_t t;
+    int a,b,s,diff;
+
+    for(t=0; t<traits.ntraits; t++)
+    {
+        for(a=0; a<NCLASSES; a++)
+            for(s=0; s<NSEXES; s++)
+            {
+                double count = sums.count[(a*NSEXES+s)*traits.stride+t];
+                cls[a].count[s] = (long)count;
+                cls[a].trait[s] = count>0 ? sums.sum[(a*NSEXES+s)*traits.stride+t]/count : NAN;
+            }
+        // A class is a row of window100k_single_site_trait_stat when some F2 of it has the trait
+        if(stat)
+            for(a=0; a<NCLASSES; a++)
+                if(cls[a].count[0]+cls[a].count[1]>0)
+                {
+                    snprintf(prefix, sizeof(prefix), "%s\t%s\t%ld\t%d\t%d\t%ld\t%ld\t", traits.traitids[t].c_str(), chr.c_str(), window, a/2, a%2, cls[a].count[1], cls[a].count[0]);
+                    *stat += prefix;
+                    AppendValue(*stat, cls[a].trait[1]);
+                    *stat += '\t';
+                    AppendValue(*stat, cls[a].trait[0]);
+                    *stat += '\n';
+                }
+        if(!autosome || !traits.hasmean[1][t] || !traits.hasmean[0][t])
+            continue;
+        // Pairs of classes that differ by one LW allele
+        double malemean = traits.mean[1][t],femalemean = traits.mean[0][t];
+        for(a=0; a<NCLASSES; a++)
+            for(b=0; b<NCLASSES; b++)
+            {
+                diff = (a/2+a%2)-(b/2+b%2);
+                if(diff!=1 && diff!=-1)
+                    continue;
+                if(cls[a].count[0]+cls[a].count[1]==0 || cls[b].count[0]+cls[b].count[1]==0)
+                    continue;
+                snprintf(prefix, sizeof(prefix), "%s\t%s\t%ld\t%d\t%d\t%ld\t%ld\t", traits.traitids[t].c_str(), chr.c_str(), window, a/2, a%2, cls[a].count[1], cls[a].count[0]);
+                deviation += prefix;
+                AppendValue(deviation, cls[a].trait[1]);
+                deviation += '\t';
+                AppendValue(deviation, cls[a].trait[0]);
+                snprintf(prefix, sizeof(prefix), "\t%d\t%d\t%ld\t%ld\t", b/2, b%2, cls[b].count[1]-cls[a].count[1], cls[b].count[0]-cls[a].count[0]);
+                deviation += prefix;
+                AppendValue(deviation, cls[b].trait[1]-cls[a].trait[1]);
+                deviation += '\t';
+                AppendValue(deviation, cls[b].trait[0]-cls[a].trait[0]);
+                deviation += '\t';
+                AppendValue(deviation, (cls[a].trait[1]-malemean)/malemean);
+                deviation += '\t';
+                AppendValue(deviation, (cls[a].trait[0]-femalemean)/femalemean);
+                deviation += '\t';
+                AppendValue(deviation, (cls[b].trait[1]-malemean)/malemean);
+                deviation += '\t';
+                AppendValue(deviation, (cls[b].trait[0]-femalemean)/femalemean);
+                deviation += '\n';
+            }
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    TraitMatrix traits;
+    vector<ChromWindows> chroms;
+    vector<string> args;
+    string statfile,error;
+    int threads,maxchr;
+    int i;
+
+    threads = 1;
+    maxchr = 23;
+    for(i=1; i<argc; i++)
+    {
+        string opt = argv[i];
+        if(opt=="--threads" && i+1<argc)
+            threads = atoi(argv[++i]);
+        else if(opt=="--stat" && i+1<argc)
+            statfile = argv[++i];
+        else if(opt=="--max-chr" && i+1<argc)
+            maxchr = atoi(argv[++i]);
+        else
+            args.push_back(opt);
+    }
+    if(args.size()!=3 || threads<1)
+    {
+        cout << "Usage: " << argv[0] << " f2_trait_name_trait_value.csv f2fragmentinheritance_window100k.txt deviation.tsv [--threads N]\n";
+        cout << "       [--stat window100k_single_site_trait_stat.tsv] [--max-chr 23]\n";
+        cout << "  For every window, trait and paternal/maternal class, counts the male (odd id) and female F2 with a\n";
+        cout << "  value and their mean trait. deviation.tsv gets the pairs of classes that differ by one allele with the\n";
+        cout << "  differences of the counts and means and the deviations of both means from the mean of the sex\n";
+        cout << "  (window100k_single_site_trait_stat_mutant_deviation_from_mean); NULL is written as \\N.\n";
+        cout << "  An F2 is left out of a window with a recombination breakpoint in it.\n";
+        cout << "  --threads N   reduce N windows at once\n";
+        cout << "  --stat F      also write the per-class statistics (window100k_single_site_trait_stat) to F\n";
+        cout << "  --max-chr C   deviation.tsv only has the chromosomes below C (default 23, the autosomes)\n";
+        return 0;
+    }
+    if(!LoadTraits(args[0], traits, error) || !LoadWindows(args[1], traits, chroms, error))
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    ofstream deviation(args[2].c_str()),stat;
+    if(!deviation)
+    {
+        cerr << "Error: could not write " << args[2] << endl;
+        return 1;
+    }
+    deviation << "trait_id\tchr\twindow\tpaternalinheritance\tmaternalinheritance\tmalecount\tfemalecount\tmaletrait\tfemaletrait\t"
+                 "paternalinheritance_mutant\tmaternalinheritance_mutant\tmalecount_diff\tfemalecount_diff\tmaletrait_diff\tfemaletrait_diff\t"
+                 "maledev\tfemaledev\tmalemutantdev\tfemalemutantdev\n";
+    if(statfile!="")
+    {
+        stat.open(statfile.c_str());
+        if(!stat)
+        {
+            cerr << "Error: could not write " << statfile << endl;
+            return 1;
+        }
+        stat << "trait_id\tchr\twindow\tpaternalinheritance\tmaternalinheritance\tmalecount\tfemalecount\tmaletrait\tfemaletrait\n";
+    }
+    cerr << traits.f2ids.size() << " F2, " << traits.ntraits << " traits, " << chroms.size() << " chromosomes" << endl;
+
+    // A batch of windows is reduced on the threads and written before the next one
+    size_t nf2 = traits.f2ids.size(),batch = 64*threads;
+    for(const ChromWindows &windows : chroms)
+    {
+        char *end;
+        long chrnum = strtol(windows.chr.c_str(), &end, 10);
+        bool autosome = *end==0 && chrnum<maxchr;
+        for(long first=0; first<windows.nwindows; first+=batch)
+        {
+            long count = min<long>(batch, windows.nwindows-first);
+            vector<string> stattext(count),deviationtext(count);
+            atomic<long> next(0);
+            vector<thread> workers;
+            for(i=0; i<threads; i++)
+                workers.emplace_back([&]()
+                {
+                    BucketSums sums;
+                    vector<int> members;
+                    long w;
+                    while((w = next++) < count)
+                    {
+                        ReduceWindow(traits, &windows.codes[(first+w)*nf2], members, sums);
+                        FormatWindow(traits, windows.chr, first+w, sums, autosome, stat.is_open() ? &stattext[w] : NULL, deviationtext[w]);
+                    }
+                });
+            for(auto &worker : workers)
+                worker.join();
+            for(long w=0; w<count; w++)
+            {
+                deviation << deviationtext[w];
+                if(stat.is_open())
+                    stat << stattext[w];
+            }
+        }
+    }
+    deviation.close();
+    if(stat.is_open())
+        stat.close();
+    if(!deviation || stat.fail())
+    {
+        cerr << "Error: could not write the outputs" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -6,9 +6,40 @@
 #include <algorithm>
 #include <iterator>
 #include <sstream>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <sys/resource.h>
+#endif
+#include <htslib/hts.h>
+#include <htslib/vcf.h>
+#include <htslib/kseq.h>
+#include <htslib/tbx.h>
+#include <htslib/sam.h>
+#include "window_columns.h"
+#include "position_mask.h"
+#include "run_metrics.h"
 
 using namespace std;
 
+// Stages of --progress/--metrics: reading and decoding the input (BGZF decompression, VCF lines,
+// BCF records, pileup columns), genotyping and counting the sites into the windows, printing or
+// storing the finished windows, and the resampling tests
+enum MetricsStage { STAGE_READ, STAGE_GENOTYPE, STAGE_FLUSH, STAGE_TEST };
+const vector<string> METRICS_STAGES = {"read", "genotype", "flush", "test"};
+
 using std::ios;
 using std::cout;
 using std::endl;
@@ -56,6 +87,41 @@ void SplitString(const string& str, const string& delimiters, vector<string> &el
         elems.emplace_back(str, prev, str.size() - prev);
 }
 
+// SplitString without copying: the views point into str, which must outlive them.
+// Empty fields are skipped as in SplitString, so column numbers agree with the header.
+void SplitStringView(string_view str, char delimiter, vector<string_view> &elems)
+{
+    const char *p = str.data();
+    const char *end = p + str.size();
+    elems.clear();
+    while(p < end)
+    {
+        const char *next = static_cast<const char*>(memchr(p, delimiter, end - p));
+        if(next == NULL)
+            next = end;
+        if(next > p)
+            elems.emplace_back(p, next - p);
+        p = next + 1;
+    }
+}
+
+// Position of key in a FORMAT column such as GT:AD:DP:GQ:PL, or -1
+int FindFormatKey(string_view format, string_view key)
+{
+    int index = 0;
+    string::size_type prev = 0, pos;
+    while(true)
+    {
+        pos = format.find(':', prev);
+        if(format.substr(prev, pos == string_view::npos ? string_view::npos : pos - prev) == key)
+            return index;
+        if(pos == string_view::npos)
+            return -1;
+        prev = pos + 1;
+        index++;
+    }
+}
+
 vector<string> LoadFileLinesIntoVector(string filename)
 {
     ifstream infile;
@@ -100,230 +166,2117 @@ vector<int> FindSamplesInVCFHeader(string header, vector<string> sampleid)
     return(retpos);
 }
 
-vector<int> GetSampleGenotypeCodeWithDepth(vector<string> genotype,vector<int> samplepos,int mindepth,int maxdepth)
+// Genotype code of one sample field: 0 (0/0), 1 (0/1 or 1/0), 2 (1/1), -1 for other genotypes,
+// or -2 when DP (the dpindex-th subfield, missing counts as 0) is outside [mindepth, maxdepth]
+int GetSampleGenotypeCodeWithDepth(string_view field, int dpindex, int mindepth, int maxdepth)
 {
     int i;
-    vector<int> retval;
-    vector<string> fieldinfo;
-    char base1,base2;
     int depth;
+    char base1,base2;
+    string::size_type pos;
+
+    depth = 0;
+    pos = 0;
+    for(i=0; i<dpindex && pos!=string_view::npos; i++)
+    {
+        pos = field.find(':', pos);
+        if(pos!=string_view::npos)
+            pos++;
+    }
+    if(dpindex>=0 && pos!=string_view::npos)
+        depth = atoi(field.data() + pos);
+    if( depth<mindepth || depth>maxdepth )
+        return -2;
+    base1 = field.size() > 0 ? field[0] : 0;
+    base2 = field.size() > 2 ? field[2] : 0;
+    if( base1 =='0'&& base2 =='0')
+        return 0;
+    if( base1=='1' && base2=='1')
+        return 2;
+    if((base1=='0'&& base2=='1')||(base1=='1'&& base2=='0'))
+        return 1;
+    return -1;
+}
+
+// Genotypes of one population at one site, packed 64 samples per word into three bit planes:
+// pass marks samples whose depth is within [mindepth, maxdepth], and hi:lo is the 2-bit genotype
+// code (00 hom-ref, 01 het, 10 hom-alt, 11 other or missing)
+struct PackedGenotypes
+{
+    vector<uint64_t> lo, hi, pass;
+};
+
+void ResetPackedGenotypes(PackedGenotypes &packed, int samplesize)
+{
+    int nwords = (samplesize + 63) / 64;
+    packed.lo.assign(nwords, 0);
+    packed.hi.assign(nwords, 0);
+    packed.pass.assign(nwords, 0);
+}
+
+// code as returned by GetSampleGenotypeCodeWithDepth; -2 leaves the sample out of the pass mask
+inline void SetPackedGenotype(PackedGenotypes &packed, int i, int code)
+{
+    uint64_t bit = uint64_t(1) << (i & 63);
+    if(code == -2)
+        return;
+    if(code < 0)
+        code = 3;
+    packed.pass[i >> 6] |= bit;
+    if(code & 1)
+        packed.lo[i >> 6] |= bit;
+    if(code & 2)
+        packed.hi[i >> 6] |= bit;
+}
+
+// count[0..3]: depth-passing samples that are hom-ref, het, hom-alt, and other or missing
+typedef void (*CountPackedFunction)(const uint64_t *lo, const uint64_t *hi, const uint64_t *pass, size_t nwords, int *count);
+
+void CountPackedGenotypesScalar(const uint64_t *lo, const uint64_t *hi, const uint64_t *pass, size_t nwords, int *count)
+{
+    size_t w;
+    for(w=0; w<nwords; w++)
+    {
+        count[0] += __builtin_popcountll(pass[w] & ~lo[w] & ~hi[w]);
+        count[1] += __builtin_popcountll(pass[w] & lo[w] & ~hi[w]);
+        count[2] += __builtin_popcountll(pass[w] & ~lo[w] & hi[w]);
+        count[3] += __builtin_popcountll(pass[w] & lo[w] & hi[w]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same loop compiled for the POPCNT instruction
+__attribute__((target("popcnt")))
+void CountPackedGenotypesPopcnt(const uint64_t *lo, const uint64_t *hi, const uint64_t *pass, size_t nwords, int *count)
+{
+    size_t w;
+    for(w=0; w<nwords; w++)
+    {
+        count[0] += __builtin_popcountll(pass[w] & ~lo[w] & ~hi[w]);
+        count[1] += __builtin_popcountll(pass[w] & lo[w] & ~hi[w]);
+        count[2] += __builtin_popcountll(pass[w] & ~lo[w] & hi[w]);
+        count[3] += __builtin_popcountll(pass[w] & lo[w] & hi[w]);
+    }
+}
+
+// Bytewise popcount of a 256-bit vector by nibble table lookup, summed into four 64-bit lanes
+__attribute__((target("avx2")))
+inline __m256i PopcountAvx2(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble)),
+                                    _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2,popcnt")))
+void CountPackedGenotypesAvx2(const uint64_t *lo, const uint64_t *hi, const uint64_t *pass, size_t nwords, int *count)
+{
+    __m256i sum[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+    uint64_t lanes[4];
+    size_t w;
+    int k;
+    for(w=0; w+4<=nwords; w+=4)
+    {
+        __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lo + w));
+        __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hi + w));
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pass + w));
+        __m256i notl = _mm256_andnot_si256(l, p);
+        __m256i withl = _mm256_and_si256(l, p);
+        sum[0] = _mm256_add_epi64(sum[0], PopcountAvx2(_mm256_andnot_si256(h, notl)));
+        sum[1] = _mm256_add_epi64(sum[1], PopcountAvx2(_mm256_andnot_si256(h, withl)));
+        sum[2] = _mm256_add_epi64(sum[2], PopcountAvx2(_mm256_and_si256(h, notl)));
+        sum[3] = _mm256_add_epi64(sum[3], PopcountAvx2(_mm256_and_si256(h, withl)));
+    }
+    for(k=0; k<4; k++)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sum[k]);
+        count[k] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    CountPackedGenotypesPopcnt(lo + w, hi + w, pass + w, nwords - w, count);
+}
+#endif
+
+// Picks the widest kernel the CPU supports, once
+CountPackedFunction SelectCountPackedFunction()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return CountPackedGenotypesAvx2;
+    if(__builtin_cpu_supports("popcnt"))
+        return CountPackedGenotypesPopcnt;
+#endif
+    return CountPackedGenotypesScalar;
+}
+
+const CountPackedFunction CountPackedGenotypes = SelectCountPackedFunction();
+
+void CountPackedSampleGenotype(const PackedGenotypes &packed, vector<int> &count)
+{
+    count.assign(4, 0);
+    CountPackedGenotypes(packed.lo.data(), packed.hi.data(), packed.pass.data(), packed.pass.size(), count.data());
+}
+
+// Counts of genotype codes 0, 1 and 2 (and 3 for other genotypes) among the samples of one
+// population, through the packed representation; samples missing from the VCF header (column -1) are ignored
+void CountSampleGenotype(const vector<string_view> &columns,const vector<int> &samplepos,int dpindex,int mindepth,int maxdepth,PackedGenotypes &packed,vector<int> &count)
+{
+    int i;
     int samplesize;
     samplesize = samplepos.size();
 
+    ResetPackedGenotypes(packed, samplesize);
     for(i=0;i<samplesize;i++)
     {
-        fieldinfo.clear();
-        SplitString(genotype[samplepos[i]],":",fieldinfo,false);
-        depth = atoi(fieldinfo[2].c_str());
-        if( depth<mindepth || depth>maxdepth )
-            continue;
-        base1 = genotype[samplepos[i]].c_str()[0];
-        base2 = genotype[samplepos[i]].c_str()[2];
-        if( base1 =='0'&& base2 =='0')
+      if(samplepos[i]<0 || samplepos[i]>=columns.size())
+        continue;
+      SetPackedGenotype(packed, i, GetSampleGenotypeCodeWithDepth(columns[samplepos[i]],dpindex,mindepth,maxdepth));
+    }
+    CountPackedSampleGenotype(packed, count);
+}
+
+float CountMiorAlleleFreq(const vector<int> &count1, const vector<int> &count2)
+{
+    float allsize;
+    float allelecount;
+    float allelefreq;
+    allsize = 2.0*(count1[0]+count1[1]+count1[2]+count2[0]+count2[1]+count2[2]);
+    allelecount = count1[1]+2*count1[2]+count2[1]+2*count2[2];
+    allelefreq = allelecount/allsize;
+    if(allelefreq>0.5)
+        allelefreq = 1.0 - allelefreq;
+    return(allelefreq);
+}
+
+// Chromosome last looked up in the --exclude mask (position_mask.h); one per scanning thread
+struct ExcludedCursor
+{
+    string chr;
+    const PositionMaskChrom *current = NULL;
+};
+
+// pos is 1-based, as in the VCF
+bool IsExcludedSite(const PositionMask &excluded, ExcludedCursor &cursor, string_view chr, long pos)
+{
+    if(excluded.chroms.empty())
+        return false;
+    if(chr != cursor.chr)
+    {
+        cursor.chr = chr;
+        cursor.current = FindMaskChrom(excluded, cursor.chr);
+    }
+    return cursor.current != NULL && IsMaskedPosition(*cursor.current, pos-1);
+}
+
+// Two alleles, as for vcftools --min-alleles 2 --max-alleles 2
+bool IsBiallelic(string_view alt)
+{
+    return alt != "." && alt.find(',') == string_view::npos;
+}
+
+// Genotype code of one BCF sample from its GT and DP values, with the same rules as the text parser
+int GetBcfGenotypeCodeWithDepth(const int32_t *gt, int ploidy, const int32_t *dp, int mindepth, int maxdepth)
+{
+    int depth;
+    int allele1,allele2;
+
+    depth = 0;
+    if(dp != NULL && dp[0] != bcf_int32_missing && dp[0] != bcf_int32_vector_end)
+        depth = dp[0];
+    if( depth<mindepth || depth>maxdepth )
+        return -2;
+    if(ploidy<2 || gt[0]==bcf_int32_vector_end || gt[1]==bcf_int32_vector_end || bcf_gt_is_missing(gt[0]) || bcf_gt_is_missing(gt[1]))
+        return -1;
+    allele1 = bcf_gt_allele(gt[0]);
+    allele2 = bcf_gt_allele(gt[1]);
+    if(allele1==0 && allele2==0)
+        return 0;
+    if(allele1==1 && allele2==1)
+        return 2;
+    if((allele1==0 && allele2==1)||(allele1==1 && allele2==0))
+        return 1;
+    return -1;
+}
+
+// samplepos are VCF column numbers; sample i of the BCF record is column i+9
+void CountBcfSampleGenotype(const int32_t *gt,int ploidy,const int32_t *dp,int ndp,const vector<int> &samplepos,int nsamples,int mindepth,int maxdepth,PackedGenotypes &packed,vector<int> &count)
+{
+    int i;
+    int sample;
+
+    ResetPackedGenotypes(packed, samplepos.size());
+    for(i=0;i<samplepos.size();i++)
+    {
+      sample = samplepos[i] - 9;
+      if(sample<0 || sample>=nsamples)
+        continue;
+      SetPackedGenotype(packed, i, GetBcfGenotypeCodeWithDepth(gt + sample*ploidy, ploidy, ndp>0 ? dp + sample*ndp : NULL, mindepth, maxdepth));
+    }
+    CountPackedSampleGenotype(packed, count);
+}
+
+// MAF bins [edges[i], edges[i+1]); the last bin also takes its upper edge. width is set when
+// the bins are of equal width, so the default bins are found exactly as allelefreq/0.05
+struct MafBins
+{
+    vector<double> edges;
+    double width;
+};
+
+bool ParseMafBins(const string &text, MafBins &bins)
+{
+    vector<string> cols;
+    size_t i;
+    int nbins;
+
+    bins.edges.clear();
+    SplitString(text, ",", cols, false);
+    for(i=0; i<cols.size(); i++)
+    {
+        bins.edges.push_back(atof(cols[i].c_str()));
+        if(i>0 && bins.edges[i]<=bins.edges[i-1])
+            return false;
+    }
+    if(bins.edges.size()<2)
+        return false;
+    nbins = bins.edges.size()-1;
+    bins.width = (bins.edges.back()-bins.edges[0])/nbins;
+    for(i=0; i<bins.edges.size(); i++)
+        if(fabs(bins.edges[i]-(bins.edges[0]+i*bins.width))>1e-9)
+            bins.width = 0;
+    return true;
+}
+
+// Bin of a minor allele frequency, -1 when it is outside the edges
+int FindMafBin(const MafBins &bins, float allelefreq)
+{
+    int nbins = bins.edges.size()-1;
+    int DAFid;
+
+    if(allelefreq<bins.edges[0] || allelefreq>bins.edges.back())
+        return -1;
+    if(bins.width>0)
+        DAFid = static_cast<int>((allelefreq-bins.edges[0])/bins.width);
+    else
+        DAFid = upper_bound(bins.edges.begin(), bins.edges.end(), (double)allelefreq) - bins.edges.begin() - 1;
+    if(DAFid>=nbins) DAFid = nbins-1;
+    return DAFid;
+}
+
+// Per-window counts for each MAF bin
+struct WindowStat
+{
+    vector<int> snps;
+    vector<int> homogenotypecount1,hetgenotypecount1;
+    vector<int> homogenotypecount2,hetgenotypecount2;
+};
+
+void ResetWindow(WindowStat &stat, int nbins)
+{
+    stat.snps.assign(nbins, 0);
+    stat.homogenotypecount1.assign(nbins, 0);
+    stat.hetgenotypecount1.assign(nbins, 0);
+    stat.homogenotypecount2.assign(nbins, 0);
+    stat.hetgenotypecount2.assign(nbins, 0);
+}
+
+// Adds (sign 1) or removes (sign -1) the counts of src
+void AddWindow(WindowStat &stat, const WindowStat &src, int sign)
+{
+    int i;
+    for(i=0; i<stat.snps.size(); i++)
+    {
+        stat.snps[i] += sign*src.snps[i];
+        stat.homogenotypecount1[i] += sign*src.homogenotypecount1[i];
+        stat.hetgenotypecount1[i] += sign*src.hetgenotypecount1[i];
+        stat.homogenotypecount2[i] += sign*src.homogenotypecount2[i];
+        stat.hetgenotypecount2[i] += sign*src.hetgenotypecount2[i];
+    }
+}
+
+// Weir & Cockerham (1984) variance components of one site for a pair of populations, computed
+// from the genotype counts as vcftools --weir-fst-pop does; false when FST is undefined there
+bool WeirCockerhamComponents(const vector<int> &count1, const vector<int> &count2, double &a, double &abc)
+{
+    const vector<int> *counts[2] = {&count1, &count2};
+    double n[2],p[2],h[2];
+    double r,nsum,nbar,nc,pbar,ssqr,hbar,b,c;
+    int i;
+
+    r = 2;
+    for(i=0; i<2; i++)
+    {
+        const vector<int> &count = *counts[i];
+        n[i] = count[0]+count[1]+count[2];
+        if(n[i]==0)
+            return false;
+        p[i] = (count[1]+2.0*count[2])/(2*n[i]);
+        h[i] = count[1]/n[i];
+    }
+    nsum = n[0]+n[1];
+    nbar = nsum/r;
+    if(nbar<=1)
+        return false;
+    nc = (nsum-(n[0]*n[0]+n[1]*n[1])/nsum)/(r-1);
+    pbar = (n[0]*p[0]+n[1]*p[1])/nsum;
+    ssqr = (n[0]*(p[0]-pbar)*(p[0]-pbar)+n[1]*(p[1]-pbar)*(p[1]-pbar))/((r-1)*nbar);
+    hbar = (n[0]*h[0]+n[1]*h[1])/nsum;
+    a = nbar/nc*(ssqr-(pbar*(1-pbar)-(r-1)/r*ssqr-hbar/4)/(nbar-1));
+    b = nbar/(nbar-1)*(pbar*(1-pbar)-(r-1)/r*ssqr-(2*nbar-1)/(4*nbar)*hbar);
+    c = hbar/2;
+    abc = a+b+c;
+    return abc!=0 && isfinite(a) && isfinite(abc);
+}
+
+// FST sums of one population pair: weighted FST is a/abc, mean FST is fst/sites
+struct FstStat
+{
+    double a,abc,fst;
+    int sites;
+};
+
+// Window layout: windows of size bp starting every step bp; size is a multiple of step
+struct WindowSpec
+{
+    long size,step;
+};
+
+// Parses "SIZE[:STEP][,SIZE[:STEP]...]"; the step defaults to the size
+bool ParseWindowSpecs(const string &text, vector<WindowSpec> &specs)
+{
+    vector<string> layouts,fields;
+    WindowSpec spec;
+
+    specs.clear();
+    SplitString(text, ",", layouts, false);
+    for(const string &layout : layouts)
+    {
+        fields.clear();
+        SplitString(layout, ":", fields, false);
+        if(fields.size()<1 || fields.size()>2)
+            return false;
+        spec.size = atol(fields[0].c_str());
+        spec.step = fields.size()==2 ? atol(fields[1].c_str()) : spec.size;
+        if(spec.size<=0 || spec.step<=0 || spec.size%spec.step!=0)
+            return false;
+        specs.push_back(spec);
+    }
+    return !specs.empty();
+}
+
+// Printed windows of one layout on one chromosome, kept until the chromosome is written
+struct WindowRows
+{
+    WindowSpec spec;
+    string chr;
+    vector<long> start;
+    vector<WindowStat> stat;
+    vector<vector<uint32_t> > samples;      // per-sample counts for the resampling tests
+    vector<vector<float> > tests;
+};
+
+// Sliding windows of one layout on the current chromosome, kept as a ring of step-sized
+// blocks: sum holds the blocks block-nblocks+1..block, i.e. the window starting at block
+// block-nblocks+1. Moving to the next block prints that window, evicts its first block and
+// adds an empty one, so every site is added once and removed once whatever the overlap.
+// The FST sums are floating point and are added up from the blocks when a window is printed,
+// so a window does not depend on the rounding of earlier evictions
+struct WindowLayout
+{
+    WindowSpec spec;
+    long nblocks;
+    long block;
+    vector<WindowStat> blocks;
+    WindowStat sum;
+    vector<vector<FstStat> > fstblocks;
+    vector<vector<uint32_t> > sampleblocks;
+    vector<uint32_t> samplesum;
+    WindowRows rows;
+    ostringstream fstrows;
+};
+
+void InitLayout(WindowLayout &layout, const WindowSpec &spec, int nbins, int npairs, int nsamplecounts)
+{
+    long i;
+    layout.spec = spec;
+    layout.nblocks = spec.size/spec.step;
+    layout.block = -1;
+    layout.blocks.resize(layout.nblocks);
+    layout.fstblocks.assign(layout.nblocks, vector<FstStat>(npairs, FstStat{0, 0, 0, 0}));
+    layout.sampleblocks.assign(layout.nblocks, vector<uint32_t>(nsamplecounts, 0));
+    layout.samplesum.assign(nsamplecounts, 0);
+    for(i=0; i<layout.nblocks; i++)
+        ResetWindow(layout.blocks[i], nbins);
+    ResetWindow(layout.sum, nbins);
+    layout.rows = WindowRows{spec, "", {}, {}, {}, {}};
+    layout.fstrows.str("");
+}
+
+// Parses "I:J[,I:J...]", 1-based indices into the population list
+bool ParseFstPairs(const string &text, int npops, vector<pair<int,int> > &pairs)
+{
+    vector<string> items,fields;
+    int first,second;
+
+    pairs.clear();
+    SplitString(text, ",", items, false);
+    for(const string &item : items)
+    {
+        fields.clear();
+        SplitString(item, ":", fields, false);
+        if(fields.size()!=2)
+            return false;
+        first = atoi(fields[0].c_str());
+        second = atoi(fields[1].c_str());
+        if(first<1 || first>npops || second<1 || second>npops || first==second)
+            return false;
+        pairs.push_back(make_pair(first-1, second-1));
+    }
+    return !pairs.empty();
+}
+
+// Philox4x32-10 (Salmon et al., SC 2011): a counter-based generator, so the draws of a replicate
+// depend only on the seed and the replicate number, not on the thread that makes them
+void Philox4x32(const uint32_t counter[4], uint64_t seed, uint32_t out[4])
+{
+    uint32_t key0 = seed, key1 = seed >> 32;
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint64_t p0,p1;
+    int round;
+
+    for(round=0; round<10; round++)
+    {
+        p0 = (uint64_t)0xD2511F53 * c0;
+        p1 = (uint64_t)0xCD9E8D57 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ key0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ key1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        key0 += 0x9E3779B9;
+        key1 += 0xBB67AE85;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+// Uniform integer in [0,bound) for draw number draw of a replicate stream
+uint32_t RandomBelow(uint64_t seed, uint32_t stream, uint32_t replicate, uint32_t draw, uint32_t bound)
+{
+    uint32_t counter[4] = {replicate, draw, stream, 0};
+    uint32_t out[4];
+    Philox4x32(counter, seed, out);
+    return ((uint64_t)out[0] * bound) >> 32;
+}
+
+// Sex-label permutations and bootstrap resamples of the samples of populations 1 and 2. The
+// samples are pooled, population 1 first; a replicate lists the pooled samples that make up each
+// group (with repeats for the bootstrap). For permutations group 2 is the rest of the samples
+struct Replicates
+{
+    int permutations,bootstraps;
+    uint64_t seed;
+    int threads;
+    int pop1size,pop2size;
+    vector<vector<int> > group1,group2;
+};
+
+#define STREAM_PERMUTATION 1
+#define STREAM_BOOTSTRAP 2
+
+// Replicates 0..permutations-1 are permutations, the next bootstraps ones are bootstrap resamples
+void MakeReplicates(Replicates &replicates, int pop1size, int pop2size)
+{
+    vector<int> order;
+    int r,i,j;
+
+    replicates.pop1size = pop1size;
+    replicates.pop2size = pop2size;
+    replicates.group1.clear();
+    replicates.group2.clear();
+    for(r=0; r<replicates.permutations; r++)
+    {
+        // Fisher-Yates shuffle of the pooled samples; the first pop1size form group 1
+        order.resize(pop1size+pop2size);
+        for(i=0; i<order.size(); i++)
+            order[i] = i;
+        for(i=order.size()-1; i>0; i--)
+        {
+            j = RandomBelow(replicates.seed, STREAM_PERMUTATION, r, i, i+1);
+            swap(order[i], order[j]);
+        }
+        replicates.group1.push_back(vector<int>(order.begin(), order.begin()+pop1size));
+        replicates.group2.push_back(vector<int>());
+    }
+    for(r=0; r<replicates.bootstraps; r++)
+    {
+        vector<int> group1(pop1size),group2(pop2size);
+        for(i=0; i<pop1size; i++)
+            group1[i] = RandomBelow(replicates.seed, STREAM_BOOTSTRAP, r, i, pop1size);
+        for(i=0; i<pop2size; i++)
+            group2[i] = pop1size + RandomBelow(replicates.seed, STREAM_BOOTSTRAP, r, pop1size+i, pop2size);
+        replicates.group1.push_back(group1);
+        replicates.group2.push_back(group2);
+    }
+}
+
+// Settings shared by all scanning threads
+struct ScanOptions
+{
+    vector<WindowSpec> windows;
+    MafBins bins;
+    int mindepth,maxdepth;
+    bool biallelic;
+    vector<string> popnames;
+    vector<vector<int> > popcolumns;        // the first two are compared in the MAF-bin statistics
+    vector<pair<int,int> > fstpairs;
+    const Replicates *replicates;           // NULL without --permutations/--bootstrap
+    const PositionMask *excluded;
+};
+
+// Largest window size, i.e. how far past its last window start a chunk has to be read
+long MaxWindowSize(const ScanOptions &options)
+{
+    long size = 0;
+    for(const WindowSpec &spec : options.windows)
+        size = max(size, spec.size);
+    return size;
+}
+
+// Het and called (hom + het) counts of each pooled sample in each MAF bin of a window:
+// counts[(s*2)*nbins+b] is het, counts[(s*2+1)*nbins+b] is called
+void AddSampleCounts(vector<uint32_t> &sum, const vector<uint32_t> &counts, int sign)
+{
+    size_t i;
+    for(i=0; i<sum.size(); i++)
+        sum[i] += sign*counts[i];
+}
+
+// Empirical two-sided p-value of HetRatio1 - HetRatio2 from the permutations, and the
+// percentile bootstrap interval of the difference, per MAF bin: tests[3*b..3*b+2]
+#define BOOTSTRAP_CI_LEVEL 0.95
+
+void TestWindow(const vector<uint32_t> &counts, const Replicates &replicates, int nbins, vector<float> &tests)
+{
+    int nsamples = replicates.pop1size+replicates.pop2size;
+    int width = 2*nbins;
+    vector<uint64_t> total(width, 0),sum1(width),sum2(width);
+    vector<int> extreme(nbins, 0),valid(nbins, 0);
+    vector<vector<double> > diffs(nbins);
+    vector<double> observed(nbins);
+    double diff;
+    size_t r;
+    int s,b,k;
+
+    for(s=0; s<nsamples; s++)
+        for(k=0; k<width; k++)
+            total[k] += counts[s*width+k];
+    sum1.assign(width, 0);
+    for(s=0; s<replicates.pop1size; s++)
+        for(k=0; k<width; k++)
+            sum1[k] += counts[s*width+k];
+    for(b=0; b<nbins; b++)
+    {
+        sum2[b] = total[b]-sum1[b];
+        sum2[nbins+b] = total[nbins+b]-sum1[nbins+b];
+        observed[b] = sum1[nbins+b]>0 && sum2[nbins+b]>0 ? (double)sum1[b]/sum1[nbins+b]-(double)sum2[b]/sum2[nbins+b] : NAN;
+    }
+    for(r=0; r<replicates.group1.size(); r++)
+    {
+        bool permutation = (int)r<replicates.permutations;
+        sum1.assign(width, 0);
+        for(int sample : replicates.group1[r])
+            for(k=0; k<width; k++)
+                sum1[k] += counts[sample*width+k];
+        if(permutation)
+            for(k=0; k<width; k++)
+                sum2[k] = total[k]-sum1[k];
+        else
         {
-          retval.push_back(0);
-          continue;
+            sum2.assign(width, 0);
+            for(int sample : replicates.group2[r])
+                for(k=0; k<width; k++)
+                    sum2[k] += counts[sample*width+k];
         }
-        if( base1=='1' && base2=='1')
+        for(b=0; b<nbins; b++)
         {
-          retval.push_back(2);
-          continue;
+            if(sum1[nbins+b]==0 || sum2[nbins+b]==0)
+                continue;
+            diff = (double)sum1[b]/sum1[nbins+b]-(double)sum2[b]/sum2[nbins+b];
+            if(!permutation)
+                diffs[b].push_back(diff);
+            else if(!isnan(observed[b]))
+            {
+                valid[b]++;
+                if(fabs(diff)>=fabs(observed[b])-1e-12)
+                    extreme[b]++;
+            }
         }
-        if((base1=='0'&& base2=='1')||(base1=='1'&& base2=='0'))
+    }
+    tests.assign(3*nbins, NAN);
+    for(b=0; b<nbins; b++)
+    {
+        if(valid[b]>0)
+            tests[3*b] = (1.0+extreme[b])/(1.0+valid[b]);
+        if(!diffs[b].empty())
         {
-          retval.push_back(1);
-          continue;
+            sort(diffs[b].begin(), diffs[b].end());
+            k = diffs[b].size();
+            tests[3*b+1] = diffs[b][min(k-1, (int)floor((1-BOOTSTRAP_CI_LEVEL)/2*k))];
+            tests[3*b+2] = diffs[b][min(k-1, (int)floor((1+BOOTSTRAP_CI_LEVEL)/2*k))];
         }
-        retval.push_back(-1);
     }
-    return(retval);
 }
 
+// Tests every window of rows on replicates.threads threads; a window is the unit of work and
+// its result does not depend on which thread computes it
+void TestWindowRows(WindowRows &rows, const Replicates &replicates, int nbins)
+{
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    int i;
+
+    rows.tests.resize(rows.start.size());
+    for(i=0; i<max(1, replicates.threads); i++)
+        workers.emplace_back([&]()
+        {
+            size_t w;
+            while((w = next++) < rows.start.size())
+                TestWindow(rows.samples[w], replicates, nbins, rows.tests[w]);
+        });
+    for(auto &worker : workers)
+        worker.join();
+}
+
+string WindowHeader(const ScanOptions &options)
+{
+    const Replicates *replicates = options.replicates;
+    return string("Chr\tPosition") + (options.windows.size()>1 ? "\tWindowSize\tStep" : "") + "\tPop1size\tPop2size\tSNPs\tHomoSites1\tHetSites1\tHomoSites2\tHetSites2\tHetRatio1\tHetRatio2"
+           + (replicates && replicates->permutations>0 ? "\tPermP" : "") + (replicates && replicates->bootstraps>0 ? "\tDiffLow\tDiffHigh" : "");
+}
 
-vector<int> CountSampleGenotype(vector<int> genotype)
+// tests holds the resampling results (TestWindow), printed after the MAF bins; NULL without them
+void PrintWindow(ostream &out, const string &chr, long start, const WindowSpec &spec, const WindowStat &stat, const vector<float> *tests, const ScanOptions &options)
 {
     int i;
-    vector<int> retval(3);
-    int samplesize;
-    samplesize = genotype.size();
-    
-    for(i=0;i<samplesize;i++)
+    out << chr << "\t" << start;
+    if(options.windows.size()>1)
+      out << "\t" << spec.size << "\t" << spec.step;
+    out << "\t" << options.popcolumns[0].size() << "\t" << options.popcolumns[1].size();
+    for(i=0; i<stat.snps.size(); i++)
+      out << "\t" << stat.snps[i] << "\t" << stat.homogenotypecount1[i] << "\t" << stat.hetgenotypecount1[i] << "\t" << stat.homogenotypecount2[i] << "\t" << stat.hetgenotypecount2[i] << "\t" << ((float)stat.hetgenotypecount1[i])/(stat.homogenotypecount1[i]+stat.hetgenotypecount1[i]) << "\t" << ((float)stat.hetgenotypecount2[i])/(stat.homogenotypecount2[i]+stat.hetgenotypecount2[i]);
+    for(i=0; tests && i<stat.snps.size(); i++)
     {
-      if(genotype[i]>=0)
-        retval[genotype[i]]++;
+      if(options.replicates->permutations>0)
+        out << "\t" << (*tests)[3*i];
+      if(options.replicates->bootstraps>0)
+        out << "\t" << (*tests)[3*i+1] << "\t" << (*tests)[3*i+2];
     }
-    return(retval);
+    out << "\n";
 }
 
-float CountMiorAlleleFreq(vector<int> genotype1, vector<int> genotype2)
+// The window statistics go either to a TSV stream or to the columns of a binary table
+// (--binary), which holds the same values as the TSV
+struct WindowOutput
 {
-    float allsize;
-    float allelecount;
-    float allelefreq;
-    allsize = 0.0;
-    allelecount = 0.0;
+    ostream *text;
+    WindowColumnsWriter *binary;
+};
+
+// Columns of the binary table and the metadata dump_window_columns needs to print the TSV
+void InitWindowColumns(WindowColumnsWriter &writer, const ScanOptions &options, const string &windows)
+{
+    string bins;
     int i;
-    int samplesize;
-    samplesize = genotype1.size();
-    
-    for(i=0;i<samplesize;i++)
+
+    AddWindowColumn(writer, "Chr", COLUMN_DICT);
+    AddWindowColumn(writer, "Position", COLUMN_INT64);
+    AddWindowColumn(writer, "WindowSize", COLUMN_INT64);
+    AddWindowColumn(writer, "Step", COLUMN_INT64);
+    AddWindowColumn(writer, "Pop1size", COLUMN_INT32);
+    AddWindowColumn(writer, "Pop2size", COLUMN_INT32);
+    for(i=1; i<options.bins.edges.size(); i++)
     {
-      if(genotype1[i]>=0)
-      {
-        allsize = allsize+2;
-        allelecount += genotype1[i];
-      }
+        AddWindowColumn(writer, "SNPs_" + to_string(i), COLUMN_INT32);
+        AddWindowColumn(writer, "HomoSites1_" + to_string(i), COLUMN_INT32);
+        AddWindowColumn(writer, "HetSites1_" + to_string(i), COLUMN_INT32);
+        AddWindowColumn(writer, "HomoSites2_" + to_string(i), COLUMN_INT32);
+        AddWindowColumn(writer, "HetSites2_" + to_string(i), COLUMN_INT32);
+        AddWindowColumn(writer, "HetRatio1_" + to_string(i), COLUMN_FLOAT32);
+        AddWindowColumn(writer, "HetRatio2_" + to_string(i), COLUMN_FLOAT32);
     }
-    samplesize = genotype2.size();
-    for(i=0;i<genotype2.size();i++)
+    for(i=1; options.replicates && i<options.bins.edges.size(); i++)
     {
-      if(genotype2[i]>=0)
-      {
-        allsize = allsize+2;
-        allelecount += genotype2[i];
-      }
+        if(options.replicates->permutations>0)
+            AddWindowColumn(writer, "PermP_" + to_string(i), COLUMN_FLOAT32);
+        if(options.replicates->bootstraps>0)
+        {
+            AddWindowColumn(writer, "DiffLow_" + to_string(i), COLUMN_FLOAT32);
+            AddWindowColumn(writer, "DiffHigh_" + to_string(i), COLUMN_FLOAT32);
+        }
     }
-    allelefreq = allelecount/allsize;
-    if(allelefreq>0.5)
-        allelefreq = 1.0 - allelefreq;
-    return(allelefreq);
+    for(i=0; i<options.bins.edges.size(); i++)
+        bins += (i>0 ? "," : "") + to_string(options.bins.edges[i]);
+    AddWindowMeta(writer, "windows", windows);
+    AddWindowMeta(writer, "maf_bins", bins);
+    AddWindowMeta(writer, "tsv_header", WindowHeader(options));
+    AddWindowMeta(writer, "tsv_hidden", options.windows.size()>1 ? "" : "WindowSize,Step");
 }
 
-int main(int argc,char *argv[])
+void AppendWindowColumns(WindowColumnsWriter &writer, const string &chr, long start, const WindowSpec &spec, const WindowStat &stat, const vector<float> *tests, const ScanOptions &options)
 {
-  if(argc!=6)
-  {
-    cout << "Usage: "<<argv[0]<<" windowsize mindepth maxdepth popfile1 popfile2\n";
-    return 0;
-  }
-  string popfile1, popfile2;
-  vector<string> pop1_individuals,pop2_individuals;
-  vector<int> pop1_individuals_columns,pop2_individuals_columns;
-  int pop1size, pop2size;
-  int mindepth,maxdepth;
-  vector<int> pop1_genotype,pop2_genotype;
-
-  string lastchr, thischr;
-  long windowsize;
-  long lastwindow, thiswindow;
+    int i,col;
 
-  int snpflag;
-  int i, j;
-
-  string linedata;
-  vector<string> data_columns;
-  vector<int> genotype1,genotype2;
-  vector<int> genotypecount1,genotypecount2;
-
-  int DAFid;
-  float allelefreq;
-
-  int snps[10];
-  int homogenotypecount1[10],hetgenotypecount1[10];
-  int homogenotypecount2[10],hetgenotypecount2[10];
-  
-  windowsize = atol(argv[1]);
-  mindepth = atoi(argv[2]);
-  maxdepth = atoi(argv[3]);
-  popfile1 = argv[4];
-  popfile2 = argv[5];
-
-  pop1_individuals = LoadFileLinesIntoVector(popfile1);
-  pop2_individuals = LoadFileLinesIntoVector(popfile2);
-
-  while( getline(cin,linedata) )
-  {
-      if(linedata.find("#CHROM",0)==0)
-          break;
-  }
-  pop1_individuals_columns = FindSamplesInVCFHeader(linedata, pop1_individuals);
-  pop2_individuals_columns = FindSamplesInVCFHeader(linedata, pop2_individuals);
-
-  pop1size = pop1_individuals_columns.size();
-  pop2size = pop2_individuals_columns.size();
-  
-  lastwindow=0;
-  thiswindow=0;
-  lastchr="";
-
-  cout << "Chr" << "\t" << "Position" << "\tPop1size\tPop2size\t" << "SNPs" << "\t" << "HomoSites1" << "\t" << "HetSites1" << "\t" << "HomoSites2" << "\t" << "HetSites2" << "\tHetRatio1" << "\tHetRatio2" << endl;
-  
-  while( getline(cin,linedata) )
-  {
-    //snpflag = 0;
-    //data_columns = split(linedata,"\t",true);
-    data_columns.clear();
-    SplitString(linedata,"\t",data_columns,false);
-    thischr = data_columns[0];
-    thiswindow = atol(data_columns[1].c_str())/windowsize;
-    if(lastchr=="")
-    {
-        lastchr = thischr;
-        lastwindow = thiswindow;
-        for(i=0; i<10; i++)
+    AppendDict(writer, 0, chr);
+    AppendInt64(writer, 1, start);
+    AppendInt64(writer, 2, spec.size);
+    AppendInt64(writer, 3, spec.step);
+    AppendInt32(writer, 4, options.popcolumns[0].size());
+    AppendInt32(writer, 5, options.popcolumns[1].size());
+    col = 6;
+    for(i=0; i<stat.snps.size(); i++)
+    {
+        AppendInt32(writer, col++, stat.snps[i]);
+        AppendInt32(writer, col++, stat.homogenotypecount1[i]);
+        AppendInt32(writer, col++, stat.hetgenotypecount1[i]);
+        AppendInt32(writer, col++, stat.homogenotypecount2[i]);
+        AppendInt32(writer, col++, stat.hetgenotypecount2[i]);
+        AppendFloat32(writer, col++, ((float)stat.hetgenotypecount1[i])/(stat.homogenotypecount1[i]+stat.hetgenotypecount1[i]));
+        AppendFloat32(writer, col++, ((float)stat.hetgenotypecount2[i])/(stat.homogenotypecount2[i]+stat.hetgenotypecount2[i]));
+    }
+    for(i=0; tests && i<stat.snps.size(); i++)
+    {
+        if(options.replicates->permutations>0)
+            AppendFloat32(writer, col++, (*tests)[3*i]);
+        if(options.replicates->bootstraps>0)
         {
-            snps[i] = 0;
-            homogenotypecount1[i] = 0;
-            hetgenotypecount1[i] = 0;
-            homogenotypecount2[i] = 0;
-            hetgenotypecount2[i] = 0;
+            AppendFloat32(writer, col++, (*tests)[3*i+1]);
+            AppendFloat32(writer, col++, (*tests)[3*i+2]);
         }
-     }
+    }
+    writer.nrows++;
+}
 
-     if( (thischr!=lastchr) || (lastwindow!=thiswindow) )
-     {
-         if(snps[0]>0)
-         {
-            cout << lastchr << "\t" << lastwindow*windowsize << "\t" << pop1size << "\t" << pop2size;
-            for(i=0; i<10; i++)
-                cout << "\t" << snps[i] << "\t" << homogenotypecount1[i] << "\t" << hetgenotypecount1[i] << "\t" << homogenotypecount2[i] << "\t" << hetgenotypecount2[i] << "\t" << ((float)hetgenotypecount1[i])/(homogenotypecount1[i]+hetgenotypecount1[i]) << "\t" << ((float)hetgenotypecount2[i])/(homogenotypecount2[i]+hetgenotypecount2[i]);
-            cout << endl;
-         }
-
-         lastchr = thischr;
-         lastwindow = thiswindow;
-         for(i=0; i<10; i++)
-         {
-            snps[i] = 0;
-            homogenotypecount1[i] = 0;
-            hetgenotypecount1[i] = 0;
-            homogenotypecount2[i] = 0;
-            hetgenotypecount2[i] = 0;
-         }
-     }
-      
-     genotype1 = GetSampleGenotypeCodeWithDepth(data_columns,pop1_individuals_columns,mindepth,maxdepth);
-     genotype2 = GetSampleGenotypeCodeWithDepth(data_columns,pop2_individuals_columns,mindepth,maxdepth);
+// Runs the resampling tests first when they are enabled
+void WriteWindowRows(WindowOutput &output, WindowRows &rows, const ScanOptions &options)
+{
+    const vector<float> *tests;
+    size_t i;
 
-     genotypecount1 = CountSampleGenotype(genotype1);
-     genotypecount2 = CountSampleGenotype(genotype2);
-     if ( genotypecount1[0]==0 && genotypecount1[1]==0 && genotypecount2[0]==0 && genotypecount2[1]==0 )
-        continue;
-     if ( genotypecount1[2]==0 && genotypecount1[1]==0 && genotypecount2[2]==0 && genotypecount2[1]==0 )
-        continue;
-     if( (genotypecount1[0]==0 && genotypecount1[1]==0 && genotypecount1[2]==0 ) || (genotypecount2[0]==0 && genotypecount2[1]==0 && genotypecount2[2]==0 ) )
-        continue;
+    if(options.replicates)
+    {
+        StageTimer timer(STAGE_TEST);
+        TestWindowRows(rows, *options.replicates, options.bins.edges.size()-1);
+    }
+    StageTimer timer(STAGE_FLUSH);
+    for(i=0; i<rows.start.size(); i++)
+    {
+        tests = options.replicates ? &rows.tests[i] : NULL;
+        if(output.binary)
+            AppendWindowColumns(*output.binary, rows.chr, rows.start[i], rows.spec, rows.stat[i], tests, options);
+        else
+            PrintWindow(*output.text, rows.chr, rows.start[i], rows.spec, rows.stat[i], tests, options);
+    }
+}
+
+// Weighted and mean FST of each population pair over the blocks first..first+nblocks-1
+void PrintFstWindow(ostream &out, const string &chr, long start, const WindowLayout &layout, long first, const ScanOptions &options)
+{
+    FstStat sum;
+    long i;
+    int j;
 
-     allelefreq = CountMiorAlleleFreq(genotype1, genotype2);
-     DAFid = static_cast<int>(allelefreq/0.05);
-     if(DAFid==10) DAFid = 9;
+    for(j=0; j<options.fstpairs.size(); j++)
+    {
+        sum = FstStat{0, 0, 0, 0};
+        for(i=0; i<layout.nblocks; i++)
+        {
+            const FstStat &block = layout.fstblocks[(first+i)%layout.nblocks][j];
+            sum.a += block.a;
+            sum.abc += block.abc;
+            sum.fst += block.fst;
+            sum.sites += block.sites;
+        }
+        if(sum.sites==0)
+            continue;
+        out << chr << "\t" << start;
+        if(options.windows.size()>1)
+          out << "\t" << layout.spec.size << "\t" << layout.spec.step;
+        out << "\t" << options.popnames[options.fstpairs[j].first] << "\t" << options.popnames[options.fstpairs[j].second] << "\t" << sum.sites << "\t" << sum.a/sum.abc << "\t" << sum.fst/sum.sites << "\n";
+    }
+}
 
-     homogenotypecount1[DAFid] += genotypecount1[0] + genotypecount1[2];
-     hetgenotypecount1[DAFid] += genotypecount1[1];
-     homogenotypecount2[DAFid] += genotypecount2[0] + genotypecount2[2];
-     hetgenotypecount2[DAFid] += genotypecount2[1];
-      
-     snps[DAFid] ++;
+void AddSiteToWindow(WindowStat &stat, int DAFid, const vector<int> &genotypecount1, const vector<int> &genotypecount2)
+{
+     stat.homogenotypecount1[DAFid] += genotypecount1[0] + genotypecount1[2];
+     stat.hetgenotypecount1[DAFid] += genotypecount1[1];
+     stat.homogenotypecount2[DAFid] += genotypecount2[0] + genotypecount2[2];
+     stat.hetgenotypecount2[DAFid] += genotypecount2[1];
 
-  }
-  if(snps[0]>0)
-  {
-       cout << lastchr << "\t" << lastwindow*windowsize << "\t" << pop1size << "\t" << pop2size;
-       for(i=0; i<10; i++)
-         cout << "\t" << snps[i] << "\t" << homogenotypecount1[i] << "\t" << hetgenotypecount1[i] << "\t" << homogenotypecount2[i] << "\t" << hetgenotypecount2[i] << "\t" << ((float)hetgenotypecount1[i])/(homogenotypecount1[i]+hetgenotypecount1[i]) << "\t" << ((float)hetgenotypecount2[i])/(homogenotypecount2[i]+hetgenotypecount2[i]);
-       cout << endl;
-  }
-  
-  return 1;
+     stat.snps[DAFid] ++;
 }
 
+// Per-thread scanning state: the open windows and the buffers reused between records.
+// Only windows starting inside [beg,end] are printed (end = 0: no limit); records are read
+// up to the end of the last such window and skipped when they start before beg, so a region
+// query only counts the sites of its own windows
+struct SiteScanner
+{
+    const ScanOptions *options;
+    WindowOutput *out;
+    ostream *fstout;
+    long beg,end,maxsize;
+    ExcludedCursor excluded;
+    vector<string_view> columns;
+    string lastformat;
+    int dpindex;
+    vector<PackedGenotypes> packed;
+    vector<vector<int> > genotypecount;
+    int32_t *gt,*dp;
+    int ngt_arr,ndp_arr;
+    string chr;
+    vector<WindowLayout> layouts;
+};
+
+// out and fstout may be NULL, in which case the rows stay in the layouts
+void InitScanner(SiteScanner &scanner, const ScanOptions &options, WindowOutput *out, ostream *fstout, long beg, long end)
+{
+    int i;
+    scanner.options = &options;
+    scanner.out = out;
+    scanner.fstout = fstout;
+    scanner.packed.resize(options.popcolumns.size());
+    scanner.genotypecount.assign(options.popcolumns.size(), vector<int>(4, 0));
+    scanner.beg = beg;
+    scanner.end = end;
+    scanner.maxsize = MaxWindowSize(options);
+    scanner.lastformat = "";
+    scanner.dpindex = -1;
+    scanner.gt = NULL;
+    scanner.dp = NULL;
+    scanner.ngt_arr = 0;
+    scanner.ndp_arr = 0;
+    scanner.chr = "";
+    scanner.layouts.resize(options.windows.size());
+    for(i=0; i<options.windows.size(); i++)
+        InitLayout(scanner.layouts[i], options.windows[i], options.bins.edges.size()-1, options.fstpairs.size(),
+                   options.replicates ? 2*(options.bins.edges.size()-1)*(options.popcolumns[0].size()+options.popcolumns[1].size()) : 0);
+}
+
+bool IsOutsideChunk(const SiteScanner &scanner, long pos)
+{
+    return pos<scanner.beg || (scanner.end>0 && pos>scanner.end+scanner.maxsize-1);
+}
+
+// Prints the window starting at the oldest block and evicts that block
+void EvictBlock(SiteScanner &scanner, WindowLayout &layout)
+{
+    long k = layout.block-layout.nblocks+1;
+    long start = k*layout.spec.step;
+
+    if(k<0)
+        return;
+    if(start>=scanner.beg && (scanner.end==0 || start<=scanner.end))
+    {
+        if(layout.sum.snps[0]>0)
+        {
+            layout.rows.chr = scanner.chr;
+            layout.rows.start.push_back(start);
+            layout.rows.stat.push_back(layout.sum);
+            if(scanner.options->replicates)
+                layout.rows.samples.push_back(layout.samplesum);
+        }
+        PrintFstWindow(layout.fstrows, scanner.chr, start, layout, k, *scanner.options);
+    }
+    WindowStat &first = layout.blocks[k%layout.nblocks];
+    AddWindow(layout.sum, first, -1);
+    ResetWindow(first, first.snps.size());
+    for(auto &fst : layout.fstblocks[k%layout.nblocks])
+        fst = FstStat{0, 0, 0, 0};
+    if(scanner.options->replicates)
+    {
+        vector<uint32_t> &counts = layout.sampleblocks[k%layout.nblocks];
+        AddSampleCounts(layout.samplesum, counts, -1);
+        fill(counts.begin(), counts.end(), 0);
+    }
+}
+
+// Moves the layout to block, printing every window that starts before block-nblocks+1.
+// Past a gap of nblocks or more all blocks are empty, so the rest of the gap is skipped
+void AdvanceLayout(SiteScanner &scanner, WindowLayout &layout, long block)
+{
+    long i,steps;
+
+    if(layout.block<0)
+    {
+        layout.block = block;
+        return;
+    }
+    steps = min(block-layout.block, layout.nblocks);
+    for(i=0; i<steps; i++)
+    {
+        EvictBlock(scanner, layout);
+        layout.block++;
+    }
+    layout.block = block;
+}
+
+// Prints the windows still open on the current chromosome, including the partial ones at its end,
+// and writes the rows of each layout in turn
+void FlushWindows(SiteScanner &scanner)
+{
+    for(auto &layout : scanner.layouts)
+    {
+        if(layout.block>=0)
+            AdvanceLayout(scanner, layout, layout.block+layout.nblocks);
+        layout.block = -1;
+        if(scanner.out)
+        {
+            WriteWindowRows(*scanner.out, layout.rows, *scanner.options);
+            layout.rows.start.clear();
+            layout.rows.stat.clear();
+            layout.rows.samples.clear();
+            layout.rows.tests.clear();
+        }
+    }
+    for(auto &layout : scanner.layouts)
+        if(scanner.fstout)
+        {
+            *scanner.fstout << layout.fstrows.str();
+            layout.fstrows.str("");
+        }
+}
+
+// Moves the windows of every layout to the site
+void UpdateWindow(SiteScanner &scanner, string_view thischr, long pos)
+{
+    if(thischr!=scanner.chr)
+    {
+        FlushWindows(scanner);
+        scanner.chr = thischr;
+    }
+    for(auto &layout : scanner.layouts)
+        AdvanceLayout(scanner, layout, pos/layout.spec.step);
+}
+
+// Per-sample het and called counts of the site for the resampling tests, from the packed
+// genotypes of populations 1 and 2
+void AddSiteSamples(SiteScanner &scanner, int DAFid)
+{
+     int nbins = scanner.options->bins.edges.size()-1;
+     int offset,pop,sample,w;
+     uint64_t called,het;
+
+     offset = 0;
+     for(pop=0; pop<2; pop++)
+     {
+        const PackedGenotypes &packed = scanner.packed[pop];
+        for(w=0; w<packed.pass.size(); w++)
+        {
+            called = packed.pass[w] & ~(packed.lo[w] & packed.hi[w]);
+            het = packed.pass[w] & packed.lo[w] & ~packed.hi[w];
+            while(called)
+            {
+                sample = offset + w*64 + __builtin_ctzll(called);
+                for(auto &layout : scanner.layouts)
+                {
+                    uint32_t *block = layout.sampleblocks[layout.block%layout.nblocks].data() + sample*2*nbins;
+                    uint32_t *sum = layout.samplesum.data() + sample*2*nbins;
+                    block[nbins+DAFid]++;
+                    sum[nbins+DAFid]++;
+                    if((het >> __builtin_ctzll(called)) & 1)
+                    {
+                        block[DAFid]++;
+                        sum[DAFid]++;
+                    }
+                }
+                called &= called-1;
+            }
+        }
+        offset += scanner.options->popcolumns[pop].size();
+     }
+}
+
+// MAF-bin statistics of the first two populations
+void AddSite(SiteScanner &scanner)
+{
+     const vector<int> &genotypecount1 = scanner.genotypecount[0];
+     const vector<int> &genotypecount2 = scanner.genotypecount[1];
+     int DAFid;
+     float allelefreq;
+
+     if ( genotypecount1[0]==0 && genotypecount1[1]==0 && genotypecount2[0]==0 && genotypecount2[1]==0 )
+        return;
+     if ( genotypecount1[2]==0 && genotypecount1[1]==0 && genotypecount2[2]==0 && genotypecount2[1]==0 )
+        return;
+     if( (genotypecount1[0]==0 && genotypecount1[1]==0 && genotypecount1[2]==0 ) || (genotypecount2[0]==0 && genotypecount2[1]==0 && genotypecount2[2]==0 ) )
+        return;
+
+     allelefreq = CountMiorAlleleFreq(genotypecount1, genotypecount2);
+     DAFid = FindMafBin(scanner.options->bins, allelefreq);
+     if(DAFid<0)
+        return;
+     for(auto &layout : scanner.layouts)
+     {
+        AddSiteToWindow(layout.blocks[layout.block%layout.nblocks], DAFid, genotypecount1, genotypecount2);
+        AddSiteToWindow(layout.sum, DAFid, genotypecount1, genotypecount2);
+     }
+     if(scanner.options->replicates)
+        AddSiteSamples(scanner, DAFid);
+}
+
+// FST components of each chosen population pair, computed once and added to every layout
+void AddSiteFst(SiteScanner &scanner)
+{
+     const ScanOptions &options = *scanner.options;
+     double a,abc;
+     int j;
+
+     for(j=0; j<options.fstpairs.size(); j++)
+     {
+        if(!WeirCockerhamComponents(scanner.genotypecount[options.fstpairs[j].first], scanner.genotypecount[options.fstpairs[j].second], a, abc))
+            continue;
+        for(auto &layout : scanner.layouts)
+        {
+            FstStat &fst = layout.fstblocks[layout.block%layout.nblocks][j];
+            fst.a += a;
+            fst.abc += abc;
+            fst.fst += a/abc;
+            fst.sites ++;
+        }
+     }
+}
+
+// One line of text VCF
+void ScanVcfLine(SiteScanner &scanner, string_view linebuffer)
+{
+    const ScanOptions &options = *scanner.options;
+    vector<string_view> &data_columns = scanner.columns;
+    long pos;
+    int i;
+
+    StageTimer timer(STAGE_GENOTYPE);
+    CountItems(1);
+    SplitStringView(linebuffer,'\t',data_columns);
+    if(data_columns.size()<9)
+        return;
+    pos = atol(data_columns[1].data());
+    if(IsOutsideChunk(scanner, pos))
+        return;
+    if(options.biallelic && !IsBiallelic(data_columns[4]))
+        return;
+    if(options.excluded && IsExcludedSite(*options.excluded, scanner.excluded, data_columns[0], pos))
+        return;
+    UpdateWindow(scanner, data_columns[0], pos);
+    if(data_columns[8]!=scanner.lastformat)
+    {
+        scanner.lastformat = data_columns[8];
+        scanner.dpindex = FindFormatKey(data_columns[8],"DP");
+    }
+
+    for(i=0; i<options.popcolumns.size(); i++)
+        CountSampleGenotype(data_columns,options.popcolumns[i],scanner.dpindex,options.mindepth,options.maxdepth,scanner.packed[i],scanner.genotypecount[i]);
+    AddSite(scanner);
+    AddSiteFst(scanner);
+}
+
+// One decoded BCF record
+void ScanBcfRecord(SiteScanner &scanner, const bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    const ScanOptions &options = *scanner.options;
+    int nsamples = bcf_hdr_nsamples(hdr);
+    int ngt,ndp;
+    int i;
+
+    StageTimer timer(STAGE_GENOTYPE);
+    CountItems(1);
+    if(IsOutsideChunk(scanner, rec->pos+1))
+      return;
+    if(options.biallelic && rec->n_allele!=2)
+      return;
+    string_view thischr = bcf_hdr_id2name(hdr, rec->rid);
+    if(options.excluded && IsExcludedSite(*options.excluded, scanner.excluded, thischr, rec->pos+1))
+      return;
+    UpdateWindow(scanner, thischr, rec->pos+1);
+
+    bcf_unpack(rec, BCF_UN_FMT);
+    ngt = bcf_get_genotypes(hdr, rec, &scanner.gt, &scanner.ngt_arr);
+    ndp = bcf_get_format_int32(hdr, rec, "DP", &scanner.dp, &scanner.ndp_arr);
+    for(i=0; i<options.popcolumns.size(); i++)
+    {
+      if(ngt<=0 || nsamples==0)
+        scanner.genotypecount[i].assign(4, 0);
+      else
+        CountBcfSampleGenotype(scanner.gt,ngt/nsamples,scanner.dp,ndp>0 ? ndp/nsamples : 0,options.popcolumns[i],nsamples,options.mindepth,options.maxdepth,scanner.packed[i],scanner.genotypecount[i]);
+    }
+    AddSite(scanner);
+    AddSiteFst(scanner);
+}
+
+// Prints the last open windows and releases the BCF buffers
+void FinishScanner(SiteScanner &scanner)
+{
+    FlushWindows(scanner);
+    free(scanner.gt);
+    free(scanner.dp);
+    scanner.gt = NULL;
+    scanner.dp = NULL;
+}
+
+// Contig length from a ##contig=<ID=...,length=...> header line
+void ParseContigLength(string_view line, unordered_map<string,long> &lengths)
+{
+    size_t start,idpos,lenpos;
+    string id;
+
+    if(line.compare(0, 10, "##contig=<")!=0)
+        return;
+    start = 9;
+    idpos = line.find("ID=", start);
+    lenpos = line.find("length=", start);
+    if(idpos==string_view::npos || lenpos==string_view::npos)
+        return;
+    idpos += 3;
+    id = string(line.substr(idpos, line.find_first_of(",>", idpos)-idpos));
+    lengths[id] = atol(line.data()+lenpos+7);
+}
+
+// Windows starting at POS beg..end of one chromosome, end = 0 for the rest of the chromosome
+struct ScanChunk
+{
+    string chr;
+    long beg,end;
+};
+
+// Chunks of about 10 Mb starting on a window boundary of every layout; a chromosome without
+// a known length is one chunk
+vector<ScanChunk> MakeScanChunks(const vector<string> &seqnames, const unordered_map<string,long> &lengths, const ScanOptions &options)
+{
+    vector<ScanChunk> chunks;
+    long align = 1;
+    long span,beg;
+
+    for(const WindowSpec &spec : options.windows)
+        align = lcm(align, spec.step);
+    span = max(1L, 10000000/align)*align;
+
+    for(const string &chr : seqnames)
+    {
+        auto it = lengths.find(chr);
+        if(it==lengths.end() || it->second<=0)
+        {
+            chunks.push_back({chr, 0, 0});
+            continue;
+        }
+        for(beg=0; beg<=it->second; beg+=span)
+            chunks.push_back({chr, beg, beg+span-1});
+        chunks.back().end = 0;
+    }
+    return chunks;
+}
+
+// Region holding the sites of the chunk's windows, i.e. up to maxsize past its last window start
+string ChunkRegion(const ScanChunk &chunk, long maxsize)
+{
+    if(chunk.beg==0 && chunk.end==0)
+        return chunk.chr;
+    if(chunk.end==0)
+        return chunk.chr + ":" + to_string(max(1L, chunk.beg));
+    return chunk.chr + ":" + to_string(max(1L, chunk.beg)) + "-" + to_string(chunk.end+maxsize-1);
+}
+
+// An input file opened with its tabix (VCF.gz) or CSI (BCF) index; one per thread
+struct IndexedInput
+{
+    htsFile *fp;
+    tbx_t *tbx;
+    hts_idx_t *idx;
+    bcf_hdr_t *hdr;
+    bcf1_t *rec;
+    kstring_t line;
+};
+
+void CloseIndexedInput(IndexedInput &input)
+{
+    if(input.rec) bcf_destroy(input.rec);
+    if(input.hdr) bcf_hdr_destroy(input.hdr);
+    if(input.idx) hts_idx_destroy(input.idx);
+    if(input.tbx) tbx_destroy(input.tbx);
+    if(input.fp) hts_close(input.fp);
+    free(input.line.s);
+    input = IndexedInput{};
+}
+
+bool OpenIndexedInput(const string &filename, bool isbcf, IndexedInput &input)
+{
+    input = IndexedInput{};
+    input.fp = hts_open(filename.c_str(), "r");
+    if(input.fp==NULL)
+        return false;
+    if(isbcf)
+    {
+        input.hdr = bcf_hdr_read(input.fp);
+        input.idx = bcf_index_load(filename.c_str());
+        input.rec = bcf_init();
+    }
+    else
+        input.tbx = tbx_index_load(filename.c_str());
+    if((isbcf && (input.hdr==NULL || input.idx==NULL)) || (!isbcf && input.tbx==NULL))
+    {
+        CloseIndexedInput(input);
+        return false;
+    }
+    return true;
+}
+
+// Sequence names in index order
+vector<string> IndexedSeqnames(const IndexedInput &input)
+{
+    vector<string> names;
+    const char **seqnames;
+    int i,n;
+
+    n = 0;
+    if(input.tbx)
+        seqnames = tbx_seqnames(input.tbx, &n);
+    else
+        seqnames = bcf_index_seqnames(input.idx, input.hdr, &n);
+    for(i=0; i<n; i++)
+        names.push_back(seqnames[i]);
+    free(seqnames);
+    return names;
+}
+
+// Printed windows of one chunk: the window statistics and the FST rows of each layout
+struct ChunkRows
+{
+    vector<WindowRows> windows;
+    vector<string> fst;
+};
+
+bool NextTabixLine(IndexedInput &input, hts_itr_t *itr)
+{
+    StageTimer timer(STAGE_READ);
+    return tbx_itr_next(input.fp, input.tbx, itr, &input.line) >= 0;
+}
+
+bool NextBcfRecord(IndexedInput &input, hts_itr_t *itr)
+{
+    StageTimer timer(STAGE_READ);
+    return bcf_itr_next(input.fp, itr, input.rec) >= 0;
+}
+
+void ScanIndexedChunk(IndexedInput &input, const ScanOptions &options, const ScanChunk &chunk, ChunkRows &rows)
+{
+    SiteScanner scanner;
+    string region = ChunkRegion(chunk, MaxWindowSize(options));
+    hts_itr_t *itr;
+
+    InitScanner(scanner, options, NULL, NULL, chunk.beg, chunk.end);
+    // A sequence without records may be missing from the index; its chunk is empty
+    if(input.tbx)
+    {
+        itr = tbx_itr_querys(input.tbx, region.c_str());
+        if(itr)
+            while(NextTabixLine(input, itr))
+                ScanVcfLine(scanner, string_view(input.line.s, input.line.l));
+    }
+    else
+    {
+        itr = bcf_itr_querys(input.idx, input.hdr, region.c_str());
+        if(itr)
+            while(NextBcfRecord(input, itr))
+                ScanBcfRecord(scanner, input.hdr, input.rec);
+    }
+    if(itr)
+        hts_itr_destroy(itr);
+    FinishScanner(scanner);
+    for(auto &layout : scanner.layouts)
+    {
+        rows.windows.push_back(move(layout.rows));
+        rows.fst.push_back(layout.fstrows.str());
+    }
+}
+
+// Scans one chunk with the input handles of its thread; false when they could not be opened
+typedef function<bool(const ScanChunk&, ChunkRows&)> ChunkScanFunction;
+
+// Scans the chunks on nthreads threads, each with the scan function (and file handles) made for
+// it by makescan, and writes the results to output (and the FST windows to fstout) in the order
+// of the serial scan: chromosome by chromosome, each layout in turn
+bool RunChunks(const function<ChunkScanFunction()> &makescan, const ScanOptions &options, const vector<ScanChunk> &chunks, int nthreads, WindowOutput &output, ostream *fstout)
+{
+    vector<ChunkRows> results(chunks.size());
+    vector<char> done(chunks.size(), 0);
+    atomic<size_t> nextchunk(0);
+    atomic<bool> failed(false);
+    mutex lock;
+    condition_variable ready;
+    vector<thread> workers;
+    size_t i,first,c,j;
+
+    for(i=0; i<(size_t)nthreads; i++)
+    {
+        workers.emplace_back([&]()
+        {
+            ChunkScanFunction scan = makescan();
+            size_t chunk;
+            while((chunk = nextchunk++) < chunks.size())
+            {
+                ChunkRows rows;
+                if(!scan(chunks[chunk], rows))
+                    failed = true;
+                lock_guard<mutex> guard(lock);
+                results[chunk] = move(rows);
+                done[chunk] = 1;
+                ready.notify_all();
+            }
+        });
+    }
+    first = 0;
+    for(i=0; i<chunks.size(); i++)
+    {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [&]() { return done[i]!=0; });
+        guard.unlock();
+        if(i+1<chunks.size() && chunks[i+1].chr==chunks[i].chr)
+            continue;
+        for(j=0; j<options.windows.size(); j++)
+            for(c=first; c<=i; c++)
+                if(j<results[c].windows.size())
+                    WriteWindowRows(output, results[c].windows[j], options);
+        for(j=0; j<options.windows.size() && fstout; j++)
+            for(c=first; c<=i; c++)
+                if(j<results[c].fst.size())
+                    *fstout << results[c].fst[j];
+        for(c=first; c<=i; c++)
+            results[c] = ChunkRows();
+        first = i+1;
+    }
+    for(auto &worker : workers)
+        worker.join();
+    return !failed;
+}
+
+// Indexed VCF.gz/BCF chunks, each thread with its own file handle
+bool RunIndexedChunks(const string &filename, bool isbcf, const ScanOptions &options, const vector<ScanChunk> &chunks, int nthreads, WindowOutput &output, ostream *fstout)
+{
+    return RunChunks([&]() -> ChunkScanFunction
+    {
+        shared_ptr<IndexedInput> input(new IndexedInput, [](IndexedInput *input) { CloseIndexedInput(*input); delete input; });
+        bool ok = OpenIndexedInput(filename, isbcf, *input);
+        return [input, ok, &options](const ScanChunk &chunk, ChunkRows &rows)
+        {
+            if(ok)
+                ScanIndexedChunk(*input, options, chunk, rows);
+            return ok;
+        };
+    }, options, chunks, nthreads, output, fstout);
+}
+
+// Known biallelic SNP of the pileup mode (--bams), 1-based
+struct PileupSite
+{
+    long pos;
+    char ref,alt;
+};
+
+// The sites of each chromosome, sorted
+typedef unordered_map<string, vector<PileupSite> > PileupSites;
+
+// "chromosome position REF ALT" lines, or the first five columns of a VCF; only SNPs are kept
+bool LoadPileupSites(const string &filename, PileupSites &sites)
+{
+    ifstream infile(filename.c_str());
+    string data;
+    vector<string> cols;
+    string ref,alt;
+
+    if(!infile)
+        return false;
+    while (getline(infile,data))
+    {
+        cols.clear();
+        SplitString(data," \t\r",cols,false);
+        if(cols.size()<4 || cols[0][0]=='#')
+            continue;
+        ref = cols.size()>=5 ? cols[3] : cols[2];
+        alt = cols.size()>=5 ? cols[4] : cols[3];
+        if(ref.size()!=1 || alt.size()!=1 || !strchr("ACGT", toupper(ref[0])) || !strchr("ACGT", toupper(alt[0])))
+            continue;
+        sites[cols[0]].push_back(PileupSite{atol(cols[1].c_str()), (char)toupper(ref[0]), (char)toupper(alt[0])});
+    }
+    for(auto &chr : sites)
+    {
+        sort(chr.second.begin(), chr.second.end(), [](const PileupSite &a, const PileupSite &b) { return a.pos<b.pos; });
+        chr.second.erase(unique(chr.second.begin(), chr.second.end(), [](const PileupSite &a, const PileupSite &b) { return a.pos==b.pos; }), chr.second.end());
+    }
+    return true;
+}
+
+// Sample name of a BAM written by filter_bam --batch: the file name without .pass.sorted.bam
+string PileupSampleName(const string &filename)
+{
+    string name = filename.substr(filename.find_last_of('/')+1);
+    const string suffixes[] = {".pass.sorted.bam", ".sorted.bam", ".bam"};
+    for(const string &suffix : suffixes)
+        if(name.size()>suffix.size() && name.compare(name.size()-suffix.size(), suffix.size(), suffix)==0)
+            return name.substr(0, name.size()-suffix.size());
+    return name;
+}
+
+// Bases below this quality are not counted; a sample is het when the minor of the REF and ALT
+// read counts is at least PILEUP_HET_FRACTION of their sum
+#define PILEUP_MIN_BASEQ 13
+#define PILEUP_HET_FRACTION 0.2
+#define PILEUP_RESERVED_FILES 32      // descriptors kept for the VCF, outputs and htslib besides the BAMs
+
+// One coordinate-sorted BAM of a thread; the index is loaded once and shared by all threads, as
+// sam_itr_querys only reads it
+struct PileupInput
+{
+    samFile *fp;
+    sam_hdr_t *hdr;
+    const hts_idx_t *idx;
+    hts_itr_t *itr;
+    const vector<PileupSite> *sites;        // sites of the current chunk's chromosome
+};
+
+void ClosePileupInput(PileupInput &input)
+{
+    if(input.itr) hts_itr_destroy(input.itr);
+    if(input.hdr) sam_hdr_destroy(input.hdr);
+    if(input.fp) sam_close(input.fp);
+    input = PileupInput{};
+}
+
+bool OpenPileupInput(const string &filename, const hts_idx_t *idx, htsThreadPool *pool, PileupInput &input)
+{
+    input = PileupInput{};
+    input.fp = sam_open(filename.c_str(), "r");
+    if(input.fp==NULL)
+        return false;
+    if(pool->pool)
+        hts_set_opt(input.fp, HTS_OPT_THREAD_POOL, pool);
+    input.hdr = sam_hdr_read(input.fp);
+    input.idx = idx;
+    if(input.hdr==NULL)
+    {
+        ClosePileupInput(input);
+        return false;
+    }
+    return true;
+}
+
+// The index of every BAM, loaded once; false with the first BAM that has none
+bool LoadPileupIndexes(const vector<string> &bamfiles, vector<hts_idx_t*> &indexes, string &failed)
+{
+    samFile *fp;
+    hts_idx_t *idx;
+
+    for(const string &bamfile : bamfiles)
+    {
+        fp = sam_open(bamfile.c_str(), "r");
+        idx = fp ? sam_index_load(fp, bamfile.c_str()) : NULL;
+        if(fp)
+            sam_close(fp);
+        if(idx==NULL)
+        {
+            failed = bamfile;
+            return false;
+        }
+        indexes.push_back(idx);
+    }
+    return true;
+}
+
+void DestroyPileupIndexes(vector<hts_idx_t*> &indexes)
+{
+    for(hts_idx_t *idx : indexes)
+        hts_idx_destroy(idx);
+    indexes.clear();
+}
+
+// Every pileup thread holds all the BAMs open: the number of threads that fit the open file limit
+// (raised to the hard limit first), at most threads; 0 when not even one thread fits
+int FitPileupThreads(size_t nbams, int threads, rlim_t &limit)
+{
+    struct rlimit files;
+
+    if(getrlimit(RLIMIT_NOFILE, &files)!=0)
+    {
+        limit = RLIM_INFINITY;
+        return threads;
+    }
+    if(files.rlim_cur<files.rlim_max)
+    {
+        struct rlimit raised = files;
+        raised.rlim_cur = files.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &raised)==0)
+            files = raised;
+    }
+    limit = files.rlim_cur;
+    if(limit==RLIM_INFINITY)
+        return threads;
+    if(limit<=PILEUP_RESERVED_FILES)
+        return 0;
+    return min<rlim_t>(threads, (limit-PILEUP_RESERVED_FILES)/nbams);
+}
+
+// Does the read [beg, end) (0-based) cover one of the sites
+bool CoversPileupSite(const vector<PileupSite> &sites, long beg, long end)
+{
+    auto it = lower_bound(sites.begin(), sites.end(), beg+1, [](const PileupSite &site, long pos) { return site.pos<pos; });
+    return it!=sites.end() && it->pos<=end;
+}
+
+// Pileup reader: mapped primary reads that cover a site; reads between the sites never reach
+// the pileup, so only the columns around the sites are built
+int ReadPileupRecord(void *data, bam1_t *b)
+{
+    PileupInput *input = static_cast<PileupInput*>(data);
+    int ret;
+
+    if(input->itr==NULL)
+        return -1;
+    while((ret = sam_itr_next(input->fp, input->itr, b)) >= 0)
+    {
+        if(b->core.flag & (BAM_FUNMAP|BAM_FSECONDARY|BAM_FQCFAIL|BAM_FDUP))
+            continue;
+        if(CoversPileupSite(*input->sites, b->core.pos, bam_endpos(b)))
+            break;
+    }
+    return ret;
+}
+
+// Genotype code of one sample at a site from its pileup, with the codes of
+// GetSampleGenotypeCodeWithDepth: the depth is the number of bases of quality PILEUP_MIN_BASEQ
+int GetPileupGenotypeCode(const bam_pileup1_t *plp, int n, const PileupSite &site, int mindepth, int maxdepth)
+{
+    int depth,ref,alt;
+    char base;
+    int i;
+
+    depth = ref = alt = 0;
+    for(i=0; i<n; i++)
+    {
+        if(plp[i].is_del || plp[i].is_refskip || bam_get_qual(plp[i].b)[plp[i].qpos]<PILEUP_MIN_BASEQ)
+            continue;
+        depth++;
+        base = seq_nt16_str[bam_seqi(bam_get_seq(plp[i].b), plp[i].qpos)];
+        if(base==site.ref)
+            ref++;
+        else if(base==site.alt)
+            alt++;
+    }
+    if( depth<mindepth || depth>maxdepth )
+        return -2;
+    if(ref+alt==0)
+        return -1;
+    if(alt<PILEUP_HET_FRACTION*(ref+alt))
+        return 0;
+    if(ref<PILEUP_HET_FRACTION*(ref+alt))
+        return 2;
+    return 1;
+}
+
+// codes[i] is the genotype code of the i-th BAM, i.e. of column 9+i of the sample header line
+void CountPileupSampleGenotype(const vector<int> &codes,const vector<int> &samplepos,PackedGenotypes &packed,vector<int> &count)
+{
+    int i;
+    int sample;
+
+    ResetPackedGenotypes(packed, samplepos.size());
+    for(i=0;i<samplepos.size();i++)
+    {
+      sample = samplepos[i] - 9;
+      if(sample<0 || sample>=codes.size())
+        continue;
+      SetPackedGenotype(packed, i, codes[sample]);
+    }
+    CountPackedSampleGenotype(packed, count);
+}
+
+// One genotyped site
+void ScanPileupSite(SiteScanner &scanner, string_view thischr, long pos, const vector<int> &codes)
+{
+    const ScanOptions &options = *scanner.options;
+    int i;
+
+    if(IsOutsideChunk(scanner, pos))
+      return;
+    if(options.excluded && IsExcludedSite(*options.excluded, scanner.excluded, thischr, pos))
+      return;
+    UpdateWindow(scanner, thischr, pos);
+    for(i=0; i<options.popcolumns.size(); i++)
+      CountPileupSampleGenotype(codes,options.popcolumns[i],scanner.packed[i],scanner.genotypecount[i]);
+    AddSite(scanner);
+    AddSiteFst(scanner);
+}
+
+bool NextPileupColumn(bam_mplp_t iter, int &tid, int &pos, vector<int> &nplp, vector<const bam_pileup1_t*> &plp)
+{
+    StageTimer timer(STAGE_READ);
+    return bam_mplp_auto(iter, &tid, &pos, nplp.data(), plp.data()) > 0;
+}
+
+// Multi-sample pileup of the chunk's region, genotyping the known sites in it
+void ScanPileupChunk(vector<PileupInput> &inputs, const PileupSites &sites, const ScanOptions &options, const ScanChunk &chunk, ChunkRows &rows)
+{
+    SiteScanner scanner;
+    string region = ChunkRegion(chunk, MaxWindowSize(options));
+    auto chrsites = sites.find(chunk.chr);
+    vector<void*> data;
+    vector<const bam_pileup1_t*> plp(inputs.size());
+    vector<int> nplp(inputs.size()),codes(inputs.size());
+    bam_mplp_t iter;
+    size_t k,i;
+    int tid,pos;
+
+    InitScanner(scanner, options, NULL, NULL, chunk.beg, chunk.end);
+    if(chrsites!=sites.end())
+    {
+        const vector<PileupSite> &chrs = chrsites->second;
+        // A BAM without the chromosome contributes no reads
+        for(auto &input : inputs)
+        {
+            input.itr = sam_itr_querys(input.idx, input.hdr, region.c_str());
+            input.sites = &chrs;
+            data.push_back(&input);
+        }
+        iter = bam_mplp_init(inputs.size(), ReadPileupRecord, data.data());
+        bam_mplp_init_overlaps(iter);
+        k = 0;
+        while(k<chrs.size() && NextPileupColumn(iter, tid, pos, nplp, plp))
+        {
+            while(k<chrs.size() && chrs[k].pos<pos+1)
+                k++;
+            if(k==chrs.size() || chrs[k].pos!=pos+1)
+                continue;
+            StageTimer timer(STAGE_GENOTYPE);
+            CountItems(1);
+            for(i=0; i<inputs.size(); i++)
+                codes[i] = GetPileupGenotypeCode(plp[i], nplp[i], chrs[k], options.mindepth, options.maxdepth);
+            ScanPileupSite(scanner, chunk.chr, chrs[k].pos, codes);
+        }
+        bam_mplp_destroy(iter);
+        for(auto &input : inputs)
+        {
+            if(input.itr)
+                hts_itr_destroy(input.itr);
+            input.itr = NULL;
+        }
+    }
+    FinishScanner(scanner);
+    for(auto &layout : scanner.layouts)
+    {
+        rows.windows.push_back(move(layout.rows));
+        rows.fst.push_back(layout.fstrows.str());
+    }
+}
+
+// Pileup chunks, each thread with its own handles of all the BAMs and the shared indexes; the BGZF
+// blocks of all the samples are decompressed on the shared thread pool
+bool RunPileupChunks(const vector<string> &bamfiles, const vector<hts_idx_t*> &indexes, const PileupSites &sites, htsThreadPool *pool, const ScanOptions &options, const vector<ScanChunk> &chunks, int nthreads, WindowOutput &output, ostream *fstout)
+{
+    return RunChunks([&]() -> ChunkScanFunction
+    {
+        shared_ptr<vector<PileupInput> > inputs(new vector<PileupInput>(bamfiles.size()), [](vector<PileupInput> *inputs)
+        {
+            for(auto &input : *inputs)
+                ClosePileupInput(input);
+            delete inputs;
+        });
+        bool ok = true;
+        size_t i;
+        for(i=0; i<bamfiles.size() && ok; i++)
+            ok = OpenPileupInput(bamfiles[i], indexes[i], pool, (*inputs)[i]);
+        return [inputs, ok, &sites, &options](const ScanChunk &chunk, ChunkRows &rows)
+        {
+            if(ok)
+                ScanPileupChunk(*inputs, sites, options, chunk, rows);
+            return ok;
+        };
+    }, options, chunks, nthreads, output, fstout);
+}
+
+// Next line of the text VCF file, or of stdin without a file
+bool ReadVcfLine(htsFile *fp, kstring_t &line, string &linedata)
+{
+  StageTimer timer(STAGE_READ);
+  return fp ? hts_getline(fp, KS_SEP_LINE, &line) >= 0 : static_cast<bool>(getline(cin,linedata));
+}
+
+bool ReadBcfRecord(htsFile *fp, bcf_hdr_t *hdr, bcf1_t *rec)
+{
+  StageTimer timer(STAGE_READ);
+  return bcf_read(fp, hdr, rec) >= 0;
+}
+
+int main(int argc,char *argv[])
+{
+  vector<string> args;
+  string excludefile;
+  string mafbins;
+  vector<string> popfiles;
+  string fstpairs,fstfile;
+  string binaryfile;
+  string bamlist,sitesfile;
+  string metricsfile;
+  double progress;
+  Replicates replicates = Replicates{};
+  int threads;
+  bool biallelic;
+  int i;
+
+  threads = 0;
+  progress = 0;
+  biallelic = false;
+  replicates.seed = 1;
+  mafbins = "0,0.05,0.1,0.15,0.2,0.25,0.3,0.35,0.4,0.45,0.5";
+  for(i=1; i<argc; i++)
+  {
+    string opt = argv[i];
+    if(opt=="--exclude" && i+1<argc)
+      excludefile = argv[++i];
+    else if(opt=="--threads" && i+1<argc)
+      threads = atoi(argv[++i]);
+    else if(opt=="--biallelic")
+      biallelic = true;
+    else if(opt=="--maf-bins" && i+1<argc)
+      mafbins = argv[++i];
+    else if(opt=="--pop" && i+1<argc)
+      popfiles.push_back(argv[++i]);
+    else if(opt=="--fst" && i+1<argc)
+      fstpairs = argv[++i];
+    else if(opt=="--fst-out" && i+1<argc)
+      fstfile = argv[++i];
+    else if(opt=="--binary" && i+1<argc)
+      binaryfile = argv[++i];
+    else if(opt=="--permutations" && i+1<argc)
+      replicates.permutations = atoi(argv[++i]);
+    else if(opt=="--bootstrap" && i+1<argc)
+      replicates.bootstraps = atoi(argv[++i]);
+    else if(opt=="--seed" && i+1<argc)
+      replicates.seed = strtoull(argv[++i], NULL, 10);
+    else if(opt=="--bams" && i+1<argc)
+      bamlist = argv[++i];
+    else if(opt=="--sites" && i+1<argc)
+      sitesfile = argv[++i];
+    else if(opt=="--metrics" && i+1<argc)
+      metricsfile = argv[++i];
+    else if(opt=="--progress" && i+1<argc)
+      progress = atof(argv[++i]);
+    else
+      args.push_back(opt);
+  }
+  if((args.size()!=5 && args.size()!=6) || (bamlist!="") != (sitesfile!="") || (bamlist!="" && args.size()!=5))
+  {
+    cout << "Usage: "<<argv[0]<<" windowsize mindepth maxdepth popfile1 popfile2 [input.vcf.gz|input.bcf] [--threads N] [--biallelic] [--exclude excluded.snps.list] [--maf-bins e0,e1,...]\n";
+    cout << "       [--pop popfile3 ...] [--fst I:J,... --fst-out fst.out] [--binary windows.bin] [--permutations N] [--bootstrap N] [--seed S]\n";
+    cout << "       [--progress S] [--metrics metrics.json]\n";
+    cout << "       "<<argv[0]<<" windowsize mindepth maxdepth popfile1 popfile2 --bams bam.list --sites known.sites [options]\n";
+    cout << "  Without an input file the VCF is read from stdin.\n";
+    cout << "  windowsize is SIZE[:STEP][,SIZE[:STEP]...]: several window layouts, e.g. 100000,100000:50000,\n";
+    cout << "                computed in one pass (SIZE a multiple of STEP); with more than one layout\n";
+    cout << "                each row also gives WindowSize and Step\n";
+    cout << "  --threads N   scan N chunks in parallel when the input file is indexed (.tbi/.csi),\n";
+    cout << "                otherwise use N extra threads for BGZF decompression\n";
+    cout << "  --biallelic   keep only sites with exactly two alleles (vcftools --min-alleles 2 --max-alleles 2)\n";
+    cout << "  --exclude F   skip the sites listed in F, one 'chromosome position' per line (vcftools --exclude-positions),\n";
+    cout << "                the intervals of F if it ends in .bed, or the mask F written by build_position_mask\n";
+    cout << "  --maf-bins E  increasing MAF bin edges (default 0,0.05,...,0.5); sites outside them are not counted\n";
+    cout << "  --pop F       one more population sample list (repeatable); popfile1 and popfile2 are populations 1 and 2\n";
+    cout << "  --fst I:J,... population pairs for windowed Weir & Cockerham FST (default with --fst-out: all pairs)\n";
+    cout << "  --fst-out F   write the FST windows to F: weighted FST (sum a / sum a+b+c) and mean per-site FST\n";
+    cout << "  --binary F    write the window statistics to F as binary columns instead of TSV on stdout;\n";
+    cout << "                dump_window_columns F prints the TSV\n";
+    cout << "  --permutations N  per window and MAF bin, permute the samples between populations 1 and 2 N times\n";
+    cout << "                and add PermP, the two-sided p-value of the HetRatio1-HetRatio2 difference\n";
+    cout << "  --bootstrap N resample the samples of each population N times and add DiffLow/DiffHigh,\n";
+    cout << "                the 95% percentile interval of the HetRatio1-HetRatio2 difference\n";
+    cout << "  --seed S      random seed of the permutations and bootstrap samples (default 1); the results\n";
+    cout << "                do not depend on --threads\n";
+    cout << "  --bams F      genotype the known sites by a pileup of the indexed BAMs listed in F (filter_bam's\n";
+    cout << "                <id>.pass.sorted.bam, <id> being the sample name) instead of reading a VCF; --threads\n";
+    cout << "                scans that many regions at once\n";
+    cout << "  --sites F     the known biallelic SNPs, 'chromosome position REF ALT' per line (or a VCF); a sample is\n";
+    cout << "                het when both alleles have at least 20% of its REF+ALT reads, and its depth is the\n";
+    cout << "                number of bases with quality >= 13\n";
+    cout << "  --progress S  every S seconds print the elapsed time, sites read, sites/s, peak RSS and the time spent\n";
+    cout << "                reading, genotyping, writing windows and testing to stderr\n";
+    cout << "  --metrics F   write these timers and counters at the end of the run to F as JSON\n";
+    return 0;
+  }
+  vector<vector<string> > pop_individuals;
+  ofstream fstout;
+  WindowColumnsWriter columns;
+  WindowOutput output = {&cout, NULL};
+  ScanOptions options;
+  PositionMask excluded;
+  SiteScanner scanner;
+  unordered_map<string,long> contiglengths;
+  string linedata;
+
+  if(!ParseWindowSpecs(args[0], options.windows))
+  {
+    cerr << "Error: bad window layout " << args[0] << ", expected SIZE[:STEP][,SIZE[:STEP]...] with SIZE a multiple of STEP" << endl;
+    return 1;
+  }
+  if(!ParseMafBins(mafbins, options.bins))
+  {
+    cerr << "Error: bad MAF bin edges " << mafbins << ", expected at least two increasing values" << endl;
+    return 1;
+  }
+  options.mindepth = atoi(args[1].c_str());
+  options.maxdepth = atoi(args[2].c_str());
+  options.biallelic = biallelic;
+  options.excluded = NULL;
+
+  popfiles.insert(popfiles.begin(), args.begin()+3, args.begin()+5);
+  options.popnames = popfiles;
+  for(const string &popfile : popfiles)
+    pop_individuals.push_back(LoadFileLinesIntoVector(popfile));
+  if(fstpairs!="" && fstfile=="")
+  {
+    cerr << "Error: --fst needs --fst-out" << endl;
+    return 1;
+  }
+  if(fstpairs!="" && !ParseFstPairs(fstpairs, popfiles.size(), options.fstpairs))
+  {
+    cerr << "Error: bad population pairs " << fstpairs << ", expected I:J[,I:J...] with 1 <= I,J <= " << popfiles.size() << endl;
+    return 1;
+  }
+  if(fstfile!="" && fstpairs=="")
+  {
+    for(i=0; i<popfiles.size(); i++)
+      for(int j=i+1; j<popfiles.size(); j++)
+        options.fstpairs.push_back(make_pair(i, j));
+  }
+  if(fstfile!="")
+  {
+    fstout.open(fstfile.c_str());
+    if(!fstout)
+    {
+      cerr << "Error: could not write " << fstfile << endl;
+      return 1;
+    }
+  }
+  if(excludefile!="")
+  {
+    string error;
+    if(!LoadPositionMask(excludefile, excluded, error))
+    {
+      cerr << "Error: " << error << endl;
+      return 1;
+    }
+    options.excluded = &excluded;
+  }
+
+  // With --bams the samples are the BAMs, in list order, and the chunks follow the BAM header
+  vector<string> bamfiles;
+  PileupSites pileupsites;
+  vector<string> seqnames;
+  vector<hts_idx_t*> bamindexes;
+  htsThreadPool pool = {NULL, 0};
+  int pileupthreads = 1;
+  if(bamlist!="")
+  {
+    bamfiles = LoadFileLinesIntoVector(bamlist);
+    if(bamfiles.empty() || !LoadPileupSites(sitesfile, pileupsites))
+    {
+      cerr << "Error: could not read " << (bamfiles.empty() ? bamlist : sitesfile) << endl;
+      return 1;
+    }
+    // Checked before any BAM is opened, so that a run does not fail on the file limit partway
+    rlim_t filelimit;
+    pileupthreads = FitPileupThreads(bamfiles.size(), max(1, threads), filelimit);
+    if(pileupthreads<1)
+    {
+      cerr << "Error: " << bamfiles.size() << " BAMs need " << bamfiles.size()+PILEUP_RESERVED_FILES << " open files, but the limit is "
+           << filelimit << "; raise it with ulimit -n" << endl;
+      return 1;
+    }
+    if(pileupthreads<max(1, threads))
+      cerr << "Warning: the open file limit " << filelimit << " allows " << pileupthreads << " pileup threads of " << bamfiles.size()
+           << " BAMs each, instead of " << threads << "; raise it with ulimit -n for more" << endl;
+    string failed;
+    if(!LoadPileupIndexes(bamfiles, bamindexes, failed))
+    {
+      cerr << "Error: could not open " << failed << " with its index" << endl;
+      return 1;
+    }
+    PileupInput input;
+    if(!OpenPileupInput(bamfiles[0], bamindexes[0], &pool, input))
+    {
+      cerr << "Error: could not open " << bamfiles[0] << endl;
+      return 1;
+    }
+    for(i=0; i<input.hdr->n_targets; i++)
+    {
+      seqnames.push_back(input.hdr->target_name[i]);
+      contiglengths[input.hdr->target_name[i]] = input.hdr->target_len[i];
+    }
+    ClosePileupInput(input);
+    linedata = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for(const string &bamfile : bamfiles)
+      linedata += "\t" + PileupSampleName(bamfile);
+    if(threads>1)
+      pool.pool = hts_tpool_init(threads);
+  }
+
+  // The input file is opened through htslib: BCF records are decoded with bcf_read, text VCF
+  // (plain or bgzipped) lines go through the same in-place parser as stdin
+  htsFile *fp = NULL;
+  bcf_hdr_t *hdr = NULL;
+  kstring_t line = {0, 0, NULL};
+  bool isbcf = false;
+  if(args.size()==6)
+  {
+    fp = hts_open(args[5].c_str(), "r");
+    if(fp == NULL)
+    {
+      cerr << "Error: could not open " << args[5] << endl;
+      return 1;
+    }
+    isbcf = hts_get_format(fp)->format == bcf;
+  }
+
+  // With an index, --threads splits the genome into window-aligned chunks scanned in parallel
+  IndexedInput indexed = IndexedInput{};
+  if(fp != NULL && threads>1)
+    OpenIndexedInput(args[5], isbcf, indexed);
+  if(fp != NULL && threads>0 && indexed.fp == NULL)
+    hts_set_threads(fp, threads);
+
+  if(isbcf)
+  {
+    hdr = bcf_hdr_read(fp);
+    if(hdr == NULL)
+    {
+      cerr << "Error: could not read the header of " << args[5] << endl;
+      return 1;
+    }
+    linedata = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for(i=0; i<bcf_hdr_nsamples(hdr); i++)
+      linedata += string("\t") + bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, i);
+    if(indexed.fp)
+    {
+      kstring_t text = {0, 0, NULL};
+      vector<string_view> headerlines;
+      bcf_hdr_format(hdr, 0, &text);
+      SplitStringView(string_view(text.s, text.l), '\n', headerlines);
+      for(auto headerline : headerlines)
+        ParseContigLength(headerline, contiglengths);
+      free(text.s);
+    }
+  }
+  else if(bamlist=="")
+  {
+    ios::sync_with_stdio(false);
+    while(true)
+    {
+        if(fp)
+        {
+            if(hts_getline(fp, KS_SEP_LINE, &line) < 0)
+                break;
+            linedata.assign(line.s, line.l);
+        }
+        else if(!getline(cin,linedata))
+            break;
+        if(linedata.find("#CHROM",0)==0)
+            break;
+        ParseContigLength(linedata, contiglengths);
+    }
+  }
+  for(auto &individuals : pop_individuals)
+    options.popcolumns.push_back(FindSamplesInVCFHeader(linedata, individuals));
+  options.replicates = NULL;
+  if(replicates.permutations>0 || replicates.bootstraps>0)
+  {
+    replicates.threads = threads>0 ? threads : 1;
+    MakeReplicates(replicates, options.popcolumns[0].size(), options.popcolumns[1].size());
+    options.replicates = &replicates;
+  }
+
+  if(binaryfile!="")
+  {
+    InitWindowColumns(columns, options, args[0]);
+    output.binary = &columns;
+  }
+  else
+    cout << WindowHeader(options) << "\n";
+  // Without --progress and --metrics g_run_metrics stays NULL and the timers are a single test
+  RunMetrics metrics;
+  if(metricsfile!="" || progress>0)
+    StartRunMetrics(metrics, METRICS_STAGES, "sites", progress);
+  if(fstout.is_open())
+    fstout << "Chr\tPosition" << (options.windows.size()>1 ? "\tWindowSize\tStep" : "") << "\tPopA\tPopB\tSites\tWeightedFST\tMeanFST\n";
+
+  if(bamlist!="")
+  {
+    vector<ScanChunk> chunks = MakeScanChunks(seqnames, contiglengths, options);
+    bool ok = RunPileupChunks(bamfiles, bamindexes, pileupsites, &pool, options, chunks, pileupthreads, output, fstout.is_open() ? &fstout : NULL);
+    if(pool.pool)
+      hts_tpool_destroy(pool.pool);
+    DestroyPileupIndexes(bamindexes);
+    if(!ok)
+    {
+      cerr << "Error: could not open the BAMs of " << bamlist << endl;
+      return 1;
+    }
+  }
+  else if(indexed.fp)
+  {
+    vector<ScanChunk> chunks = MakeScanChunks(IndexedSeqnames(indexed), contiglengths, options);
+    CloseIndexedInput(indexed);
+    if(!RunIndexedChunks(args[5], isbcf, options, chunks, threads, output, fstout.is_open() ? &fstout : NULL))
+    {
+      cerr << "Error: could not open " << args[5] << " with its index" << endl;
+      return 1;
+    }
+  }
+  else
+  {
+    InitScanner(scanner, options, &output, fstout.is_open() ? &fstout : NULL, 0, 0);
+    if(isbcf)
+    {
+      bcf1_t *rec = bcf_init();
+      while( ReadBcfRecord(fp, hdr, rec) )
+        ScanBcfRecord(scanner, hdr, rec);
+      bcf_destroy(rec);
+    }
+    else
+    {
+      while( ReadVcfLine(fp, line, linedata) )
+        ScanVcfLine(scanner, fp ? string_view(line.s, line.l) : string_view(linedata));
+    }
+    FinishScanner(scanner);
+  }
+
+  if(binaryfile!="")
+  {
+    StageTimer timer(STAGE_FLUSH);
+    if(!WriteWindowColumns(columns, binaryfile))
+    {
+      cerr << "Error: could not write " << binaryfile << endl;
+      return 1;
+    }
+  }
+  if(g_run_metrics)
+  {
+    StopRunMetrics(metrics);
+    if(metricsfile!="" && !WriteRunMetrics(metrics, "xie_unphased_vcf_for_heterozygote_stat", metricsfile))
+    {
+      cerr << "Error: could not write " << metricsfile << endl;
+      return 1;
+    }
+  }
+
+  if(hdr != NULL)
+    bcf_hdr_destroy(hdr);
+  free(line.s);
+  if(fp != NULL)
+    hts_close(fp);
+  return 1;
+}